@@ -27,40 +27,16 @@
  * authors and should not be interpreted as representing official policies, either expressed
  * or implied, of Moe Wheatley.
  */
+#include <algorithm>
 #include <cmath>
-#ifndef _MSC_VER
-#include <sys/time.h>
-#else
-#include <Windows.h>
-#include <winsock.h>
-#include <cstdint>
-
-int gettimeofday(struct timeval * tp, struct timezone * tzp)
-{
-    // Note: some broken versions only have 8 trailing zero's, the correct epoch has 9 trailing zero's
-    static const uint64_t EPOCH = ((uint64_t) 116444736000000000ULL);
-
-    SYSTEMTIME  system_time;
-    FILETIME    file_time;
-    uint64_t    time;
-
-    GetSystemTime( &system_time );
-    SystemTimeToFileTime( &system_time, &file_time );
-    time =  ((uint64_t)file_time.dwLowDateTime )      ;
-    time += ((uint64_t)file_time.dwHighDateTime) << 32;
-
-    tp->tv_sec  = (long) ((time - EPOCH) / 10000000L);
-    tp->tv_usec = (long) (system_time.wMilliseconds * 1000);
-    return 0;
-}
-
-#endif
 
 #include <QColor>
 #include <QDateTime>
+#include <QScreen>
 #include <QDebug>
 #include <QFont>
 #include <QPainter>
+#include <QStaticText>
 #include <QtGlobal>
 #include <QToolTip>
 #include "Plotter.h"
@@ -71,6 +47,11 @@ int gettimeofday(struct timeval * tp, struct timezone * tzp)
 
 #define CUR_CUT_DELTA 5		//cursor capture delta in pixels
 
+#define HOR_MARGIN 5
+#define VER_MARGIN 5
+
+#define PLOTTER_LABEL_CACHE_SIZE 256
+
 #define FFT_MIN_DB     -160.f
 #define FFT_MAX_DB      0.f
 
@@ -95,16 +76,6 @@ static inline bool out_of_range(float min, float max)
             max < min + 10.f);
 }
 
-/** Current time in milliseconds since Epoch */
-static inline quint64 time_ms(void)
-{
-    struct timeval  tval;
-
-    gettimeofday(&tval, NULL);
-
-    return 1e3 * tval.tv_sec + 1e-3 * tval.tv_usec;
-}
-
 #define STATUS_TIP \
     "Click, drag or scroll on spectrum to tune. " \
     "Drag and scroll X and Y axes for pan and zoom. " \
@@ -123,29 +94,6 @@ CPlotter::CPlotter(QWidget *parent) : QFrame(parent)
     setTooltipsEnabled(false);
     setStatusTip(tr(STATUS_TIP));
 
-    // default waterfall color scheme
-    for (int i = 0; i < 256; i++)
-    {
-        // level 0: black background
-        if (i < 20)
-            m_ColorTbl[i].setRgb(0, 0, 0);
-        // level 1: black -> blue
-        else if ((i >= 20) && (i < 70))
-            m_ColorTbl[i].setRgb(0, 0, 140*(i-20)/50);
-        // level 2: blue -> light-blue / greenish
-        else if ((i >= 70) && (i < 100))
-            m_ColorTbl[i].setRgb(60*(i-70)/30, 125*(i-70)/30, 115*(i-70)/30 + 140);
-        // level 3: light blue -> yellow
-        else if ((i >= 100) && (i < 150))
-            m_ColorTbl[i].setRgb(195*(i-100)/50 + 60, 130*(i-100)/50 + 125, 255-(255*(i-100)/50));
-        // level 4: yellow -> red
-        else if ((i >= 150) && (i < 250))
-            m_ColorTbl[i].setRgb(255, 255-255*(i-150)/100, 0);
-        // level 5: red -> white
-        else if (i >= 250)
-            m_ColorTbl[i].setRgb(255, 255*(i-250)/5, 255*(i-250)/5);
-    }
-
     m_PeakHoldActive = false;
     m_PeakHoldValid = false;
 
@@ -181,9 +129,20 @@ CPlotter::CPlotter(QWidget *parent) : QFrame(parent)
     m_CursorCaptured = NOCAP;
     m_Running = false;
     m_DrawOverlay = true;
-    m_2DPixmap = QPixmap(0,0);
-    m_OverlayPixmap = QPixmap(0,0);
-    m_WaterfallPixmap = QPixmap(0,0);
+    m_ViewDirty = true;
+    m_PeakHoldResets = 0;
+    m_WaterfallClears = 0;
+    m_GridLayer = QImage();
+    m_FilterLayer = QImage();
+    m_FilterRect = QRect();
+    m_ShownTraceRect = QRect();
+    m_ShownLines = 0;
+    m_ShownGeneration = 0;
+    m_ShownHistoryKey = 0;
+    m_FontHeight = 0;
+    m_GridLeft = 0;
+    m_LevelLabelWidth = 0;
+    m_LabelGap = 0;
     m_Size = QSize(0,0);
     m_GrabPosition = 0;
     m_Percent2DScreen = 30;	//percent of screen used for 2D display
@@ -192,23 +151,44 @@ CPlotter::CPlotter(QWidget *parent) : QFrame(parent)
 
     m_FreqDigits = 3;
 
-    m_Peaks = QMap<int,int>();
     setPeakDetection(false, 2);
+    m_Detector = SPECTRUM_STAT_MAX;
     m_PeakHoldValid = false;
 
     setFftPlotColor(QColor(0xFF,0xFF,0xFF,0xFF));
     setFftFill(false);
 
     // always update waterfall
-    tlast_wf_ms = 0;
     msec_per_wfline = 0;
     wf_span = 0;
     fft_rate = 15;
-    memset(m_wfbuf, 255, MAX_SCREENSIZE);
+
+    // Data may arrive at any rate, the screen is redrawn from a timer
+    m_DrawCount = 0;
+    m_FpsDraws = 0;
+    m_DrawFps = 0;
+    m_RefreshTimer.setTimerType(Qt::PreciseTimer);
+    connect(&m_RefreshTimer, &QTimer::timeout, this, &CPlotter::onRefresh);
+
+    // Pictures are drawn on the renderer thread and only blitted here
+    m_Source = nullptr;
+    m_PushSequence = 0;
+    m_SourceRate = 0;
+    m_SourceFftSize = 0;
+    m_SourceHop = 0;
+    m_Renderer.setSource(&m_PushFrames);
+    m_History = nullptr;
+    m_HistoryEnd = 0;
+    m_HistorySpan = 0;
+    connect(&m_Renderer, &plot_renderer::frameRendered, this, &CPlotter::onFrameRendered);
+    m_Renderer.start();
 }
 
 CPlotter::~CPlotter()
 {
+    // m_PushFrames goes before m_Renderer, so stop reading it first
+    m_Renderer.stop();
+    m_Renderer.wait();
 }
 
 QSize CPlotter::minimumSizeHint() const
@@ -227,7 +207,7 @@ void CPlotter::mouseMoveEvent(QMouseEvent* event)
     QPoint pt = event->pos(); 
 
     /* mouse enter / mouse leave events */
-    if (m_OverlayPixmap.rect().contains(pt))
+    if (m_GridLayer.rect().contains(pt))
     {
         //is in Overlay bitmap region
         if (event->buttons() == Qt::NoButton)
@@ -307,10 +287,14 @@ void CPlotter::mouseMoveEvent(QMouseEvent* event)
                     m_CursorCaptured = NOCAP;
                 }
                 if (m_TooltipsEnabled)
+                {
+                    // over a detected peak the tooltip shows the peak
+                    int peak = m_PeakDetection > 0 ? getNearestPeak(pt) : -1;
                     QToolTip::showText(event->globalPos(),
-                                       QString("F: %1 kHz")
-                                       .arg(freqFromX(pt.x())/1.e3f, 0, 'f', 3),
+                                       QString(peak != -1 ? "Peak: %1 kHz" : "F: %1 kHz")
+                                       .arg(freqFromX(peak != -1 ? peak : pt.x())/1.e3f, 0, 'f', 3),
                                        this);
+                }
             }
             m_GrabPosition = 0;
         }
@@ -347,7 +331,7 @@ void CPlotter::mouseMoveEvent(QMouseEvent* event)
             // move Y scale up/down
             float delta_px = m_Yzero - pt.y();
             float delta_db = delta_px * fabs(m_PandMindB - m_PandMaxdB) /
-                    (float)m_OverlayPixmap.height();
+                    (float)m_GridLayer.height();
             m_PandMindB -= delta_db;
             m_PandMaxdB -= delta_db;
             if (out_of_range(m_PandMindB, m_PandMaxdB))
@@ -377,7 +361,7 @@ void CPlotter::mouseMoveEvent(QMouseEvent* event)
             setCursor(QCursor(Qt::ClosedHandCursor));
             // pan viewable range or move center frequency
             int delta_px = m_Xzero - pt.x();
-            qint64 delta_hz = delta_px * m_Span / m_OverlayPixmap.width();
+            qint64 delta_hz = delta_px * m_Span / m_GridLayer.width();
             if (event->buttons() & Qt::MiddleButton)
             {
                 m_CenterFreq += delta_hz;
@@ -389,6 +373,7 @@ void CPlotter::mouseMoveEvent(QMouseEvent* event)
                 setFftCenterFreq(m_FftCenter + delta_hz);
             }
             updateOverlay();
+            zoomRangeMoved();
 
             m_PeakHoldValid = false;
 
@@ -504,15 +489,17 @@ void CPlotter::mouseMoveEvent(QMouseEvent* event)
 
 int CPlotter::getNearestPeak(QPoint pt)
 {
-    QMap<int, int>::const_iterator i = m_Peaks.lowerBound(pt.x() - PEAK_CLICK_MAX_H_DISTANCE);
-    QMap<int, int>::const_iterator upperBound = m_Peaks.upperBound(pt.x() + PEAK_CLICK_MAX_H_DISTANCE);
+    // peaks are sorted by x, only the few within reach are looked at
+    const std::vector<QPoint> &peaks = shownImage().peaks;
+    auto i = std::lower_bound(peaks.begin(), peaks.end(), pt.x() - PEAK_CLICK_MAX_H_DISTANCE,
+                              [](const QPoint &peak, int x) { return peak.x() < x; });
     float   dist = 1.0e10;
     int     best = -1;
 
-    for ( ; i != upperBound; i++)
+    for ( ; i != peaks.end() && i->x() <= pt.x() + PEAK_CLICK_MAX_H_DISTANCE; i++)
     {
-        int x = i.key();
-        int y = i.value();
+        int x = i->x();
+        int y = i->y();
 
         if (abs(y - pt.y()) > PEAK_CLICK_MAX_V_DISTANCE)
             continue;
@@ -532,14 +519,25 @@ int CPlotter::getNearestPeak(QPoint pt)
 void CPlotter::setWaterfallSpan(quint64 span_ms)
 {
     wf_span = span_ms;
-    msec_per_wfline = wf_span / m_WaterfallPixmap.height();
+    msec_per_wfline = waterfallHeight() > 0 ? wf_span / waterfallHeight() : 0;
     clearWaterfall();
 }
 
 void CPlotter::clearWaterfall()
 {
-    m_WaterfallPixmap.fill(Qt::black);
-    memset(m_wfbuf, 255, MAX_SCREENSIZE);
+    m_WaterfallClears++;
+    viewChanged();
+}
+
+/**
+ * The waterfall is a ring of lines, the shown picture's waterfallRow holds
+ * the newest one and older lines follow below it, wrapping at the bottom.
+ * Returns it unrolled with the newest line on top.
+ */
+QImage CPlotter::waterfallImage() const
+{
+    const plot_image &image = shownImage();
+    return plot_renderer::unrollWaterfall(image.waterfall, image.waterfallRow);
 }
 
 /**
@@ -550,9 +548,50 @@ void CPlotter::clearWaterfall()
  * We assume that frequency strings are up to date
  */
 bool CPlotter::saveWaterfall(const QString & filename) const
+{
+    const plot_image &image = shownImage();
+    if (!image.history.isNull())
+        return saveWaterfallImage(filename, image.history, image.historyEnd,
+                                  (double)image.historySpan / image.history.height());
+
+    return saveWaterfallImage(filename, waterfallImage(), image.lastLineMs,
+                              msec_per_wfline > 0 ? (double)msec_per_wfline : 1000.0 / fft_rate);
+}
+
+/**
+ * @brief Save a time range of the waterfall history to a graphics file
+ * @param filename
+ * @param from Start of the range in ms since epoch.
+ * @param to End of the range in ms since epoch, exclusive.
+ * @param lines Height of the picture, 0 for one line per stored line.
+ * @return TRUE if the save successful, FALSE if an erorr occurred.
+ *
+ * The range is drawn over the shown frequency range at the plotter width,
+ * lines that share a picture line are combined with the detector.
+ */
+bool CPlotter::saveWaterfall(const QString & filename, qint64 from, qint64 to, int lines) const
+{
+    int w = m_Size.width();
+    if (!m_History || to <= from || w <= 0)
+        return false;
+
+    if (lines <= 0)
+        lines = m_History->linesBetween(from, to);
+    lines = qBound(1, lines, PLOTTER_EXPORT_MAX_LINES);
+
+    std::vector<float> db;
+    qint64 start = m_CenterFreq + m_FftCenter - m_Span / 2;
+    if (!m_History->render(from, to, start, start + m_Span, w, lines, m_Detector, db))
+        return false;
+
+    return saveWaterfallImage(filename, plot_renderer::colorWaterfall(db, w, lines, m_WfMindB, m_WfMaxdB),
+                              to, (double)(to - from) / lines);
+}
+
+// Frequency and time axes over a waterfall picture with the newest line on top
+bool CPlotter::saveWaterfallImage(const QString &filename, QImage pixmap, qint64 newestMs, double msPerLine) const
 {
     QBrush          axis_brush(QColor(0x00, 0x00, 0x00, 0x70), Qt::SolidPattern);
-    QPixmap         pixmap(m_WaterfallPixmap);
     QPainter        painter(&pixmap);
     QRect           rect;
     QDateTime       tt;
@@ -598,10 +637,7 @@ bool CPlotter::saveWaterfall(const QString & filename) const
     for (i = 1; i < tdivs; i++)
     {
         y = (int)((float)i * pixperdiv);
-        if (msec_per_wfline > 0)
-            msec =  tlast_wf_ms - y * msec_per_wfline;
-        else
-            msec =  tlast_wf_ms - y * 1000 / fft_rate;
+        msec = newestMs - (qint64)(y * msPerLine);
 
         tt.setMSecsSinceEpoch(msec);
         rect.setRect(0, y - font_metrics.height(), wya - 5, font_metrics.height());
@@ -611,16 +647,49 @@ bool CPlotter::saveWaterfall(const QString & filename) const
         painter.drawText(rect, Qt::AlignRight|Qt::AlignVCenter, tt.toString("hh:mm:ss"));
     }
 
+    painter.end();
     return pixmap.save(filename, 0, -1);
 }
 
+/**
+ * Read the waterfall history from a store, which must outlive the plotter
+ * or be unset first. Scrolling back with Alt and the wheel over the
+ * waterfall, or showWaterfallHistory(), shows stored lines.
+ */
+void CPlotter::setWaterfallHistory(waterfall_history *history)
+{
+    m_History = history;
+    m_Renderer.setHistory(history);
+    showWaterfallHistory(0);
+}
+
+/**
+ * Show the stored waterfall of spanMs (0 for the span of the live one) up
+ * to endMs in ms since epoch, instead of the live waterfall. Lines and
+ * frequencies that share a pixel are combined with the detector. An endMs
+ * of 0 goes back to the live waterfall.
+ */
+void CPlotter::showWaterfallHistory(qint64 endMs, qint64 spanMs)
+{
+    m_HistoryEnd = m_History ? qMax((qint64)0, endMs) : 0;
+    m_HistorySpan = spanMs > 0 ? spanMs : liveWaterfallSpan();
+    viewChanged();
+}
+
+// Time covered by the live waterfall
+qint64 CPlotter::liveWaterfallSpan() const
+{
+    qint64 h = qMax(1, waterfallHeight());
+    return msec_per_wfline > 0 ? (qint64)msec_per_wfline * h : h * 1000 / qMax(1, fft_rate);
+}
+
 /** Get waterfall time resolution in milleconds / line. */
 quint64 CPlotter::getWfTimeRes(void)
 {
     if (msec_per_wfline)
         return msec_per_wfline;
     else
-        return 1000 * fft_rate / m_WaterfallPixmap.height(); // Auto mode
+        return 1000 * fft_rate / qMax(1, waterfallHeight()); // Auto mode
 }
 
 void CPlotter::setFftRate(int rate_hz)
@@ -725,7 +794,7 @@ void CPlotter::mouseReleaseEvent(QMouseEvent * event)
 {
     QPoint pt = event->pos();
 
-    if (!m_OverlayPixmap.rect().contains(pt))
+    if (!m_GridLayer.rect().contains(pt))
     {
         // not in Overlay region
         if (NOCAP != m_CursorCaptured)
@@ -759,7 +828,7 @@ void CPlotter::zoomStepX(float step, int x)
                              (float)(m_SampleFreq) * 10.0f);
 
     // Frequency where event occured is kept fixed under mouse
-    float ratio = (float)x / (float)m_OverlayPixmap.width();
+    float ratio = (float)x / (float)m_GridLayer.width();
     float fixed_hz = freqFromX(x);
     float f_max = fixed_hz + (1.0 - ratio) * new_range;
     float f_min = f_max - new_range;
@@ -776,6 +845,12 @@ void CPlotter::zoomStepX(float step, int x)
     m_PeakHoldValid = false;
 }
 
+// The shown range moved without a zoom step, the zoom level stays
+void CPlotter::zoomRangeMoved()
+{
+    emit newZoomLevel((float)m_SampleFreq / (float)m_Span);
+}
+
 // Zoom on X axis (absolute level)
 void CPlotter::zoomOnXAxis(float level)
 {
@@ -797,9 +872,9 @@ void CPlotter::wheelEvent(QWheelEvent * event)
         // Vertical zoom. Wheel down: zoom out, wheel up: zoom in
         // During zoom we try to keep the point (dB or kHz) under the cursor fixed
         float zoom_fac = event->angleDelta().manhattanLength() < 0 ? 1.1 : 0.9;
-        float ratio = (float)pt.y() / (float)m_OverlayPixmap.height();
+        float ratio = (float)pt.y() / (float)m_GridLayer.height();
         float db_range = m_PandMaxdB - m_PandMindB;
-        float y_range = (float)m_OverlayPixmap.height();
+        float y_range = (float)m_GridLayer.height();
         float db_per_pix = db_range / y_range;
         float fixed_db = m_PandMaxdB - pt.y() * db_per_pix;
 
@@ -817,6 +892,22 @@ void CPlotter::wheelEvent(QWheelEvent * event)
     {
         zoomStepX(event->angleDelta().manhattanLength() < 0 ? 1.1 : 0.9, pt.x());
     }
+    else if ((event->modifiers() & Qt::AltModifier) && m_History && pt.y() >= m_GridLayer.height())
+    {
+        // Scroll the waterfall back in time by a quarter of its height per
+        // step, back at the newest line it is live again. Some platforms
+        // turn the wheel horizontal while Alt is held.
+        qint64 first, last;
+        if (m_History->timeRange(&first, &last))
+        {
+            QPoint delta = event->angleDelta();
+            int steps = (delta.y() ? delta.y() : delta.x()) / 120;
+            qint64 span = m_HistoryEnd ? m_HistorySpan : liveWaterfallSpan();
+            qint64 end = (m_HistoryEnd ? m_HistoryEnd : last + 1) - steps * span / 4;
+            end = qMax(end, first + 1);
+            showWaterfallHistory(end > last ? 0 : end, span);
+        }
+    }
     else if (event->modifiers() & Qt::ControlModifier)
     {
         // filter width
@@ -853,255 +944,229 @@ void CPlotter::resizeEvent(QResizeEvent* )
 
     if (m_Size != size())
     {
-        // if changed, resize pixmaps to new screensize
+        // if changed, resize the layers to the new screensize, the
+        // renderer resizes its pictures when it gets the new view
         int     fft_plot_height;
 
         m_Size = size();
         fft_plot_height = m_Percent2DScreen * m_Size.height() / 100;
-        m_OverlayPixmap = QPixmap(m_Size.width(), fft_plot_height);
-        m_OverlayPixmap.fill(Qt::black);
-        m_2DPixmap = QPixmap(m_Size.width(), fft_plot_height);
-        m_2DPixmap.fill(Qt::black);
-
-        int height = (100 - m_Percent2DScreen) * m_Size.height() / 100;
-        if (m_WaterfallPixmap.isNull())
-        {
-            m_WaterfallPixmap = QPixmap(m_Size.width(), height);
-            m_WaterfallPixmap.fill(Qt::black);
-        }
-        else
-        {
-            m_WaterfallPixmap = m_WaterfallPixmap.scaled(m_Size.width(), height,
-                                                         Qt::IgnoreAspectRatio,
-                                                         Qt::SmoothTransformation);
-        }
+        m_GridLayer = QImage(m_Size.width(), fft_plot_height, QImage::Format_RGB32);
+        m_GridLayer.fill(Qt::black);
+        m_FilterLayer = QImage(m_Size.width(), fft_plot_height, QImage::Format_ARGB32_Premultiplied);
+        m_FilterLayer.fill(Qt::transparent);
+        m_FilterRect = QRect();
+        m_GridKey = grid_key();
+        m_FilterKey = filter_key();
+        m_ShownTraceRect = QRect();
+        update();
 
         m_PeakHoldValid = false;
 
         if (wf_span > 0)
-            msec_per_wfline = wf_span / height;
-        memset(m_wfbuf, 255, MAX_SCREENSIZE);
+            msec_per_wfline = wf_span / qMax(1, waterfallHeight());
     }
 
     drawOverlay();
+    viewChanged();
 }
 
-// Called by QT when screen needs to be redrawn
-void CPlotter::paintEvent(QPaintEvent *)
+// Called by QT when screen needs to be redrawn. Only the damaged region is
+// composed: grid, filter box and trace, then the waterfall.
+void CPlotter::paintEvent(QPaintEvent *event)
 {
     QPainter painter(this);
+    const plot_image &image = shownImage();
 
-    painter.drawPixmap(0, 0, m_2DPixmap);
-    painter.drawPixmap(0, m_Percent2DScreen * m_Size.height() / 100,
-                       m_WaterfallPixmap);
-}
+    for (const QRect &damaged : event->region())
+    {
+        QRect r = damaged & m_GridLayer.rect();
+        if (r.isEmpty())
+            continue;
 
-// Called to update spectrum data for displaying on the screen
-void CPlotter::draw()
-{
-    int     i, n;
-    int     w;
-    int     h;
-    int     xmin, xmax;
+        painter.drawImage(r.topLeft(), m_GridLayer, r);
 
-    if (m_DrawOverlay)
-    {
-        drawOverlay();
-        m_DrawOverlay = false;
-    }
+        QRect f = r & m_FilterRect;
+        if (!f.isEmpty())
+            painter.drawImage(f.topLeft(), m_FilterLayer, f);
 
-    QPoint LineBuf[MAX_SCREENSIZE];
+        QRect t = r & image.traceRect;
+        if (!t.isEmpty())
+            painter.drawImage(t.topLeft(), image.trace, t);
+    }
 
-    if (!m_Running)
+    int y = m_Percent2DScreen * m_Size.height() / 100;
+    QRect waterfallRect(0, y, m_Size.width(), m_Size.height() - y);
+    if (!event->region().intersects(waterfallRect))
         return;
 
-    // get/draw the waterfall
-    w = m_WaterfallPixmap.width();
-    h = m_WaterfallPixmap.height();
-
-    // no need to draw if pixmap is invisible
-    if (w != 0 && h != 0)
+    if (!image.history.isNull())
     {
-        quint64     tnow_ms = time_ms();
-
-        // get scaled FFT data
-        n = qMin(w, MAX_SCREENSIZE);
-        getScreenIntegerFFTData(255, n, m_WfMaxdB, m_WfMindB,
-                                m_FftCenter - (qint64)m_Span / 2,
-                                m_FftCenter + (qint64)m_Span / 2,
-                                m_wfData, m_fftbuf,
-                                &xmin, &xmax);
-
-        if (msec_per_wfline > 0)
-        {
-            // not in "auto" mode, so accumulate waterfall data
-            for (i = 0; i < n; i++)
-            {
-                // average
-                //m_wfbuf[i] = (m_wfbuf[i] + m_fftbuf[i]) / 2;
+        painter.drawImage(QPoint(0, y), image.history);
+        return;
+    }
 
-                // peak (0..255 where 255 is min)
-                if (m_fftbuf[i] < m_wfbuf[i])
-                    m_wfbuf[i] = m_fftbuf[i];
-            }
-        }
+    if (image.waterfall.isNull())
+    {
+        painter.fillRect(waterfallRect, Qt::black);
+        return;
+    }
 
-        // is it time to update waterfall?
-        if (tnow_ms - tlast_wf_ms >= msec_per_wfline)
-        {
-            tlast_wf_ms = tnow_ms;
+    // Two blits instead of scrolling: newest line down to the bottom of the
+    // ring, then the wrapped older part below it
+    int w = image.waterfall.width();
+    int h = image.waterfall.height();
+    int row = image.waterfallRow;
+    painter.drawImage(QPoint(0, y), image.waterfall, QRect(0, row, w, h - row));
+    if (row > 0)
+        painter.drawImage(QPoint(0, y + h - row), image.waterfall, QRect(0, 0, w, row));
+}
 
-            // move current data down one line(must do before attaching a QPainter object)
-            m_WaterfallPixmap.scroll(0, 1, 0, 0, w, h);
+// Refresh timer tick, the renderer only draws if something changed since the last one
+void CPlotter::onRefresh()
+{
+    draw();
+}
 
-            QPainter painter1(&m_WaterfallPixmap);
+// A picture from the renderer is waiting, show it
+void CPlotter::onFrameRendered()
+{
+    if (!m_Renderer.output()->update())
+        return;
 
-            // draw new line of fft data at top of waterfall bitmap
-            painter1.setPen(QColor(0, 0, 0));
-            for (i = 0; i < xmin; i++)
-                painter1.drawPoint(i, 0);
-            for (i = xmax; i < w; i++)
-                painter1.drawPoint(i, 0);
+    // Stays untouched by the renderer until the next update()
+    const plot_image &image = shownImage();
 
-            if (msec_per_wfline > 0)
-            {
-                // user set time span
-                for (i = xmin; i < xmax; i++)
-                {
-                    painter1.setPen(m_ColorTbl[255 - m_wfbuf[i]]);
-                    painter1.drawPoint(i, 0);
-                    m_wfbuf[i] = 255;
-                }
-            }
-            else
-            {
-                for (i = xmin; i < xmax; i++)
-                {
-                    painter1.setPen(m_ColorTbl[255 - m_fftbuf[i]]);
-                    painter1.drawPoint(i, 0);
-                }
-            }
-        }
+    if (image.sampleRate > 0 &&
+        (image.sampleRate != m_SourceRate || image.fftSize != m_SourceFftSize || image.hop != m_SourceHop))
+    {
+        m_SourceRate = image.sampleRate;
+        m_SourceFftSize = image.fftSize;
+        m_SourceHop = image.hop;
+        emit spectrumFormatChanged(image.sampleRate, image.fftSize, image.hop);
     }
 
-    // get/draw the 2D spectrum
-    w = m_2DPixmap.width();
-    h = m_2DPixmap.height();
-
-    if (w != 0 && h != 0)
+    if (image.hasData)
     {
-        // first copy into 2Dbitmap the overlay bitmap.
-        m_2DPixmap = m_OverlayPixmap.copy(0,0,w,h);
-
-        QPainter painter2(&m_2DPixmap);
-
-// workaround for "fixed" line drawing since Qt 5
-// see http://stackoverflow.com/questions/16990326
-#if QT_VERSION >= 0x050000
-        painter2.translate(0.5, 0.5);
-#endif
-
-        // get new scaled fft data
-        getScreenIntegerFFTData(h, qMin(w, MAX_SCREENSIZE),
-                                m_PandMaxdB, m_PandMindB,
-                                m_FftCenter - (qint64)m_Span/2,
-                                m_FftCenter + (qint64)m_Span/2,
-                                m_fftData, m_fftbuf,
-                                &xmin, &xmax);
-
-        // draw the pandapter
-        painter2.setPen(m_FftColor);
-        n = xmax - xmin;
-        for (i = 0; i < n; i++)
-        {
-            LineBuf[i].setX(i + xmin);
-            LineBuf[i].setY(m_fftbuf[i + xmin]);
-        }
-
-        if (m_FftFill)
-        {
-            painter2.setBrush(QBrush(m_FftFillCol, Qt::SolidPattern));
-            if (n < MAX_SCREENSIZE-2)
-            {
-                LineBuf[n].setX(xmax-1);
-                LineBuf[n].setY(h);
-                LineBuf[n+1].setX(xmin);
-                LineBuf[n+1].setY(h);
-                painter2.drawPolygon(LineBuf, n+2);
-            }
-            else
-            {
-                LineBuf[MAX_SCREENSIZE-2].setX(xmax-1);
-                LineBuf[MAX_SCREENSIZE-2].setY(h);
-                LineBuf[MAX_SCREENSIZE-1].setX(xmin);
-                LineBuf[MAX_SCREENSIZE-1].setY(h);
-                painter2.drawPolygon(LineBuf, n);
-            }
-        }
-        else
+        m_Running = true;
+        m_DrawCount++;
+        m_FpsDraws++;
+        if (!m_FpsTimer.isValid())
+            m_FpsTimer.start();
+        else if (m_FpsTimer.elapsed() >= 1000)
         {
-            painter2.drawPolyline(LineBuf, n);
+            m_DrawFps = m_FpsDraws * 1000.0 / m_FpsTimer.restart();
+            m_FpsDraws = 0;
         }
+    }
 
-        // Peak detection
-        if (m_PeakDetection > 0)
-        {
-            m_Peaks.clear();
-
-            float   mean = 0;
-            float   sum_of_sq = 0;
-            for (i = 0; i < n; i++)
-            {
-                mean += m_fftbuf[i + xmin];
-                sum_of_sq += m_fftbuf[i + xmin] * m_fftbuf[i + xmin];
-            }
-            mean /= n;
-            float stdev= sqrt(sum_of_sq / n - mean * mean );
-
-            int lastPeak = -1;
-            for (i = 0; i < n; i++)
-            {
-                //m_PeakDetection times the std over the mean or better than current peak
-                float d = (lastPeak == -1) ? (mean - m_PeakDetection * stdev) :
-                                           m_fftbuf[lastPeak + xmin];
+    // repaint where the old or the new trace is, and the waterfall if it moved
+    QRegion damaged = QRegion(m_ShownTraceRect) | image.traceRect;
+    m_ShownTraceRect = image.traceRect;
+    if (image.waterfallLines != m_ShownLines || image.waterfallGeneration != m_ShownGeneration ||
+        image.history.cacheKey() != m_ShownHistoryKey)
+    {
+        int y = m_Percent2DScreen * m_Size.height() / 100;
+        damaged |= QRect(0, y, m_Size.width(), m_Size.height() - y);
+        m_ShownLines = image.waterfallLines;
+        m_ShownGeneration = image.waterfallGeneration;
+        m_ShownHistoryKey = image.history.cacheKey();
+    }
 
-                if (m_fftbuf[i + xmin] < d)
-                    lastPeak=i;
+    // trigger a new paintEvent
+    if (!damaged.isEmpty())
+        update(damaged);
+}
 
-                if (lastPeak != -1 &&
-                        (i - lastPeak > PEAK_H_TOLERANCE || i == n-1))
-                {
-                    m_Peaks.insert(lastPeak + xmin, m_fftbuf[lastPeak + xmin]);
-                    painter2.drawEllipse(lastPeak + xmin - 5,
-                                         m_fftbuf[lastPeak + xmin] - 5, 10, 10);
-                    lastPeak = -1;
-                }
-            }
-        }
+/**
+ * Pull spectra from an analyzer instead of having them pushed with
+ * setNewFttData(). The renderer takes the latest frame once per refresh,
+ * frames the display could not keep up with count as skipped; their peaks
+ * are already folded into the waterfall line of the frame that is shown.
+ * The source must stay alive until it is replaced or unset.
+ */
+void CPlotter::setSpectrumSource(spectrum_exchange *source)
+{
+    m_Source = source;
+    m_Renderer.setSource(source ? source : &m_PushFrames);
+    m_SourceRate = m_SourceFftSize = m_SourceHop = 0;
 
-        // Peak hold
-        if (m_PeakHoldActive)
-        {
-            for (i = 0; i < n; i++)
-            {
-                if(!m_PeakHoldValid || m_fftbuf[i] < m_fftPeakHoldBuf[i])
-                    m_fftPeakHoldBuf[i] = m_fftbuf[i];
+    if (m_Source)
+    {
+        if (m_RefreshTimer.interval() <= 0)
+            setRefreshRate(screen() ? screen()->refreshRate() : PLOTTER_DEFAULT_REFRESH_HZ);
+        m_RefreshTimer.start();
+    }
+    else if (!m_Running)
+    {
+        m_RefreshTimer.stop();
+    }
+}
 
-                LineBuf[i].setX(i + xmin);
-                LineBuf[i].setY(m_fftPeakHoldBuf[i + xmin]);
-            }
-            painter2.setPen(m_PeakHoldColor);
-            painter2.drawPolyline(LineBuf, n);
+/**
+ * Something the picture depends on changed. While the refresh timer runs
+ * the view goes to the renderer with the next tick, otherwise right away.
+ */
+void CPlotter::viewChanged()
+{
+    m_ViewDirty = true;
+    if (!m_RefreshTimer.isActive() && m_Renderer.isRunning())
+        pushView();
+}
 
-            m_PeakHoldValid = true;
-        }
+// Hand a copy of everything the renderer draws with over to it
+void CPlotter::pushView()
+{
+    plot_view view;
+
+    view.width = m_GridLayer.width();
+    view.spectrumHeight = m_GridLayer.height();
+    view.waterfallHeight = m_GridLayer.isNull() ? 0 : waterfallHeight();
+    view.sampleFreq = m_SampleFreq;
+    view.centerFreq = m_CenterFreq;
+    view.startFreq = m_FftCenter - (qint64)m_Span/2;
+    view.stopFreq = m_FftCenter + (qint64)m_Span/2;
+    view.pandMindB = m_PandMindB;
+    view.pandMaxdB = m_PandMaxdB;
+    view.wfMindB = m_WfMindB;
+    view.wfMaxdB = m_WfMaxdB;
+    view.fftColor = m_FftColor;
+    view.fftFillColor = m_FftFillCol;
+    view.peakHoldColor = m_PeakHoldColor;
+    view.fftFill = m_FftFill;
+    view.peakHold = m_PeakHoldActive;
+    view.peakDetection = m_PeakDetection;
+    view.detector = m_Detector;
+    view.msecPerLine = msec_per_wfline;
+
+    if (!m_PeakHoldValid)
+    {
+        m_PeakHoldResets++;
+        m_PeakHoldValid = true;
+    }
+    view.peakHoldResets = m_PeakHoldResets;
+    view.waterfallClears = m_WaterfallClears;
+    view.historyEnd = m_HistoryEnd;
+    view.historySpan = m_HistorySpan;
 
-      painter2.end();
+    m_Renderer.setView(view);
+    m_ViewDirty = false;
+}
 
+// Called to update spectrum data for displaying on the screen. The drawing
+// itself happens on the renderer thread, the picture arrives through
+// onFrameRendered().
+void CPlotter::draw()
+{
+    if (m_DrawOverlay)
+    {
+        m_DrawOverlay = false;
+        drawOverlay();
     }
 
-    // trigger a new paintEvent
-    update();
+    if (m_ViewDirty || !m_PeakHoldValid)
+        pushView();
+
+    m_Renderer.requestFrame();
 }
 
 /**
@@ -1112,17 +1177,9 @@ void CPlotter::draw()
  * When FFT data is set using this method, the same data will be used for both the
  * pandapter and the waterfall.
  */
-void CPlotter::setNewFttData(float *fftData, int size)
+void CPlotter::setNewFttData(const float *fftData, int size)
 {
-    /** FIXME **/
-    if (!m_Running)
-        m_Running = true;
-
-    m_wfData = fftData;
-    m_fftData = fftData;
-    m_fftDataSize = size;
-
-    draw();
+    setNewFttData(fftData, fftData, size);
 }
 
 /**
@@ -1132,123 +1189,61 @@ void CPlotter::setNewFttData(float *fftData, int size)
  * @param size The FFT size.
  *
  * This method can be used to set different FFT data set for the pandapter and the
- * waterfall.
+ * waterfall. The data is copied, so it can be called at any rate: the renderer
+ * takes the latest data at the next refresh tick, and waterfall data it has not
+ * taken yet is max-merged into the next line, so peaks are never lost. Data
+ * replaced before it was drawn counts as skipped. Ignored while a spectrum
+ * source is set.
  */
-
-void CPlotter::setNewFttData(float *fftData, float *wfData, int size)
+void CPlotter::setNewFttData(const float *fftData, const float *wfData, int size)
 {
-    /** FIXME **/
     if (!m_Running)
-        m_Running = true;
-
-    m_wfData = wfData;
-    m_fftData = fftData;
-    m_fftDataSize = size;
-
-    draw();
-}
-
-void CPlotter::getScreenIntegerFFTData(qint32 plotHeight, qint32 plotWidth,
-                                       float maxdB, float mindB,
-                                       qint64 startFreq, qint64 stopFreq,
-                                       float *inBuf, qint32 *outBuf,
-                                       int *xmin, int *xmax)
-{
-    qint32 i;
-    qint32 y;
-    qint32 x;
-    qint32 ymax = 10000;
-    qint32 xprev = -1;
-    qint32 minbin, maxbin;
-    qint32 m_BinMin, m_BinMax;
-    qint32 m_FFTSize = m_fftDataSize;
-    float *m_pFFTAveBuf = inBuf;
-    float  dBGainFactor = ((float)plotHeight) / fabs(maxdB - mindB);
-    qint32* m_pTranslateTbl = new qint32[qMax(m_FFTSize, plotWidth)];
-
-    /** FIXME: qint64 -> qint32 **/
-    m_BinMin = (qint32)((float)startFreq * (float)m_FFTSize / m_SampleFreq);
-    m_BinMin += (m_FFTSize/2);
-    m_BinMax = (qint32)((float)stopFreq * (float)m_FFTSize / m_SampleFreq);
-    m_BinMax += (m_FFTSize/2);
-
-    minbin = m_BinMin < 0 ? 0 : m_BinMin;
-    if (m_BinMin > m_FFTSize)
-        m_BinMin = m_FFTSize - 1;
-    if (m_BinMax <= m_BinMin)
-        m_BinMax = m_BinMin + 1;
-    maxbin = m_BinMax < m_FFTSize ? m_BinMax : m_FFTSize;
-    bool largeFft = (m_BinMax-m_BinMin) > plotWidth; // true if more fft point than plot points
-
-    if (largeFft)
-    {
-        // more FFT points than plot points
-        for (i = minbin; i < maxbin; i++)
-            m_pTranslateTbl[i] = ((qint64)(i-m_BinMin)*plotWidth) / (m_BinMax - m_BinMin);
-        *xmin = m_pTranslateTbl[minbin];
-        *xmax = m_pTranslateTbl[maxbin - 1];
-    }
-    else
     {
-        // more plot points than FFT points
-        for (i = 0; i < plotWidth; i++)
-            m_pTranslateTbl[i] = m_BinMin + (i*(m_BinMax - m_BinMin)) / plotWidth;
-        *xmin = 0;
-        *xmax = plotWidth;
+        m_Running = true;
+        if (!m_RefreshTimer.isActive())
+        {
+            if (m_RefreshTimer.interval() <= 0)
+                setRefreshRate(screen() ? screen()->refreshRate() : PLOTTER_DEFAULT_REFRESH_HZ);
+            m_RefreshTimer.start();
+        }
     }
 
-    if (largeFft)
+    if (m_PushFrames.pending() && (int)m_PushWaterfall.size() == size)
     {
-        // more FFT points than plot points
-        for (i = minbin; i < maxbin; i++ )
-        {
-            y = (qint32)(dBGainFactor*(maxdB-m_pFFTAveBuf[i]));
-
-            if (y > plotHeight)
-                y = plotHeight;
-            else if (y < 0)
-                y = 0;
-
-            x = m_pTranslateTbl[i];	//get fft bin to plot x coordinate transform
-
-            if (x == xprev)   // still mappped to same fft bin coordinate
-            {
-                if (y < ymax) // store only the max value
-                {
-                    outBuf[x] = y;
-                    ymax = y;
-                }
-
-            }
-            else
-            {
-                outBuf[x] = y;
-                xprev = x;
-                ymax = y;
-            }
-        }
+        for (int i = 0; i < size; i++)
+            m_PushWaterfall[i] = qMax(m_PushWaterfall[i], wfData[i]);
     }
     else
     {
-        // more plot points than FFT points
-        for (x = 0; x < plotWidth; x++ )
-        {
-            i = m_pTranslateTbl[x]; // get plot to fft bin coordinate transform
-            if(i < 0 || i >= m_FFTSize)
-                y = plotHeight;
-            else
-                y = (qint32)(dBGainFactor*(maxdB-m_pFFTAveBuf[i]));
+        m_PushWaterfall.assign(wfData, wfData + size);
+    }
 
-            if (y > plotHeight)
-                y = plotHeight;
-            else if (y < 0)
-                y = 0;
+    spectrum_frame &frame = m_PushFrames.writeBuffer();
+    frame.average.assign(fftData, fftData + size);
+    frame.waterfall = m_PushWaterfall;
+    frame.fftSize = size;
+    frame.hop = 0;
+    frame.sampleRate = 0;
+    frame.timestamp = QDateTime::currentMSecsSinceEpoch();
+    frame.sequence = ++m_PushSequence;
+    m_PushFrames.publish();
+}
 
-            outBuf[x] = y;
-        }
-    }
+/** Redraw at most hz times per second, normally the display refresh rate. */
+void CPlotter::setRefreshRate(qreal hz)
+{
+    if (hz <= 0)
+        hz = PLOTTER_DEFAULT_REFRESH_HZ;
+    m_RefreshTimer.setInterval(qMax(1, qRound(1000.0 / hz)));
+}
 
-    delete [] m_pTranslateTbl;
+void CPlotter::resetDrawStats()
+{
+    m_Renderer.resetStats();
+    m_DrawCount = 0;
+    m_FpsDraws = 0;
+    m_DrawFps = 0;
+    m_FpsTimer.invalidate();
 }
 
 void CPlotter::setFftRange(float min, float max)
@@ -1276,38 +1271,101 @@ void CPlotter::setWaterfallRange(float min, float max)
     m_WfMindB = min;
     m_WfMaxdB = max;
     // no overlay change is necessary
+    viewChanged();
 }
 
-// Called to draw an overlay bitmap containing grid and text that
-// does not need to be recreated every fft data update.
+/**
+ * Bring the overlay layers up to date: grid and labels, and the demod
+ * filter box on top of it. Both are cached images, each redrawn only when
+ * the values it is drawn from changed, and only the area that changed is
+ * repainted. The trace is blended over them at paint time.
+ */
 void CPlotter::drawOverlay()
 {
-    if (m_OverlayPixmap.isNull())
+    if (m_GridLayer.isNull())
         return;
 
-    int     w = m_OverlayPixmap.width();
-    int     h = m_OverlayPixmap.height();
+    grid_key grid;
+    grid.width = m_GridLayer.width();
+    grid.height = m_GridLayer.height();
+    grid.centerFreq = m_CenterFreq;
+    grid.fftCenter = m_FftCenter;
+    grid.span = m_Span;
+    grid.sampleFreq = m_SampleFreq;
+    grid.freqUnits = m_FreqUnits;
+    grid.freqDigits = m_FreqDigits;
+    grid.pandMindB = m_PandMindB;
+    grid.pandMaxdB = m_PandMaxdB;
+    grid.vdivDelta = m_VdivDelta;
+    grid.centerLine = m_CenterLineEnabled;
+    grid.font = m_Font;
+
+    if (!(grid == m_GridKey))
+    {
+        m_GridKey = grid;
+        drawGridLayer();
+        update(m_GridLayer.rect());
+
+        // span, zoom and range also move the trace
+        viewChanged();
+    }
+
+    filter_key filter;
+    filter.width = m_GridLayer.width();
+    filter.height = m_GridLayer.height();
+    filter.enabled = m_FilterBoxEnabled;
+    if (m_FilterBoxEnabled)
+    {
+        m_DemodFreqX = xFromFreq(m_DemodCenterFreq);
+        m_DemodLowCutFreqX = xFromFreq(m_DemodCenterFreq + m_DemodLowCutFreq);
+        m_DemodHiCutFreqX = xFromFreq(m_DemodCenterFreq + m_DemodHiCutFreq);
+        filter.demodX = m_DemodFreqX;
+        filter.lowCutX = m_DemodLowCutFreqX;
+        filter.hiCutX = m_DemodHiCutFreqX;
+    }
+
+    if (!(filter == m_FilterKey))
+    {
+        QRect old = m_FilterRect;
+        m_FilterKey = filter;
+        drawFilterLayer();
+        update(old | m_FilterRect);
+    }
+}
+
+// Background, center line, frequency and level grid with their labels
+void CPlotter::drawGridLayer()
+{
+    int     w = m_GridLayer.width();
+    int     h = m_GridLayer.height();
     int     x,y;
     float   pixperdiv;
     float   adjoffset;
     float   dbstepsize;
     float   mindbadj;
-    QRect   rect;
-    QFontMetrics    metrics(m_Font);
-    QPainter        painter(&m_OverlayPixmap);
+    QPainter        painter(&m_GridLayer);
     painter.setFont(m_Font);
 
+    // Text is measured once per font, labels are laid out once per string
+    if (!(m_MetricsFont == m_Font) || m_FontHeight == 0)
+    {
+        QFontMetrics metrics(m_Font);
+        m_FontHeight = metrics.height();
+        m_GridLeft = metrics.horizontalAdvance("XXXX") + 2 * HOR_MARGIN;
+        m_LevelLabelWidth = metrics.horizontalAdvance("-120 ");
+        m_LabelGap = metrics.horizontalAdvance("O");
+        m_MetricsFont = m_Font;
+        m_Labels.clear();
+    }
+
     // solid background
     painter.setBrush(Qt::SolidPattern);
     painter.fillRect(0, 0, w, h, QColor(PLOTTER_BGD_COLOR));
 
-#define HOR_MARGIN 5
-#define VER_MARGIN 5
-
     // X and Y axis areas
-    m_YAxisWidth = metrics.horizontalAdvance("XXXX") + 2 * HOR_MARGIN;
-    m_XAxisYCenter = h - metrics.height()/2;
-    int xAxisHeight = metrics.height() + 2 * VER_MARGIN;
+    m_YAxisWidth = m_GridLeft;
+    m_XAxisYCenter = h - m_FontHeight/2;
+    int xAxisHeight = m_FontHeight + 2 * VER_MARGIN;
     int xAxisTop = h - xAxisHeight;
     int fLabelTop = xAxisTop + VER_MARGIN;
 
@@ -1326,7 +1384,7 @@ void CPlotter::drawOverlay()
     QString label;
     label.setNum(float((StartFreq + m_Span) / m_FreqUnits), 'f', m_FreqDigits);
     calcDivSize(StartFreq, StartFreq + m_Span,
-                qMin(w/(metrics.horizontalAdvance(label) + metrics.horizontalAdvance("O")), HORZ_DIVS_MAX),
+                qMin(w/(labelText(label).size().toSize().width() + m_LabelGap), HORZ_DIVS_MAX),
                 m_StartFreqAdj, m_FreqPerDiv, m_HorDivs);
     pixperdiv = (float)w * (float) m_FreqPerDiv / (float) m_Span;
     adjoffset = pixperdiv * float (m_StartFreqAdj - StartFreq) / (float) m_FreqPerDiv;
@@ -1339,18 +1397,16 @@ void CPlotter::drawOverlay()
             painter.drawLine(x, 0, x, xAxisTop);
     }
 
-    // draw frequency values (x axis)
+    // draw frequency values (x axis), centered on their grid line
     makeFrequencyStrs();
     painter.setPen(QColor(PLOTTER_TEXT_COLOR));
     for (int i = 0; i <= m_HorDivs; i++)
     {
-        int tw = metrics.horizontalAdvance(m_HDivText[i]);
+        const QStaticText &text = labelText(m_HDivText[i]);
+        QSizeF ts = text.size();
         x = (int)((float)i*pixperdiv + adjoffset);
         if (x > m_YAxisWidth)
-        {
-            rect.setRect(x - tw/2, fLabelTop, tw, metrics.height());
-            painter.drawText(rect, Qt::AlignHCenter|Qt::AlignBottom, m_HDivText[i]);
-        }
+            painter.drawStaticText(QPointF(x - ts.width() / 2, fLabelTop + m_FontHeight - ts.height()), text);
     }
 
     // Level grid
@@ -1381,51 +1437,70 @@ void CPlotter::drawOverlay()
             painter.drawLine(m_YAxisWidth, y, w, y);
     }
 
-    // draw amplitude values (y axis)
+    // draw amplitude values (y axis), right aligned and centered on their grid line
     int dB = m_PandMaxdB;
-    m_YAxisWidth = metrics.horizontalAdvance("-120 ");
+    m_YAxisWidth = m_LevelLabelWidth;
     painter.setPen(QColor(PLOTTER_TEXT_COLOR));
     for (int i = 0; i < m_VerDivs; i++)
     {
         y = h - (int)((float) i * pixperdiv + adjoffset);
-        int th = metrics.height();
         if (y < h -xAxisHeight)
         {
             dB = mindbadj + dbstepsize * i;
-            rect.setRect(HOR_MARGIN, y - th / 2, m_YAxisWidth, th);
-            painter.drawText(rect, Qt::AlignRight|Qt::AlignVCenter, QString::number(dB));
+            const QStaticText &text = labelText(QString::number(dB));
+            QSizeF ts = text.size();
+            painter.drawStaticText(QPointF(HOR_MARGIN + m_YAxisWidth - ts.width(), y - ts.height() / 2), text);
         }
     }
+}
 
-    // Draw demod filter box
-    if (m_FilterBoxEnabled)
-    {
-        m_DemodFreqX = xFromFreq(m_DemodCenterFreq);
-        m_DemodLowCutFreqX = xFromFreq(m_DemodCenterFreq + m_DemodLowCutFreq);
-        m_DemodHiCutFreqX = xFromFreq(m_DemodCenterFreq + m_DemodHiCutFreq);
+// Demod filter box, transparent outside of m_FilterRect
+void CPlotter::drawFilterLayer()
+{
+    QPainter painter(&m_FilterLayer);
+    int h = m_FilterLayer.height();
 
-        int dw = m_DemodHiCutFreqX - m_DemodLowCutFreqX;
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    painter.fillRect(m_FilterRect, Qt::transparent);
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    m_FilterRect = QRect();
 
-        painter.setOpacity(0.3);
-        painter.fillRect(m_DemodLowCutFreqX, 0, dw, h,
-                         QColor(PLOTTER_FILTER_BOX_COLOR));
+    if (!m_FilterBoxEnabled)
+        return;
 
-        painter.setOpacity(1.0);
-        painter.setPen(QColor(PLOTTER_FILTER_LINE_COLOR));
-        painter.drawLine(m_DemodFreqX, 0, m_DemodFreqX, h);
-    }
+    int dw = m_DemodHiCutFreqX - m_DemodLowCutFreqX;
 
-    if (!m_Running)
+    painter.setOpacity(0.3);
+    painter.fillRect(m_DemodLowCutFreqX, 0, dw, h,
+                     QColor(PLOTTER_FILTER_BOX_COLOR));
+
+    painter.setOpacity(1.0);
+    painter.setPen(QColor(PLOTTER_FILTER_LINE_COLOR));
+    painter.drawLine(m_DemodFreqX, 0, m_DemodFreqX, h);
+
+    m_FilterRect = (QRect(m_DemodLowCutFreqX, 0, dw, h).normalized() |
+                    QRect(m_DemodFreqX - 1, 0, 3, h)) & m_FilterLayer.rect();
+}
+
+/**
+ * Label text laid out for the plotter font. Labels repeat a lot between
+ * redraws of the grid (levels, and frequencies while only the range
+ * changes), so their layout is kept instead of being redone every time.
+ */
+const QStaticText &CPlotter::labelText(const QString &text)
+{
+    auto it = m_Labels.find(text);
+    if (it == m_Labels.end())
     {
-        // if not running so is no data updates to draw to screen
-        // copy into 2Dbitmap the overlay bitmap.
-        m_2DPixmap = m_OverlayPixmap.copy(0,0,w,h);
+        if (m_Labels.size() >= PLOTTER_LABEL_CACHE_SIZE)
+            m_Labels.clear();
 
-        // trigger a new paintEvent
-        update();
+        QStaticText label(text);
+        label.setTextFormat(Qt::PlainText);
+        label.prepare(QTransform(), m_Font);
+        it = m_Labels.insert(text, label);
     }
-
-    painter.end();
+    return it.value();
 }
 
 // Create frequency division strings based on start frequency, span frequency,
@@ -1485,20 +1560,20 @@ void CPlotter::makeFrequencyStrs()
 // Convert from screen coordinate to frequency
 int CPlotter::xFromFreq(qint64 freq)
 {
-    int w = m_OverlayPixmap.width();
+    int w = m_GridLayer.width();
     qint64 StartFreq = m_CenterFreq + m_FftCenter - m_Span/2;
     int x = (int) w * ((float)freq - StartFreq)/(float)m_Span;
     if (x < 0)
         return 0;
     if (x > (int)w)
-        return m_OverlayPixmap.width();
+        return m_GridLayer.width();
     return x;
 }
 
 // Convert from frequency to screen coordinate
 qint64 CPlotter::freqFromX(int x)
 {
-    int w = m_OverlayPixmap.width();
+    int w = m_GridLayer.width();
     qint64 StartFreq = m_CenterFreq + m_FftCenter - m_Span / 2;
     qint64 f = (qint64)(StartFreq + (float)m_Span * (float)x / (float)w);
     return f;
@@ -1508,15 +1583,17 @@ qint64 CPlotter::freqFromX(int x)
 quint64 CPlotter::msecFromY(int y)
 {
     // ensure we are in the waterfall region
-    if (y < m_OverlayPixmap.height())
+    if (y < m_GridLayer.height())
         return 0;
 
-    int dy = y - m_OverlayPixmap.height();
+    int dy = y - m_GridLayer.height();
 
+    if (m_HistoryEnd)
+        return m_HistoryEnd - dy * m_HistorySpan / qMax(1, waterfallHeight());
     if (msec_per_wfline > 0)
-        return tlast_wf_ms - dy * msec_per_wfline;
+        return shownImage().lastLineMs - dy * msec_per_wfline;
     else
-        return tlast_wf_ms - dy * 1000 / fft_rate;
+        return shownImage().lastLineMs - dy * 1000 / fft_rate;
 }
 
 // Round frequency to click resolution value
@@ -1586,6 +1663,7 @@ void CPlotter::resetHorizontalZoom(void)
 {
     setFftCenterFreq(0);
     setSpanFreq((qint32)m_SampleFreq);
+    zoomRangeMoved();
 }
 
 /** Center FFT plot around 0 (corresponds to center freq). */
@@ -1594,6 +1672,7 @@ void CPlotter::moveToCenterFreq(void)
     setFftCenterFreq(0);
     updateOverlay();
     m_PeakHoldValid = false;
+    zoomRangeMoved();
 }
 
 /** Center FFT plot around the demodulator frequency. */
@@ -1603,6 +1682,7 @@ void CPlotter::moveToDemodFreq(void)
     updateOverlay();
 
     m_PeakHoldValid = false;
+    zoomRangeMoved();
 }
 
 /** Set FFT plot color. */
@@ -1613,12 +1693,14 @@ void CPlotter::setFftPlotColor(const QColor color)
     m_FftFillCol.setAlpha(0x1A);
     m_PeakHoldColor = color;
     m_PeakHoldColor.setAlpha(60);
+    viewChanged();
 }
 
 /** Enable/disable filling the area below the FFT plot. */
 void CPlotter::setFftFill(bool enabled)
 {
     m_FftFill = enabled;
+    viewChanged();
 }
 
 /** Set peak hold on or off. */
@@ -1626,6 +1708,7 @@ void CPlotter::setPeakHold(bool enabled)
 {
     m_PeakHoldActive = enabled;
     m_PeakHoldValid = false;
+    viewChanged();
 }
 
 /**
@@ -1639,6 +1722,18 @@ void CPlotter::setPeakDetection(bool enabled, float c)
         m_PeakDetection = -1;
     else
         m_PeakDetection = c;
+    viewChanged();
+}
+
+/**
+ * Set how the pandapter combines the FFT bins that fall on one pixel when
+ * zoomed out: peak (default), minimum or average. The waterfall always
+ * shows the peak.
+ */
+void CPlotter::setDetector(spectrum_statistic detector)
+{
+    m_Detector = detector;
+    viewChanged();
 }
 
 void CPlotter::calcDivSize (qint64 low, qint64 high, int divswanted, qint64 &adjlow, qint64 &step, int& divs)
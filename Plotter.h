@@ -6,16 +6,23 @@
 #include <QFont>
 #include <QFrame>
 #include <QImage>
+#include <QTimer>
+#include <QElapsedTimer>
 #include <vector>
 #include <QMap>
+#include <QHash>
+#include <QStaticText>
+
+#include "plot_renderer.h"
+#include "waterfall_history.h"
 
 #define HORZ_DIVS_MAX 12    //50
 #define VERT_DIVS_MIN 5
-#define MAX_SCREENSIZE 16384
+#define PLOTTER_DEFAULT_REFRESH_HZ 60
+#define PLOTTER_EXPORT_MAX_LINES 16384
 
 #define PEAK_CLICK_MAX_H_DISTANCE 10 //Maximum horizontal distance of clicked point from peak
 #define PEAK_CLICK_MAX_V_DISTANCE 20 //Maximum vertical distance of clicked point from peak
-#define PEAK_H_TOLERANCE 2
 
 
 class CPlotter : public QFrame
@@ -39,10 +46,11 @@ public:
     void setTooltipsEnabled(bool enabled) { m_TooltipsEnabled = enabled; }
     void setBookmarksEnabled(bool enabled) { m_BookmarksEnabled = enabled; }
 
-    void setNewFttData(float *fftData, int size);
-    void setNewFttData(float *fftData, float *wfData, int size);
+    void setNewFttData(const float *fftData, int size);
+    void setNewFttData(const float *fftData, const float *wfData, int size);
 
     void setCenterFreq(quint64 f);
+    qint64 getCenterFreq(void) { return m_CenterFreq; }
     void setFreqUnits(qint32 unit) { m_FreqUnits = unit; }
 
     void setDemodCenterFreq(quint64 f) { m_DemodCenterFreq = f; }
@@ -112,6 +120,8 @@ public:
         qint64 limit = ((qint64)m_SampleFreq + m_Span) / 2 - 1;
         m_FftCenter = qBound(-limit, f, limit);
     }
+    qint64 getFftCenterFreq(void) { return m_FftCenter; }
+    qint64 getSpanFreq(void) { return m_Span; }
 
     int     getNearestPeak(QPoint pt);
     void    setWaterfallSpan(quint64 span_ms);
@@ -119,6 +129,18 @@ public:
     void    setFftRate(int rate_hz);
     void    clearWaterfall(void);
     bool    saveWaterfall(const QString & filename) const;
+    bool    saveWaterfall(const QString & filename, qint64 from, qint64 to, int lines = 0) const;
+    void    setWaterfallHistory(waterfall_history *history);
+    void    showWaterfallHistory(qint64 endMs, qint64 spanMs = 0);
+    bool    showingWaterfallHistory() const { return m_HistoryEnd != 0; }
+
+    void    setRefreshRate(qreal hz);
+    void    setSpectrumSource(spectrum_exchange *source);
+    double  drawFps() const { return m_DrawFps; }
+    quint64 dataUpdates() const { return m_Renderer.dataUpdates(); }
+    quint64 skippedUpdates() const { return m_Renderer.skippedUpdates(); }  // replaced before being drawn
+    quint64 drawCount() const { return m_DrawCount; }
+    void    resetDrawStats();
 
 signals:
     void newCenterFreq(qint64 f);
@@ -127,7 +149,8 @@ signals:
     void newHighCutFreq(int f);
     void newFilterFreq(int low, int high);  /* substitute for NewLow / NewHigh */
     void pandapterRangeChanged(float min, float max);
-    void newZoomLevel(float level);
+    void newZoomLevel(float level);         /* also sent when the zoomed range moves */
+    void spectrumFormatChanged(int sampleRate, int fftSize, int hop);
 
 public slots:
     // zoom functions
@@ -144,6 +167,7 @@ public slots:
     void setPandapterRange(float min, float max);
     void setWaterfallRange(float min, float max);
     void setPeakDetection(bool enabled, float c);
+    void setDetector(spectrum_statistic detector);
     void updateOverlay();
 
     void setPercent2DScreen(int percent)
@@ -162,6 +186,10 @@ protected:
     void mouseReleaseEvent(QMouseEvent * event);
     void wheelEvent( QWheelEvent * event );
 
+private slots:
+    void onRefresh();
+    void onFrameRendered();
+
 private:
     enum eCapturetype {
         NOCAP,
@@ -174,10 +202,24 @@ private:
     };
 
     void        drawOverlay();
+    void        drawGridLayer();
+    void        drawFilterLayer();
+    const QStaticText &labelText(const QString &text);
+    void        viewChanged();
+    void        pushView();
+    int         waterfallHeight() const
+    {
+        return (100 - m_Percent2DScreen) * m_Size.height() / 100;
+    }
+    const plot_image &shownImage() const { return m_Renderer.output()->readBuffer(); }
+    QImage      waterfallImage() const;
+    bool        saveWaterfallImage(const QString &filename, QImage pixmap, qint64 newestMs, double msPerLine) const;
+    qint64      liveWaterfallSpan() const;
     void        makeFrequencyStrs();
     int         xFromFreq(qint64 freq);
     qint64      freqFromX(int x);
     void        zoomStepX(float factor, int x);
+    void        zoomRangeMoved();
     qint64      roundFreq(qint64 freq, int resolution);
     quint64     msecFromY(int y);
     void        clampDemodParameters();
@@ -185,30 +227,25 @@ private:
     {
         return ((x > (xr - delta)) && (x < (xr + delta)));
     }
-    void getScreenIntegerFFTData(qint32 plotHeight, qint32 plotWidth,
-                                 float maxdB, float mindB,
-                                 qint64 startFreq, qint64 stopFreq,
-                                 float *inBuf, qint32 *outBuf,
-                                 qint32 *maxbin, qint32 *minbin);
     void calcDivSize (qint64 low, qint64 high, int divswanted, qint64 &adjlow, qint64 &step, int& divs);
 
     bool        m_PeakHoldActive;
-    bool        m_PeakHoldValid;
-    qint32      m_fftbuf[MAX_SCREENSIZE];
-    quint8      m_wfbuf[MAX_SCREENSIZE]; // used for accumulating waterfall data at high time spans
-    qint32      m_fftPeakHoldBuf[MAX_SCREENSIZE];
-    float      *m_fftData;     /*! pointer to incoming FFT data */
-    float      *m_wfData;
-    int         m_fftDataSize;
+    bool        m_PeakHoldValid;    // false until the renderer was told to restart peak hold
+    int         m_PeakHoldResets;
+    int         m_WaterfallClears;
+    bool        m_ViewDirty;        // view changed since it was last handed to m_Renderer
 
     int         m_XAxisYCenter;
     int         m_YAxisWidth;
 
     eCapturetype    m_CursorCaptured;
-    QPixmap     m_2DPixmap;
-    QPixmap     m_OverlayPixmap;
-    QPixmap     m_WaterfallPixmap;
-    QColor      m_ColorTbl[256];
+    QImage      m_GridLayer;        /*!< Background, grid and labels of the pandapter */
+    QImage      m_FilterLayer;      /*!< Demod filter box, transparent elsewhere */
+    QRect       m_FilterRect;       /*!< Part of m_FilterLayer that is not transparent */
+    QRect       m_ShownTraceRect;   /*!< Trace area of the picture on screen */
+    quint64     m_ShownLines;       /*!< Waterfall state of the picture on screen */
+    quint64     m_ShownGeneration;
+    qint64      m_ShownHistoryKey;  /*!< cacheKey() of the scrollback on screen */
     QSize       m_Size;
     QString     m_Str;
     QString     m_HDivText[HORZ_DIVS_MAX+1];
@@ -260,21 +297,96 @@ private:
     int         m_HdivDelta; /*!< Minimum distance in pixels between two horizontal grid lines (vertical division). */
     int         m_VdivDelta; /*!< Minimum distance in pixels between two vertical grid lines (horizontal division). */
 
+    // Everything the grid layer is drawn from, it is redrawn when this changes
+    struct grid_key
+    {
+        int     width {0};
+        int     height {0};
+        qint64  centerFreq {0};
+        qint64  fftCenter {0};
+        qint64  span {0};
+        float   sampleFreq {0};
+        qint32  freqUnits {0};
+        int     freqDigits {0};
+        float   pandMindB {0};
+        float   pandMaxdB {0};
+        int     vdivDelta {0};
+        bool    centerLine {false};
+        QFont   font;
+
+        bool operator==(const grid_key &o) const
+        {
+            return width == o.width && height == o.height && centerFreq == o.centerFreq &&
+                   fftCenter == o.fftCenter && span == o.span && sampleFreq == o.sampleFreq &&
+                   freqUnits == o.freqUnits && freqDigits == o.freqDigits &&
+                   pandMindB == o.pandMindB && pandMaxdB == o.pandMaxdB &&
+                   vdivDelta == o.vdivDelta && centerLine == o.centerLine && font == o.font;
+        }
+    };
+
+    // Same for the filter layer, in screen coordinates
+    struct filter_key
+    {
+        int     width {0};
+        int     height {0};
+        bool    enabled {false};
+        int     demodX {0};
+        int     lowCutX {0};
+        int     hiCutX {0};
+
+        bool operator==(const filter_key &o) const
+        {
+            return width == o.width && height == o.height && enabled == o.enabled &&
+                   demodX == o.demodX && lowCutX == o.lowCutX && hiCutX == o.hiCutX;
+        }
+    };
+
+    grid_key    m_GridKey;
+    filter_key  m_FilterKey;
+    QFont       m_MetricsFont;      /*!< Font the cached sizes below were measured with */
+    int         m_FontHeight;
+    int         m_GridLeft;         /*!< Vertical grid lines start right of this */
+    int         m_LevelLabelWidth;
+    int         m_LabelGap;         /*!< Minimum space between two frequency labels */
+    QHash<QString, QStaticText> m_Labels;
+
     quint32     m_LastSampleRate;
 
     QColor      m_FftColor, m_FftFillCol, m_PeakHoldColor;
     bool        m_FftFill;
 
     float       m_PeakDetection;
-    QMap<int,int>   m_Peaks;
+    spectrum_statistic m_Detector;  /*!< How bins sharing a pixel are combined */
 
     QList< QPair<QRect, qint64> >     m_BookmarkTags;
 
     // Waterfall averaging
-    quint64     tlast_wf_ms;        // last time waterfall has been updated
     quint64     msec_per_wfline;    // milliseconds between waterfall updates
     quint64     wf_span;            // waterfall span in milliseconds (0 = auto)
     int         fft_rate;           // expected FFT rate (needed when WF span is auto)
+
+    // Refresh timer decoupling data rate from draw rate
+    QTimer      m_RefreshTimer;
+    quint64     m_DrawCount;
+    int         m_FpsDraws;
+    double      m_DrawFps;
+    QElapsedTimer m_FpsTimer;
+
+    // Pictures are drawn by m_Renderer from m_Source, or from m_PushFrames
+    // filled by setNewFttData(); the GUI thread only blits them
+    plot_renderer m_Renderer;
+    spectrum_exchange *m_Source;
+    spectrum_exchange m_PushFrames;
+    std::vector<float> m_PushWaterfall;
+    quint64     m_PushSequence;
+    int         m_SourceRate;
+    int         m_SourceFftSize;
+    int         m_SourceHop;
+
+    // Scrollback from the stored waterfall, drawn by m_Renderer
+    waterfall_history *m_History;
+    qint64      m_HistoryEnd;       // ms since epoch of the newest line shown, 0 shows the live waterfall
+    qint64      m_HistorySpan;      // ms shown over the waterfall height
 };
 
 #endif // PLOTTER_H
@@ -0,0 +1,97 @@
+#include "audio_buffer.h"
+
+#include <utility>
+
+audio_buffer::audio_buffer(const audio_buffer &other)
+    : m_ref(other.m_ref ? av_buffer_ref(other.m_ref) : nullptr)
+    , m_size(other.m_size)
+    , m_format(other.m_format)
+    , m_sampleRate(other.m_sampleRate)
+    , m_channels(other.m_channels)
+    , m_channelMask(other.m_channelMask)
+    , m_frames(other.m_frames)
+    , m_pts(other.m_pts)
+{
+}
+
+audio_buffer::audio_buffer(audio_buffer &&other) noexcept
+    : m_ref(std::exchange(other.m_ref, nullptr))
+    , m_size(other.m_size)
+    , m_format(other.m_format)
+    , m_sampleRate(other.m_sampleRate)
+    , m_channels(other.m_channels)
+    , m_channelMask(other.m_channelMask)
+    , m_frames(other.m_frames)
+    , m_pts(other.m_pts)
+{
+}
+
+audio_buffer &audio_buffer::operator=(const audio_buffer &other)
+{
+    if (this != &other)
+    {
+        audio_buffer copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+audio_buffer &audio_buffer::operator=(audio_buffer &&other) noexcept
+{
+    if (this != &other)
+    {
+        av_buffer_unref(&m_ref);
+        m_ref = std::exchange(other.m_ref, nullptr);
+        m_size = other.m_size;
+        m_format = other.m_format;
+        m_sampleRate = other.m_sampleRate;
+        m_channels = other.m_channels;
+        m_channelMask = other.m_channelMask;
+        m_frames = other.m_frames;
+        m_pts = other.m_pts;
+    }
+    return *this;
+}
+
+audio_buffer::~audio_buffer()
+{
+    av_buffer_unref(&m_ref);
+}
+
+audio_buffer_pool::~audio_buffer_pool()
+{
+    // Outstanding buffers keep the pool alive until they are returned
+    av_buffer_pool_uninit(&m_pool);
+}
+
+audio_buffer audio_buffer_pool::get(AVSampleFormat format, int channels, int sampleRate, int frames,
+                                    uint64_t channelMask)
+{
+    audio_buffer buffer;
+
+    int size = av_samples_get_buffer_size(nullptr, channels, frames, format, 1);
+    if (size <= 0)
+        return buffer;
+
+    QMutexLocker locker(&m_mutex);
+    if (!m_pool || size > m_blockSize)
+    {
+        av_buffer_pool_uninit(&m_pool);
+        m_blockSize = size;
+        m_pool = av_buffer_pool_init(m_blockSize, nullptr);
+        if (!m_pool)
+            return buffer;
+    }
+
+    buffer.m_ref = av_buffer_pool_get(m_pool);
+    if (!buffer.m_ref)
+        return buffer;
+
+    buffer.m_size = size;
+    buffer.m_format = format;
+    buffer.m_sampleRate = sampleRate;
+    buffer.m_channels = channels;
+    buffer.m_channelMask = channelMask;
+    buffer.m_frames = frames;
+    return buffer;
+}
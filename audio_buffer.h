@@ -0,0 +1,88 @@
+#ifndef AUDIO_BUFFER_H
+#define AUDIO_BUFFER_H
+
+#include <QMetaType>
+#include <QMutex>
+#include <cstdint>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include <libavutil/buffer.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/channel_layout.h>
+#ifdef __cplusplus
+};
+#endif
+
+// Block of interleaved PCM shared between the decoder and any number of
+// consumers (playback, spectrum, meters, recorders). Copies only take a
+// reference on the underlying AVBufferRef; the memory goes back to its
+// audio_buffer_pool when the last copy is destroyed. Consumers must treat
+// the samples as read-only.
+class audio_buffer
+{
+public:
+    audio_buffer() = default;
+    audio_buffer(const audio_buffer &other);
+    audio_buffer(audio_buffer &&other) noexcept;
+    audio_buffer &operator=(const audio_buffer &other);
+    audio_buffer &operator=(audio_buffer &&other) noexcept;
+    ~audio_buffer();
+
+    bool isNull() const { return !m_ref; }
+    const uint8_t *data() const { return m_ref ? m_ref->data : nullptr; }
+    template <typename T> const T *samples() const { return reinterpret_cast<const T *>(data()); }
+    int size() const { return m_size; }
+
+    AVSampleFormat format() const { return m_format; }
+    int sampleRate() const { return m_sampleRate; }
+    int channels() const { return m_channels; }
+    uint64_t channelMask() const { return m_channelMask; }
+    int frames() const { return m_frames; }
+    int64_t pts() const { return m_pts; }
+    void setPts(int64_t pts) { m_pts = pts; }
+
+    // Only valid while the producer holds the single reference
+    uint8_t *writableData() { return m_ref && av_buffer_is_writable(m_ref) ? m_ref->data : nullptr; }
+
+private:
+    friend class audio_buffer_pool;
+
+    AVBufferRef *m_ref {nullptr};
+    int m_size {0};
+    AVSampleFormat m_format {AV_SAMPLE_FMT_NONE};
+    int m_sampleRate {0};
+    int m_channels {0};
+    uint64_t m_channelMask {0};
+    int m_frames {0};
+    int64_t m_pts {AV_NOPTS_VALUE};
+};
+
+Q_DECLARE_METATYPE(audio_buffer)
+
+// AVBufferPool of fixed size blocks. Asking for a larger block than the pool
+// serves starts a new pool; buffers of the old one stay valid and the old
+// pool is freed once they are all returned.
+class audio_buffer_pool
+{
+public:
+    audio_buffer_pool() = default;
+    ~audio_buffer_pool();
+
+    audio_buffer_pool(const audio_buffer_pool&) = delete;
+    audio_buffer_pool& operator=(const audio_buffer_pool&) = delete;
+
+    audio_buffer get(AVSampleFormat format, int channels, int sampleRate, int frames,
+                     uint64_t channelMask = 0);
+
+    int blockSize() const { return m_blockSize; }
+
+private:
+    QMutex m_mutex;
+    AVBufferPool *m_pool {nullptr};
+    int m_blockSize {0};
+};
+
+#endif // AUDIO_BUFFER_H
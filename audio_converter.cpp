@@ -0,0 +1,715 @@
+#include "audio_converter.h"
+
+#include <QElapsedTimer>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+#include <algorithm>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include <libavutil/cpu.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+#ifdef __cplusplus
+};
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define AUDIO_CONVERTER_X86 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define AUDIO_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define AUDIO_TARGET_AVX2
+#endif
+#endif
+
+/* Per format sample description, all conversions go through float */
+
+template <AVSampleFormat F> struct sample_traits;
+
+template <> struct sample_traits<AV_SAMPLE_FMT_U8>
+{
+    using type = uint8_t;
+    static constexpr bool planar = false;
+    static float to_float(type v) { return (int(v) - 128) * (1.0f / 128.0f); }
+};
+template <> struct sample_traits<AV_SAMPLE_FMT_S16>
+{
+    using type = int16_t;
+    static constexpr bool planar = false;
+    static float to_float(type v) { return v * (1.0f / 32768.0f); }
+    static type from_float(float v)
+    {
+        // Clamped in the operand order of maxps/minps, NaN comes out as -32768 like in the SIMD kernels
+        v = v > -1.0f ? v : -1.0f;
+        v = v < 1.0f ? v : 1.0f;
+        return (type)std::min(lrintf(v * 32768.0f), 32767L);
+    }
+};
+template <> struct sample_traits<AV_SAMPLE_FMT_S32>
+{
+    using type = int32_t;
+    static constexpr bool planar = false;
+    static float to_float(type v) { return v * (1.0f / 2147483648.0f); }
+};
+template <> struct sample_traits<AV_SAMPLE_FMT_FLT>
+{
+    using type = float;
+    static constexpr bool planar = false;
+    static float to_float(type v) { return v; }
+    static type from_float(float v) { return v; }
+};
+template <> struct sample_traits<AV_SAMPLE_FMT_DBL>
+{
+    using type = double;
+    static constexpr bool planar = false;
+    static float to_float(type v) { return (float)v; }
+};
+template <> struct sample_traits<AV_SAMPLE_FMT_S64>
+{
+    using type = int64_t;
+    static constexpr bool planar = false;
+    static float to_float(type v) { return (float)(v * (1.0 / 9223372036854775808.0)); }
+};
+
+#define PLANAR_TRAITS(planarFmt, packedFmt) \
+    template <> struct sample_traits<planarFmt> : sample_traits<packedFmt> \
+    { \
+        static constexpr bool planar = true; \
+    };
+
+PLANAR_TRAITS(AV_SAMPLE_FMT_U8P, AV_SAMPLE_FMT_U8)
+PLANAR_TRAITS(AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_S16)
+PLANAR_TRAITS(AV_SAMPLE_FMT_S32P, AV_SAMPLE_FMT_S32)
+PLANAR_TRAITS(AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLT)
+PLANAR_TRAITS(AV_SAMPLE_FMT_DBLP, AV_SAMPLE_FMT_DBL)
+PLANAR_TRAITS(AV_SAMPLE_FMT_S64P, AV_SAMPLE_FMT_S64)
+
+/* Scalar reference kernels, one instantiation per format pair */
+
+template <AVSampleFormat In, AVSampleFormat Out, bool Mix>
+static void convert_c(const uint8_t *const *in, int inChannels,
+                      uint8_t *out, int outChannels, int samples, const float *matrix)
+{
+    using in_t = typename sample_traits<In>::type;
+    using out_t = typename sample_traits<Out>::type;
+    constexpr bool planar = sample_traits<In>::planar;
+    constexpr bool copy = std::is_same<in_t, out_t>::value;
+
+    out_t *dst = reinterpret_cast<out_t *>(out);
+
+    auto sample = [&](int ch, int i) -> in_t {
+        if (planar)
+            return reinterpret_cast<const in_t *>(in[ch])[i];
+        return reinterpret_cast<const in_t *>(in[0])[i * inChannels + ch];
+    };
+
+    if constexpr (!Mix)
+    {
+        // Same channel count, only the sample format and layout change
+        for (int i = 0; i < samples; i++)
+            for (int ch = 0; ch < inChannels; ch++)
+            {
+                if constexpr (copy)
+                    *dst++ = sample(ch, i);
+                else
+                    *dst++ = sample_traits<Out>::from_float(sample_traits<In>::to_float(sample(ch, i)));
+            }
+    }
+    else
+    {
+        for (int i = 0; i < samples; i++)
+            for (int o = 0; o < outChannels; o++)
+            {
+                const float *row = matrix + o * inChannels;
+                float acc = 0.0f;
+                for (int ch = 0; ch < inChannels; ch++)
+                    acc += row[ch] * sample_traits<In>::to_float(sample(ch, i));
+                *dst++ = sample_traits<Out>::from_float(acc);
+            }
+    }
+}
+
+template <AVSampleFormat In>
+static audio_converter::kernel_fn select_c(AVSampleFormat outFmt, bool mix)
+{
+    if (outFmt == AV_SAMPLE_FMT_S16)
+        return mix ? convert_c<In, AV_SAMPLE_FMT_S16, true> : convert_c<In, AV_SAMPLE_FMT_S16, false>;
+    return mix ? convert_c<In, AV_SAMPLE_FMT_FLT, true> : convert_c<In, AV_SAMPLE_FMT_FLT, false>;
+}
+
+static audio_converter::kernel_fn select_c(AVSampleFormat inFmt, AVSampleFormat outFmt, bool mix)
+{
+    switch (inFmt)
+    {
+    case AV_SAMPLE_FMT_U8:   return select_c<AV_SAMPLE_FMT_U8>(outFmt, mix);
+    case AV_SAMPLE_FMT_S16:  return select_c<AV_SAMPLE_FMT_S16>(outFmt, mix);
+    case AV_SAMPLE_FMT_S32:  return select_c<AV_SAMPLE_FMT_S32>(outFmt, mix);
+    case AV_SAMPLE_FMT_FLT:  return select_c<AV_SAMPLE_FMT_FLT>(outFmt, mix);
+    case AV_SAMPLE_FMT_DBL:  return select_c<AV_SAMPLE_FMT_DBL>(outFmt, mix);
+    case AV_SAMPLE_FMT_S64:  return select_c<AV_SAMPLE_FMT_S64>(outFmt, mix);
+    case AV_SAMPLE_FMT_U8P:  return select_c<AV_SAMPLE_FMT_U8P>(outFmt, mix);
+    case AV_SAMPLE_FMT_S16P: return select_c<AV_SAMPLE_FMT_S16P>(outFmt, mix);
+    case AV_SAMPLE_FMT_S32P: return select_c<AV_SAMPLE_FMT_S32P>(outFmt, mix);
+    case AV_SAMPLE_FMT_FLTP: return select_c<AV_SAMPLE_FMT_FLTP>(outFmt, mix);
+    case AV_SAMPLE_FMT_DBLP: return select_c<AV_SAMPLE_FMT_DBLP>(outFmt, mix);
+    case AV_SAMPLE_FMT_S64P: return select_c<AV_SAMPLE_FMT_S64P>(outFmt, mix);
+    default:                 return nullptr;
+    }
+}
+
+#ifdef AUDIO_CONVERTER_X86
+
+/*
+ * SSE2 / AVX2 kernels for what decoders actually produce. Float to s16
+ * clamps to [-1, 1] first so the int32 conversion never overflows and
+ * packs saturates 32768 to 32767. The scalar path clamps in the same
+ * operand order, so both agree bit for bit, NaN included.
+ * Tails shorter than a vector fall back to the scalar template.
+ */
+
+static inline __m128i flt_to_s32_sse2(__m128 v)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    v = _mm_min_ps(_mm_max_ps(v, _mm_sub_ps(_mm_setzero_ps(), one)), one);
+    return _mm_cvtps_epi32(_mm_mul_ps(v, scale));
+}
+
+static void fltp2_to_s16_sse2(const uint8_t *const *in, int inChannels, uint8_t *out, int outChannels,
+                              int samples, const float *matrix)
+{
+    const float *l = reinterpret_cast<const float *>(in[0]);
+    const float *r = reinterpret_cast<const float *>(in[1]);
+    int16_t *dst = reinterpret_cast<int16_t *>(out);
+
+    int i = 0;
+    for (; i + 4 <= samples; i += 4)
+    {
+        __m128i li = flt_to_s32_sse2(_mm_loadu_ps(l + i));
+        __m128i ri = flt_to_s32_sse2(_mm_loadu_ps(r + i));
+        __m128i lo = _mm_unpacklo_epi32(li, ri);
+        __m128i hi = _mm_unpackhi_epi32(li, ri);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 2 * i), _mm_packs_epi32(lo, hi));
+    }
+
+    const uint8_t *tail[2] = { reinterpret_cast<const uint8_t *>(l + i), reinterpret_cast<const uint8_t *>(r + i) };
+    convert_c<AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16, false>(tail, inChannels, reinterpret_cast<uint8_t *>(dst + 2 * i),
+                                                           outChannels, samples - i, matrix);
+}
+
+static void fltp2_to_flt_sse2(const uint8_t *const *in, int inChannels, uint8_t *out, int outChannels,
+                              int samples, const float *matrix)
+{
+    const float *l = reinterpret_cast<const float *>(in[0]);
+    const float *r = reinterpret_cast<const float *>(in[1]);
+    float *dst = reinterpret_cast<float *>(out);
+
+    int i = 0;
+    for (; i + 4 <= samples; i += 4)
+    {
+        __m128 lv = _mm_loadu_ps(l + i);
+        __m128 rv = _mm_loadu_ps(r + i);
+        _mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(lv, rv));
+        _mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(lv, rv));
+    }
+
+    const uint8_t *tail[2] = { reinterpret_cast<const uint8_t *>(l + i), reinterpret_cast<const uint8_t *>(r + i) };
+    convert_c<AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLT, false>(tail, inChannels, reinterpret_cast<uint8_t *>(dst + 2 * i),
+                                                           outChannels, samples - i, matrix);
+}
+
+// Packed float (or mono planar) to s16, channel count does not matter
+static void flt_to_s16_sse2(const uint8_t *const *in, int inChannels, uint8_t *out, int outChannels,
+                            int samples, const float *matrix)
+{
+    const float *src = reinterpret_cast<const float *>(in[0]);
+    int16_t *dst = reinterpret_cast<int16_t *>(out);
+    const int count = samples * inChannels;
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i a = flt_to_s32_sse2(_mm_loadu_ps(src + i));
+        __m128i b = flt_to_s32_sse2(_mm_loadu_ps(src + i + 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packs_epi32(a, b));
+    }
+
+    const uint8_t *tail[1] = { reinterpret_cast<const uint8_t *>(src + i) };
+    convert_c<AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_S16, false>(tail, 1, reinterpret_cast<uint8_t *>(dst + i),
+                                                          1, count - i, matrix);
+    (void)outChannels;
+}
+
+static void s16_to_flt_sse2(const uint8_t *const *in, int inChannels, uint8_t *out, int outChannels,
+                            int samples, const float *matrix)
+{
+    const int16_t *src = reinterpret_cast<const int16_t *>(in[0]);
+    float *dst = reinterpret_cast<float *>(out);
+    const int count = samples * inChannels;
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        // Sign extend by placing the sample in the high half and shifting back
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+
+    const uint8_t *tail[1] = { reinterpret_cast<const uint8_t *>(src + i) };
+    convert_c<AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLT, false>(tail, 1, reinterpret_cast<uint8_t *>(dst + i),
+                                                          1, count - i, matrix);
+    (void)outChannels;
+}
+
+AUDIO_TARGET_AVX2
+static inline __m256i flt_to_s32_avx2(__m256 v)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 scale = _mm256_set1_ps(32768.0f);
+    v = _mm256_min_ps(_mm256_max_ps(v, _mm256_sub_ps(_mm256_setzero_ps(), one)), one);
+    return _mm256_cvtps_epi32(_mm256_mul_ps(v, scale));
+}
+
+AUDIO_TARGET_AVX2
+static void fltp2_to_s16_avx2(const uint8_t *const *in, int inChannels, uint8_t *out, int outChannels,
+                              int samples, const float *matrix)
+{
+    const float *l = reinterpret_cast<const float *>(in[0]);
+    const float *r = reinterpret_cast<const float *>(in[1]);
+    int16_t *dst = reinterpret_cast<int16_t *>(out);
+
+    int i = 0;
+    for (; i + 8 <= samples; i += 8)
+    {
+        __m256i li = flt_to_s32_avx2(_mm256_loadu_ps(l + i));
+        __m256i ri = flt_to_s32_avx2(_mm256_loadu_ps(r + i));
+        // Unpack and pack both work per 128 bit lane, which keeps the order
+        __m256i lo = _mm256_unpacklo_epi32(li, ri);
+        __m256i hi = _mm256_unpackhi_epi32(li, ri);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + 2 * i), _mm256_packs_epi32(lo, hi));
+    }
+
+    const uint8_t *tail[2] = { reinterpret_cast<const uint8_t *>(l + i), reinterpret_cast<const uint8_t *>(r + i) };
+    convert_c<AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16, false>(tail, inChannels, reinterpret_cast<uint8_t *>(dst + 2 * i),
+                                                           outChannels, samples - i, matrix);
+}
+
+AUDIO_TARGET_AVX2
+static void fltp2_to_flt_avx2(const uint8_t *const *in, int inChannels, uint8_t *out, int outChannels,
+                              int samples, const float *matrix)
+{
+    const float *l = reinterpret_cast<const float *>(in[0]);
+    const float *r = reinterpret_cast<const float *>(in[1]);
+    float *dst = reinterpret_cast<float *>(out);
+
+    int i = 0;
+    for (; i + 8 <= samples; i += 8)
+    {
+        __m256 lv = _mm256_loadu_ps(l + i);
+        __m256 rv = _mm256_loadu_ps(r + i);
+        __m256 lo = _mm256_unpacklo_ps(lv, rv);
+        __m256 hi = _mm256_unpackhi_ps(lv, rv);
+        _mm256_storeu_ps(dst + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+        _mm256_storeu_ps(dst + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+    }
+
+    const uint8_t *tail[2] = { reinterpret_cast<const uint8_t *>(l + i), reinterpret_cast<const uint8_t *>(r + i) };
+    convert_c<AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLT, false>(tail, inChannels, reinterpret_cast<uint8_t *>(dst + 2 * i),
+                                                           outChannels, samples - i, matrix);
+}
+
+AUDIO_TARGET_AVX2
+static void flt_to_s16_avx2(const uint8_t *const *in, int inChannels, uint8_t *out, int outChannels,
+                            int samples, const float *matrix)
+{
+    const float *src = reinterpret_cast<const float *>(in[0]);
+    int16_t *dst = reinterpret_cast<int16_t *>(out);
+    const int count = samples * inChannels;
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i a = flt_to_s32_avx2(_mm256_loadu_ps(src + i));
+        __m256i b = flt_to_s32_avx2(_mm256_loadu_ps(src + i + 8));
+        // packs interleaves the lanes of a and b, put them back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), packed);
+    }
+
+    const uint8_t *tail[1] = { reinterpret_cast<const uint8_t *>(src + i) };
+    convert_c<AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_S16, false>(tail, 1, reinterpret_cast<uint8_t *>(dst + i),
+                                                          1, count - i, matrix);
+    (void)outChannels;
+}
+
+AUDIO_TARGET_AVX2
+static void s16_to_flt_avx2(const uint8_t *const *in, int inChannels, uint8_t *out, int outChannels,
+                            int samples, const float *matrix)
+{
+    const int16_t *src = reinterpret_cast<const int16_t *>(in[0]);
+    float *dst = reinterpret_cast<float *>(out);
+    const int count = samples * inChannels;
+    const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+    }
+
+    const uint8_t *tail[1] = { reinterpret_cast<const uint8_t *>(src + i) };
+    convert_c<AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLT, false>(tail, 1, reinterpret_cast<uint8_t *>(dst + i),
+                                                          1, count - i, matrix);
+    (void)outChannels;
+}
+
+static audio_converter::kernel_fn select_simd(AVSampleFormat inFmt, int channels, AVSampleFormat outFmt,
+                                              audio_converter::simd_level level)
+{
+    const bool avx2 = level >= audio_converter::SIMD_AVX2;
+
+    // Mono planar is laid out exactly like packed
+    if (inFmt == AV_SAMPLE_FMT_FLTP && channels == 1)
+        inFmt = AV_SAMPLE_FMT_FLT;
+    if (inFmt == AV_SAMPLE_FMT_S16P && channels == 1)
+        inFmt = AV_SAMPLE_FMT_S16;
+
+    if (inFmt == AV_SAMPLE_FMT_FLTP && channels == 2)
+    {
+        if (outFmt == AV_SAMPLE_FMT_S16)
+            return avx2 ? fltp2_to_s16_avx2 : fltp2_to_s16_sse2;
+        return avx2 ? fltp2_to_flt_avx2 : fltp2_to_flt_sse2;
+    }
+    if (inFmt == AV_SAMPLE_FMT_FLT && outFmt == AV_SAMPLE_FMT_S16)
+        return avx2 ? flt_to_s16_avx2 : flt_to_s16_sse2;
+    if (inFmt == AV_SAMPLE_FMT_S16 && outFmt == AV_SAMPLE_FMT_FLT)
+        return avx2 ? s16_to_flt_avx2 : s16_to_flt_sse2;
+
+    return nullptr;
+}
+
+#endif // AUDIO_CONVERTER_X86
+
+audio_converter::audio_converter()
+{
+    std::fill(std::begin(m_matrix), std::end(m_matrix), 0.0f);
+}
+
+audio_converter::simd_level audio_converter::cpuLevel()
+{
+#ifdef AUDIO_CONVERTER_X86
+    int flags = av_get_cpu_flags();
+    if (flags & AV_CPU_FLAG_AVX2)
+        return SIMD_AVX2;
+    if (flags & AV_CPU_FLAG_SSE2)
+        return SIMD_SSE2;
+#endif
+    return SIMD_NONE;
+}
+
+const char *audio_converter::levelName(simd_level level)
+{
+    switch (level)
+    {
+    case SIMD_SSE2: return "sse2";
+    case SIMD_AVX2: return "avx2";
+    default:        return "c";
+    }
+}
+
+/**
+ * AV_CH_* bit of each channel index of frame, 0 for a channel without one.
+ * Without a frame, or when the frame does not name its channels, FFmpeg's
+ * default layout of the channel count is used.
+ */
+static void channel_masks(const AVFrame *frame, int channels, uint64_t *masks)
+{
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
+    uint64_t layout = frame ? frame->channel_layout : 0;
+    if (av_get_channel_layout_nb_channels(layout) != channels)
+        layout = av_get_default_channel_layout(channels);
+    for (int ch = 0; ch < channels; ch++)
+        masks[ch] = av_channel_layout_extract_channel(layout, ch);
+#else
+    AVChannelLayout fallback;
+    av_channel_layout_default(&fallback, channels);
+    const AVChannelLayout *layout = frame ? &frame->ch_layout : nullptr;
+    if (!layout || layout->nb_channels != channels || layout->order == AV_CHANNEL_ORDER_UNSPEC)
+        layout = &fallback;
+
+    for (int ch = 0; ch < channels; ch++)
+    {
+        AVChannel c = av_channel_layout_channel_from_index(layout, ch);
+        masks[ch] = (c >= 0 && c < 64) ? (1ULL << c) : 0;
+    }
+    av_channel_layout_uninit(&fallback);
+#endif
+}
+
+static int frame_channels(const AVFrame *frame)
+{
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
+    return frame->channels;
+#else
+    return frame->ch_layout.nb_channels;
+#endif
+}
+
+/**
+ * Downmix matrix from the channel order of the input. Left and right go to
+ * their side, center and back center to both sides at -3 dB, the other
+ * left and right channels (surrounds, wides, heights) to their side at
+ * -3 dB, LFE is dropped and unknown channels go to both sides at -3 dB.
+ * Mono takes every channel but LFE. Each output row is normalized so a
+ * full scale input can not clip.
+ */
+void audio_converter::build_matrix()
+{
+    std::fill(std::begin(m_matrix), std::end(m_matrix), 0.0f);
+    const float minus3dB = 0.70710678f;
+
+    const uint64_t lfe = AV_CH_LOW_FREQUENCY | AV_CH_LOW_FREQUENCY_2;
+    const uint64_t left = AV_CH_BACK_LEFT | AV_CH_SIDE_LEFT | AV_CH_FRONT_LEFT_OF_CENTER |
+                          AV_CH_TOP_FRONT_LEFT | AV_CH_TOP_BACK_LEFT | AV_CH_WIDE_LEFT |
+                          AV_CH_SURROUND_DIRECT_LEFT | AV_CH_STEREO_LEFT;
+    const uint64_t right = AV_CH_BACK_RIGHT | AV_CH_SIDE_RIGHT | AV_CH_FRONT_RIGHT_OF_CENTER |
+                           AV_CH_TOP_FRONT_RIGHT | AV_CH_TOP_BACK_RIGHT | AV_CH_WIDE_RIGHT |
+                           AV_CH_SURROUND_DIRECT_RIGHT | AV_CH_STEREO_RIGHT;
+
+    for (int o = 0; o < m_outChannels; o++)
+    {
+        float *row = m_matrix + o * m_inChannels;
+
+        for (int ch = 0; ch < m_inChannels; ch++)
+        {
+            const uint64_t c = m_channelMasks[ch];
+            if (c & lfe)
+                row[ch] = 0.0f;
+            else if (m_outChannels == 1 || m_inChannels == 1)
+                row[ch] = 1.0f;
+            else if (c == AV_CH_FRONT_LEFT)
+                row[ch] = (o == 0) ? 1.0f : 0.0f;
+            else if (c == AV_CH_FRONT_RIGHT)
+                row[ch] = (o == 1) ? 1.0f : 0.0f;
+            else if (c & left)
+                row[ch] = (o == 0) ? minus3dB : 0.0f;
+            else if (c & right)
+                row[ch] = (o == 1) ? minus3dB : 0.0f;
+            else
+                row[ch] = minus3dB;     // center, back center, top center or unknown
+        }
+
+        float sum = 0.0f;
+        for (int ch = 0; ch < m_inChannels; ch++)
+            sum += row[ch];
+        if (sum > 1.0f)
+            for (int ch = 0; ch < m_inChannels; ch++)
+                row[ch] /= sum;
+    }
+}
+
+bool audio_converter::configure(AVSampleFormat inFmt, int inChannels, AVSampleFormat outFmt, int outChannels,
+                                simd_level maxLevel)
+{
+    m_kernel = nullptr;
+
+    if (outFmt != AV_SAMPLE_FMT_S16 && outFmt != AV_SAMPLE_FMT_FLT)
+        return false;
+    if (inChannels <= 0 || inChannels > AUDIO_CONVERTER_MAX_CHANNELS ||
+        outChannels <= 0 || outChannels > inChannels)
+        return false;
+
+    m_inFmt = inFmt;
+    m_outFmt = outFmt;
+    m_inChannels = inChannels;
+    m_outChannels = outChannels;
+    channel_masks(nullptr, inChannels, m_channelMasks);
+
+    bool mix = outChannels != inChannels;
+    if (mix)
+        build_matrix();
+
+    m_level = SIMD_NONE;
+#ifdef AUDIO_CONVERTER_X86
+    simd_level level = std::min(maxLevel, cpuLevel());
+    if (!mix && level > SIMD_NONE)
+    {
+        m_kernel = select_simd(inFmt, inChannels, outFmt, level);
+        if (m_kernel)
+            m_level = level;
+    }
+#else
+    (void)maxLevel;
+#endif
+    if (!m_kernel)
+        m_kernel = select_c(inFmt, outFmt, mix);
+    if (!m_kernel)
+        return false;
+
+    size_t needed = (size_t)AUDIO_CONVERTER_DEFAULT_SAMPLES * outChannels * av_get_bytes_per_sample(outFmt);
+    if (m_buffer.size() < needed)
+        m_buffer.resize(needed);
+
+    return true;
+}
+
+bool audio_converter::configure(const AVFrame *frame, AVSampleFormat outFmt, int outChannels,
+                                simd_level maxLevel)
+{
+    const int channels = frame_channels(frame);
+    if (!configure((AVSampleFormat)frame->format, channels, outFmt, outChannels, maxLevel))
+        return false;
+
+    // Mix by the channel order the decoder reports
+    channel_masks(frame, channels, m_channelMasks);
+    if (outChannels != channels)
+        build_matrix();
+    return true;
+}
+
+bool audio_converter::matches(const AVFrame *frame) const
+{
+    const int channels = frame_channels(frame);
+    if (!matches((AVSampleFormat)frame->format, channels))
+        return false;
+
+    uint64_t masks[AUDIO_CONVERTER_MAX_CHANNELS];
+    channel_masks(frame, channels, masks);
+    return std::equal(masks, masks + channels, m_channelMasks);
+}
+
+int audio_converter::convert(const uint8_t *const *in, int samples)
+{
+    if (!m_kernel || samples <= 0)
+        return 0;
+
+    size_t bytes = (size_t)samples * m_outChannels * av_get_bytes_per_sample(m_outFmt);
+    if (m_buffer.size() < bytes)
+        m_buffer.resize(bytes);
+
+    m_kernel(in, m_inChannels, m_buffer.data(), m_outChannels, samples, m_matrix);
+    return (int)bytes;
+}
+
+int audio_converter::outputSize(int samples) const
+{
+    return samples * m_outChannels * av_get_bytes_per_sample(m_outFmt);
+}
+
+int audio_converter::convert(const uint8_t *const *in, int samples, uint8_t *out)
+{
+    if (!m_kernel || samples <= 0 || !out)
+        return 0;
+
+    m_kernel(in, m_inChannels, out, m_outChannels, samples, m_matrix);
+    return outputSize(samples);
+}
+
+int audio_converter::convert(const AVFrame *frame)
+{
+    return convert(frame->extended_data, frame->nb_samples);
+}
+
+audio_converter::benchmark_result audio_converter::benchmark(AVSampleFormat inFmt, int inChannels,
+                                                             AVSampleFormat outFmt, int outChannels,
+                                                             int samples, int iterations)
+{
+    benchmark_result result;
+
+    AVFrame *src = av_frame_alloc();
+    AVFrame *dst = av_frame_alloc();
+    src->format = inFmt;
+    src->nb_samples = samples;
+    src->sample_rate = 48000;
+    dst->format = outFmt;
+    dst->nb_samples = samples;
+    dst->sample_rate = 48000;
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
+    src->channel_layout = av_get_default_channel_layout(inChannels);
+    src->channels = inChannels;
+    dst->channel_layout = av_get_default_channel_layout(outChannels);
+    dst->channels = outChannels;
+#else
+    av_channel_layout_default(&src->ch_layout, inChannels);
+    av_channel_layout_default(&dst->ch_layout, outChannels);
+#endif
+    if (av_frame_get_buffer(src, 0) < 0 || av_frame_get_buffer(dst, 0) < 0)
+    {
+        av_frame_free(&src);
+        av_frame_free(&dst);
+        return result;
+    }
+
+    // A sine is enough, the kernels are not data dependent
+    int planes = av_sample_fmt_is_planar(inFmt) ? inChannels : 1;
+    int perPlane = av_sample_fmt_is_planar(inFmt) ? 1 : inChannels;
+    for (int p = 0; p < planes; p++)
+        for (int i = 0; i < samples * perPlane; i++)
+        {
+            double v = 0.8 * std::sin(i * 0.05 + p);
+            uint8_t *d = src->extended_data[p];
+            switch (av_get_packed_sample_fmt(inFmt))
+            {
+            case AV_SAMPLE_FMT_U8:  d[i] = (uint8_t)(128 + v * 127); break;
+            case AV_SAMPLE_FMT_S16: reinterpret_cast<int16_t *>(d)[i] = (int16_t)(v * 32767); break;
+            case AV_SAMPLE_FMT_S32: reinterpret_cast<int32_t *>(d)[i] = (int32_t)(v * 2147483647.0); break;
+            case AV_SAMPLE_FMT_FLT: reinterpret_cast<float *>(d)[i] = (float)v; break;
+            case AV_SAMPLE_FMT_DBL: reinterpret_cast<double *>(d)[i] = v; break;
+            case AV_SAMPLE_FMT_S64: reinterpret_cast<int64_t *>(d)[i] = (int64_t)(v * 9.2e18); break;
+            default: break;
+            }
+        }
+
+    const double totalSamples = (double)samples * iterations;
+    QElapsedTimer timer;
+
+    SwrContext *swr = nullptr;
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
+    swr = swr_alloc_set_opts(nullptr, dst->channel_layout, outFmt, 48000,
+                             src->channel_layout, inFmt, 48000, 0, nullptr);
+#else
+    swr_alloc_set_opts2(&swr, &dst->ch_layout, outFmt, 48000, &src->ch_layout, inFmt, 48000, 0, nullptr);
+#endif
+    if (swr && swr_init(swr) >= 0)
+    {
+        timer.start();
+        for (int n = 0; n < iterations; n++)
+            swr_convert_frame(swr, dst, src);
+        result.swrMsps = totalSamples / qMax<qint64>(1, timer.nsecsElapsed()) * 1e3;
+    }
+    swr_free(&swr);
+
+    audio_converter converter;
+    if (converter.configure(inFmt, inChannels, outFmt, outChannels, SIMD_NONE))
+    {
+        timer.restart();
+        for (int n = 0; n < iterations; n++)
+            converter.convert(src);
+        result.scalarMsps = totalSamples / qMax<qint64>(1, timer.nsecsElapsed()) * 1e3;
+    }
+
+    if (converter.configure(inFmt, inChannels, outFmt, outChannels, SIMD_AUTO))
+    {
+        result.simd = converter.level();
+        timer.restart();
+        for (int n = 0; n < iterations; n++)
+            converter.convert(src);
+        result.simdMsps = totalSamples / qMax<qint64>(1, timer.nsecsElapsed()) * 1e3;
+    }
+
+    av_frame_free(&src);
+    av_frame_free(&dst);
+
+    return result;
+}
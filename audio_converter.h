@@ -0,0 +1,100 @@
+#ifndef AUDIO_CONVERTER_H
+#define AUDIO_CONVERTER_H
+
+#include <cstdint>
+#include <vector>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+#ifdef __cplusplus
+};
+#endif
+
+#define AUDIO_CONVERTER_MAX_CHANNELS    8
+#define AUDIO_CONVERTER_DEFAULT_SAMPLES 4096
+
+// Sample format conversion for the playback and analysis paths. Converts any
+// packed or planar AVSampleFormat to interleaved s16 or f32, optionally
+// downmixing to fewer channels by the input's channel order, into a buffer
+// owned by the converter that is only reallocated when a frame is larger
+// than any seen before.
+//
+// Every (input format, output format, downmix) combination is a separate
+// template instantiation. The common decoder outputs (fltp/flt/s16 stereo
+// and mono) additionally have SSE2 and AVX2 kernels picked at configure()
+// time from the CPU flags FFmpeg detects.
+class audio_converter
+{
+public:
+    enum simd_level
+    {
+        SIMD_NONE,
+        SIMD_SSE2,
+        SIMD_AVX2,
+        SIMD_AUTO
+    };
+
+    audio_converter();
+
+    // outFmt must be AV_SAMPLE_FMT_S16 or AV_SAMPLE_FMT_FLT
+    bool configure(AVSampleFormat inFmt, int inChannels, AVSampleFormat outFmt, int outChannels,
+                   simd_level maxLevel = SIMD_AUTO);
+    bool matches(AVSampleFormat inFmt, int inChannels) const
+    {
+        return m_kernel && inFmt == m_inFmt && inChannels == m_inChannels;
+    }
+    // Same for the format of a decoded frame, downmixing by its channel order
+    bool configure(const AVFrame *frame, AVSampleFormat outFmt, int outChannels,
+                   simd_level maxLevel = SIMD_AUTO);
+    bool matches(const AVFrame *frame) const;
+
+    // Returns the number of bytes written to data(), valid until the next call
+    int convert(const uint8_t *const *in, int samples);
+    int convert(const AVFrame *frame);
+    const uint8_t *data() const { return m_buffer.data(); }
+
+    // Same, into caller owned memory of at least outputSize(samples) bytes
+    int convert(const uint8_t *const *in, int samples, uint8_t *out);
+    int outputSize(int samples) const;
+
+    AVSampleFormat outFormat() const { return m_outFmt; }
+    int outChannels() const { return m_outChannels; }
+    simd_level level() const { return m_level; }
+    static simd_level cpuLevel();
+    static const char *levelName(simd_level level);
+
+    struct benchmark_result
+    {
+        double swrMsps {0};
+        double scalarMsps {0};
+        double simdMsps {0};
+        simd_level simd {SIMD_NONE};
+    };
+    // Million samples per second (per channel) for swr_convert_frame, the
+    // scalar template kernel and the best SIMD kernel
+    static benchmark_result benchmark(AVSampleFormat inFmt, int inChannels,
+                                      AVSampleFormat outFmt, int outChannels,
+                                      int samples, int iterations);
+
+    using kernel_fn = void (*)(const uint8_t *const *in, int inChannels,
+                               uint8_t *out, int outChannels, int samples, const float *matrix);
+
+private:
+    void build_matrix();
+
+    kernel_fn m_kernel {nullptr};
+    AVSampleFormat m_inFmt {AV_SAMPLE_FMT_NONE};
+    AVSampleFormat m_outFmt {AV_SAMPLE_FMT_NONE};
+    int m_inChannels {0};
+    int m_outChannels {0};
+    simd_level m_level {SIMD_NONE};
+    float m_matrix[AUDIO_CONVERTER_MAX_CHANNELS * AUDIO_CONVERTER_MAX_CHANNELS];
+    uint64_t m_channelMasks[AUDIO_CONVERTER_MAX_CHANNELS] {};  // AV_CH_* of each input channel
+    std::vector<uint8_t> m_buffer;
+};
+
+#endif // AUDIO_CONVERTER_H
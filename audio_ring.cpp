@@ -0,0 +1,37 @@
+#include "audio_ring.h"
+
+audio_pull_device::audio_pull_device(audio_ring_buffer *ring, QObject *parent)
+    : QIODevice(parent)
+    , m_ring(ring)
+{
+}
+
+qint64 audio_pull_device::bytesAvailable() const
+{
+    return (qint64)m_ring->available() + QIODevice::bytesAvailable();
+}
+
+qint64 audio_pull_device::readData(char *data, qint64 maxlen)
+{
+    if (maxlen <= 0)
+        return 0;
+
+    size_t n = m_ring->read(data, (size_t)maxlen);
+    if (n > 0)
+        m_primed = true;
+
+    if ((qint64)n < maxlen)
+    {
+        memset(data + n, 0, (size_t)maxlen - n);
+        // Waiting for the first samples is not an underrun
+        if (m_primed)
+            m_ring->countUnderrun();
+    }
+
+    return maxlen;
+}
+
+qint64 audio_pull_device::writeData(const char *, qint64)
+{
+    return -1;
+}
@@ -0,0 +1,126 @@
+#ifndef AUDIO_RING_H
+#define AUDIO_RING_H
+
+#include <QIODevice>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#define AUDIO_RING_MS           500
+#define AUDIO_SINK_BUFFER_MS    40
+
+// Lock-free single-producer / single-consumer byte ring between the audio
+// decoder and the sink. Neither side ever blocks: the decoder drops a block
+// that does not fit (overrun), the sink gets silence for what is missing
+// (underrun). Blocks are written whole so sample frames are never split.
+class audio_ring_buffer
+{
+public:
+    audio_ring_buffer() = default;
+
+    // Not thread safe, call before producer and consumer start
+    void resize(size_t bytes)
+    {
+        size_t size = 1024;
+        while (size < bytes)
+            size <<= 1;
+        m_data.assign(size, 0);
+        m_mask = size - 1;
+        m_head.store(0, std::memory_order_relaxed);
+        m_tail.store(0, std::memory_order_relaxed);
+    }
+
+    audio_ring_buffer(const audio_ring_buffer&) = delete;
+    audio_ring_buffer& operator=(const audio_ring_buffer&) = delete;
+
+    // Producer side
+    size_t write(const char *data, size_t bytes)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        const size_t head = m_head.load(std::memory_order_acquire);
+        const size_t space = capacity() - (tail - head);
+
+        if (bytes > space)
+        {
+            m_overruns.fetch_add(1, std::memory_order_relaxed);
+            m_overrunBytes.fetch_add(bytes, std::memory_order_relaxed);
+            return 0;
+        }
+
+        copy_in(tail, data, bytes);
+        m_tail.store(tail + bytes, std::memory_order_release);
+        return bytes;
+    }
+
+    // Consumer side
+    size_t read(char *data, size_t bytes)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        const size_t tail = m_tail.load(std::memory_order_acquire);
+        const size_t used = tail - head;
+
+        size_t n = bytes < used ? bytes : used;
+        copy_out(head, data, n);
+        m_head.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    void countUnderrun() { m_underruns.fetch_add(1, std::memory_order_relaxed); }
+
+    size_t available() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+    size_t capacity() const { return m_data.size(); }
+    uint64_t underruns() const { return m_underruns.load(std::memory_order_relaxed); }
+    uint64_t overruns() const { return m_overruns.load(std::memory_order_relaxed); }
+    uint64_t overrunBytes() const { return m_overrunBytes.load(std::memory_order_relaxed); }
+
+private:
+    void copy_in(size_t pos, const char *src, size_t n)
+    {
+        size_t offset = pos & m_mask;
+        size_t first = n < capacity() - offset ? n : capacity() - offset;
+        memcpy(m_data.data() + offset, src, first);
+        memcpy(m_data.data(), src + first, n - first);
+    }
+
+    void copy_out(size_t pos, char *dst, size_t n) const
+    {
+        size_t offset = pos & m_mask;
+        size_t first = n < capacity() - offset ? n : capacity() - offset;
+        memcpy(dst, m_data.data() + offset, first);
+        memcpy(dst + first, m_data.data(), n - first);
+    }
+
+    alignas(64) std::atomic<size_t> m_head {0};
+    alignas(64) std::atomic<size_t> m_tail {0};
+    alignas(64) std::atomic<uint64_t> m_underruns {0};
+    std::atomic<uint64_t> m_overruns {0};
+    std::atomic<uint64_t> m_overrunBytes {0};
+    std::vector<char> m_data;
+    size_t m_mask {0};
+};
+
+// Read-only QIODevice a QAudioSink pulls from in pull mode. Always returns
+// what the sink asked for, padding with silence on underrun, so a late
+// decoder shows up as a counter instead of a stopped sink.
+class audio_pull_device : public QIODevice
+{
+public:
+    explicit audio_pull_device(audio_ring_buffer *ring, QObject *parent = nullptr);
+
+    bool isSequential() const override { return true; }
+    qint64 bytesAvailable() const override;
+
+protected:
+    qint64 readData(char *data, qint64 maxlen) override;
+    qint64 writeData(const char *data, qint64 len) override;
+
+private:
+    audio_ring_buffer *m_ring;
+    bool m_primed {false};
+};
+
+#endif // AUDIO_RING_H
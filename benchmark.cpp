@@ -0,0 +1,67 @@
+#include "benchmark.h"
+#include "sws_converter.h"
+#include "audio_converter.h"
+#include "spectrum_kernels.h"
+
+#include <QThread>
+#include <iostream>
+#include <iomanip>
+
+static void benchmark_sws(int srcW, int srcH, int dstW, int dstH, int frames)
+{
+    int threads = qBound(1, QThread::idealThreadCount(), SWS_MAX_SLICES);
+    auto r = sws_converter::benchmark(srcW, srcH, AV_PIX_FMT_YUV420P,
+                                      dstW, dstH, AV_PIX_FMT_RGB32, frames, threads);
+
+    std::cout << "sws " << srcW << "x" << srcH << " yuv420p -> " << dstW << "x" << dstH << " rgb32"
+              << std::fixed << std::setprecision(1)
+              << "  per-frame context: " << r.perFrameFps << " fps"
+              << "  cached: " << r.cachedFps << " fps"
+              << "  cached x" << threads << " bands: " << r.slicedFps << " fps" << std::endl;
+}
+
+static void benchmark_audio(AVSampleFormat inFmt, int inChannels, AVSampleFormat outFmt, int outChannels)
+{
+    auto r = audio_converter::benchmark(inFmt, inChannels, outFmt, outChannels, 1024, 20000);
+
+    std::cout << "audio " << av_get_sample_fmt_name(inFmt) << " x" << inChannels << " -> "
+              << av_get_sample_fmt_name(outFmt) << " x" << outChannels
+              << std::fixed << std::setprecision(1)
+              << "  swr_convert_frame: " << r.swrMsps << " Msps"
+              << "  c: " << r.scalarMsps << " Msps"
+              << "  " << audio_converter::levelName(r.simd) << ": " << r.simdMsps << " Msps" << std::endl;
+}
+
+static bool benchmark_spectrum(int bins)
+{
+    auto r = spectrum_kernels::benchmark(bins, 200000 / qMax(1, bins / 256));
+    bool accurate = r.maxErrorDb <= SPECTRUM_DB_MAX_ERROR;
+
+    std::cout << "spectrum " << bins << " bins power+dB+smooth"
+              << std::fixed << std::setprecision(1)
+              << "  c: " << r.scalarMbps << " Mbins/s"
+              << "  " << audio_converter::levelName(r.simd) << ": " << r.simdMbps << " Mbins/s"
+              << std::scientific << std::setprecision(2)
+              << "  max dB error: " << r.maxErrorDb << (accurate ? "" : " EXCEEDS BOUND") << std::endl;
+    return accurate;
+}
+
+int run_benchmarks()
+{
+    benchmark_sws(1920, 1080, 1920, 1080, 240);
+    benchmark_sws(3840, 2160, 3840, 2160, 60);
+    benchmark_sws(3840, 2160, 960, 540, 120);
+
+    benchmark_audio(AV_SAMPLE_FMT_FLTP, 2, AV_SAMPLE_FMT_S16, 2);
+    benchmark_audio(AV_SAMPLE_FMT_FLTP, 2, AV_SAMPLE_FMT_FLT, 2);
+    benchmark_audio(AV_SAMPLE_FMT_FLT, 2, AV_SAMPLE_FMT_S16, 2);
+    benchmark_audio(AV_SAMPLE_FMT_S16, 2, AV_SAMPLE_FMT_FLT, 2);
+    benchmark_audio(AV_SAMPLE_FMT_S16P, 2, AV_SAMPLE_FMT_S16, 2);
+    benchmark_audio(AV_SAMPLE_FMT_FLTP, 6, AV_SAMPLE_FMT_S16, 2);
+
+    bool ok = true;
+    ok &= benchmark_spectrum(2048);
+    ok &= benchmark_spectrum(32768);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,7 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+// Micro benchmarks of the processing engine, run with --benchmark.
+int run_benchmarks();
+
+#endif // BENCHMARK_H
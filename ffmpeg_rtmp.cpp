@@ -1,5 +1,9 @@
 #include "ffmpeg_rtmp.h"
+#include "flv_pipe.h"
 #include <QStandardPaths>
+#include <QDir>
+#include <QRegularExpression>
+#include <QtMath>
 
 #define STR(x) #x
 #define XSTR(x) STR(x)
@@ -55,39 +59,61 @@ ffmpeg_rtmp::ffmpeg_rtmp(QObject *parent)
 void ffmpeg_rtmp::stop()
 {
     m_stop = true;
+    if (m_pipe)
+        m_pipe->close();
 }
 
-void ffmpeg_rtmp::setUrl()
+ffmpeg_rtmp::~ffmpeg_rtmp()
 {
-    bool found = false;
-    foreach(QNetworkInterface interface, QNetworkInterface::allInterfaces())
-    {
-        if (interface.flags().testFlag(QNetworkInterface::IsUp) && !interface.flags().testFlag(QNetworkInterface::IsLoopBack))
-            foreach (QNetworkAddressEntry entry, interface.addressEntries())
-            {
-                //qDebug() << entry.ip().toString() + " " + interface.hardwareAddress()  + " " + interface.humanReadableName();
-                if ( !found && interface.hardwareAddress() != "00:00:00:00:00:00" && entry.ip().toString().contains(".")
-                     && !interface.humanReadableName().contains("VM") && !interface.hardwareAddress().startsWith("00:") && interface.hardwareAddress() != "")
-                {
-                    in_filename  = "rtmp://" + entry.ip().toString() + ":8889/live";
-                    qDebug() << in_filename;
-                    emit sendUrl(in_filename);
-                    found = true;
-                }
-            }
-    }
+    stop();
+    wait();
 }
 
+void ffmpeg_rtmp::setInput(const QString &streamKey, std::shared_ptr<flv_pipe> pipe, const QString &outputDir)
+{
+    m_streamKey = streamKey;
+    m_pipe = std::move(pipe);
+
+    QString fileKey = streamKey;
+    fileKey.replace(QRegularExpression("[^A-Za-z0-9_.-]"), "_");
+    out_filename = QDir(outputDir).filePath(QString("output_%1.mp4").arg(fileKey));
+}
+
+int ffmpeg_rtmp::read_pipe(void *opaque, uint8_t *buf, int buf_size)
+{
+    auto *self = static_cast<ffmpeg_rtmp*>(opaque);
+    int n = self->m_pipe->read(buf, buf_size);
+    return n > 0 ? n : AVERROR_EOF;
+}
 
 int ffmpeg_rtmp::prepare_ffmpeg()
 {
-    // Open the RTMP stream
-    AVDictionary *format_opts = NULL;
-    av_dict_set(&format_opts, "timeout", "30", 0);
+    // FLV stream handed over by rtmp_server for this stream key
+    const int ioBufferSize = 32768;
+    uint8_t *ioBuffer = static_cast<uint8_t*>(av_malloc(ioBufferSize));
+    if (!ioBuffer) {
+        qDebug() << "error av_malloc";
+        return false;
+    }
+
+    inputIoContext = avio_alloc_context(ioBuffer, ioBufferSize, 0, this, &ffmpeg_rtmp::read_pipe, nullptr, nullptr);
+    if (!inputIoContext) {
+        av_free(ioBuffer);
+        qDebug() << "error avio_alloc_context";
+        return false;
+    }
+
+    inputContext = avformat_alloc_context();
+    if (!inputContext) {
+        qDebug() << "error avformat_alloc_context";
+        return false;
+    }
+    inputContext->pb = inputIoContext;
+    inputContext->flags |= AVFMT_FLAG_CUSTOM_IO;
 
-    if (avformat_open_input(&inputContext, in_filename.toStdString().c_str() , nullptr, &format_opts) != 0) {
+    if (avformat_open_input(&inputContext, nullptr, av_find_input_format("flv"), nullptr) != 0) {
         // Error handling
-        qDebug() << "timeout, avformat_open_input";
+        qDebug() << "error avformat_open_input";
         return false;
     }
 
@@ -140,53 +166,71 @@ int ffmpeg_rtmp::prepare_ffmpeg()
         qDebug() << "error avformat_write_header";
         return false;
     }
-
-    auto video_codec = avcodec_find_decoder(vid_stream->codecpar->codec_id);
-    if (!video_codec) {
-        qDebug() << "error video avcodec_find_decoder";
-        return false;
+    outputHeaderWritten = true;
+
+    // Every stream is recorded as is, only the ones present get a decoder.
+    // A stream that can not be decoded is still recorded, just not shown.
+    if (vid_stream && !open_decoder(vid_stream, &videoCodecContext, &video_frame)) {
+        post_info("Video stream can not be decoded, recording only.");
+        vid_stream = nullptr;
+        video_idx = -1;
+    }
+    if (aud_stream && !open_decoder(aud_stream, &audioCodecContext, &audio_frame)) {
+        post_info("Audio stream can not be decoded, recording only.");
+        aud_stream = nullptr;
+        audio_idx = -1;
     }
-    videoCodecContext = avcodec_alloc_context3(video_codec);
 
-    if(avcodec_parameters_to_context(videoCodecContext, vid_stream->codecpar)<0)
-        std::cout << 512;
+    return true;
+}
 
-    if (avcodec_open2(videoCodecContext, video_codec, nullptr)<0) {
-        std::cout << 5;
+bool ffmpeg_rtmp::open_decoder(AVStream *stream, AVCodecContext **context, AVFrame **frame)
+{
+    auto codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (!codec) {
+        qDebug() << "error avcodec_find_decoder" << avcodec_get_name(stream->codecpar->codec_id);
         return false;
     }
 
-    auto audio_codec = avcodec_find_decoder(aud_stream->codecpar->codec_id);
-    if (!audio_codec) {
-        qDebug() << "error audio avcodec_find_decoder";
+    *context = avcodec_alloc_context3(codec);
+    *frame = av_frame_alloc();
+    if (!*context || !*frame ||
+        avcodec_parameters_to_context(*context, stream->codecpar) < 0 ||
+        avcodec_open2(*context, codec, nullptr) < 0) {
+        qDebug() << "error opening decoder" << avcodec_get_name(stream->codecpar->codec_id);
+        avcodec_free_context(context);
+        av_frame_free(frame);
         return false;
     }
-    audioCodecContext = avcodec_alloc_context3(audio_codec);
-    /* put sample parameters */
 
-    if(avcodec_parameters_to_context(audioCodecContext, aud_stream->codecpar)<0)
-        std::cout << 512;
+    return true;
+}
 
-    if (avcodec_open2(audioCodecContext, audio_codec, nullptr)<0) {
-        std::cout << 5;
-        return false;
-    }
+void ffmpeg_rtmp::close_ffmpeg()
+{
+    if (outputContext && outputHeaderWritten)
+        av_write_trailer(outputContext);
+    outputHeaderWritten = false;
 
-    video_frame = av_frame_alloc();
-    if (!video_frame) {
-        qDebug() << "error video av_frame_alloc";
-        avcodec_free_context(&videoCodecContext);
-        return false;
+    avformat_close_input(&inputContext);
+    if (inputIoContext) {
+        av_freep(&inputIoContext->buffer);
+        avio_context_free(&inputIoContext);
     }
+    if (outputContext && !(outputContext->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&outputContext->pb);
+    avformat_free_context(outputContext);
+    outputContext = nullptr;
 
-    audio_frame = av_frame_alloc();
-    if (!audio_frame) {
-        qDebug() << "error audio av_frame_alloc";
-        avcodec_free_context(&audioCodecContext);
-        return false;
-    }
+    avcodec_free_context(&videoCodecContext);
+    avcodec_free_context(&audioCodecContext);
+    av_frame_free(&video_frame);
+    av_frame_free(&audio_frame);
 
-    return true;
+    vid_stream = nullptr;
+    aud_stream = nullptr;
+    video_idx = -1;
+    audio_idx = -1;
 }
 
 int ffmpeg_rtmp::start_audio_device()
@@ -199,31 +243,53 @@ int ffmpeg_rtmp::start_audio_device()
         return false;
     }
 #if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
-    format.setChannelCount(audioCodecContext->channels);
+    int channels = qMin(audioCodecContext->channels, 2);
 #else
-    format.setChannelCount(audioCodecContext->ch_layout.nb_channels);
+    int channels = qMin(audioCodecContext->ch_layout.nb_channels, 2);
 #endif
+    // audio_converter downmixes anything wider than stereo
+    format.setChannelCount(channels);
     format.setSampleRate(audioCodecContext->sample_rate);
     format.setSampleFormat(QAudioFormat::Int16);
-    format.setChannelConfig(QAudioFormat::ChannelConfigStereo);
+    format.setChannelConfig(channels == 1 ? QAudioFormat::ChannelConfigMono : QAudioFormat::ChannelConfigStereo);
 
     qDebug() << format.sampleRate() << format.channelCount() << format.sampleFormat();
 
-    m_audioSinkOutput.reset(new QAudioSink(deviceInfo, format));
-    int bufferSize = 4096; // Set your desired buffer size in bytes
-
-    m_audioSinkOutput->setBufferSize(bufferSize);
-
-    m_ioAudioDevice = m_audioSinkOutput->start();
-
-    qreal initialVolume = QAudio::convertVolume(m_audioSinkOutput->volume(),
-                                                QAudio::LinearVolumeScale,
-                                                QAudio::LogarithmicVolumeScale);
-
+    // Decoder and sink only meet in the ring, neither waits for the other
+    m_audioRing.resize(format.bytesForDuration(AUDIO_RING_MS * 1000));
+
+    // Pull mode is driven by the sink's timers, which need an event loop the
+    // stage threads do not have
+    m_audioOutputThread.reset(new QThread);
+    m_audioOutputThread->setObjectName("audio output");
+    m_audioContext = new QObject;
+    m_audioContext->moveToThread(m_audioOutputThread.data());
+    m_audioOutputThread->start();
+
+    bool started = false;
+    qreal initialVolume = 0;
+    QMetaObject::invokeMethod(m_audioContext, [&]() {
+        m_audioSinkOutput.reset(new QAudioSink(deviceInfo, format));
+        m_audioSinkOutput->setBufferSize(format.bytesForDuration(AUDIO_SINK_BUFFER_MS * 1000));
+
+        m_audioPullDevice.reset(new audio_pull_device(&m_audioRing));
+        m_audioPullDevice->open(QIODevice::ReadOnly);
+        m_audioSinkOutput->start(m_audioPullDevice.data());
+        started = m_audioSinkOutput->error() == QAudio::NoError;
+
+        initialVolume = QAudio::convertVolume(m_audioSinkOutput->volume(),
+                                              QAudio::LinearVolumeScale,
+                                              QAudio::LogarithmicVolumeScale);
+    }, Qt::BlockingQueuedConnection);
+
+    if (!started) {
+        stop_audio_device();
+        return false;
+    }
 
     info = "Audio Device: " + deviceInfo.description() + " Volume: " + QString::number(initialVolume) + " Ch: " + QString::number(format.channelCount());
     qDebug() << info;
-    emit sendInfo(info);
+    post_info(info);
 
     return true;
 }
@@ -236,140 +302,127 @@ int ffmpeg_rtmp::set_audio_device(QAudioDevice &audio_device)
 
 int ffmpeg_rtmp::set_parameters()
 {
-    int videoWidth = 0;
-    int videoHeight = 0;
-
-    AVCodecParameters* codecVideoParams = inputContext->streams[video_idx]->codecpar;
-    if (!codecVideoParams)
-        return false;
-
-    AVCodecID codecVideoId = codecVideoParams->codec_id;
-    auto codecVideoName = avcodec_get_name(codecVideoId);
-    videoWidth = codecVideoParams->width;
-    videoHeight = codecVideoParams->height;
-
-    AVCodecParameters* codecAudioParams = inputContext->streams[audio_idx]->codecpar;
-    if (!codecAudioParams)
-        return false;
-
-    AVCodecID codecAudioId = codecAudioParams->codec_id;
-    auto codecAudioName = avcodec_get_name(codecAudioId);
+    if (video_idx != -1)
+    {
+        AVCodecParameters* codecVideoParams = inputContext->streams[video_idx]->codecpar;
+        if (!codecVideoParams)
+            return false;
 
-    info = "Video Codec: " + QString(codecVideoName);
-    emit sendInfo(info);
+        auto codecVideoName = avcodec_get_name(codecVideoParams->codec_id);
+        info = "Video Codec: " + QString(codecVideoName);
+        post_info(info);
 
-    info = "Video width: " + QString::number(videoWidth) + " Video height: " + QString::number(videoHeight);
-    emit sendInfo(info);
+        info = "Video width: " + QString::number(codecVideoParams->width) + " Video height: " + QString::number(codecVideoParams->height);
+        post_info(info);
 
-    // Get pixel format name
-    const char* pixelFormatName = av_get_pix_fmt_name(static_cast<AVPixelFormat>(codecVideoParams->format));
-    if (!pixelFormatName) {
-        info = "Unknown pixel format";
-    } else {
-        QString pixelFormat = QString::fromUtf8(pixelFormatName);
-        info = "Video Pixel Format: " + pixelFormat;
+        // Get pixel format name
+        const char* pixelFormatName = av_get_pix_fmt_name(static_cast<AVPixelFormat>(codecVideoParams->format));
+        if (!pixelFormatName) {
+            info = "Unknown pixel format";
+        } else {
+            QString pixelFormat = QString::fromUtf8(pixelFormatName);
+            info = "Video Pixel Format: " + pixelFormat;
+        }
+        post_info(info);
+    }
+    else
+    {
+        post_info("No video stream.");
     }
-    emit sendInfo(info);
 
-    info = "Audio Codec: " + QString(codecAudioName) + " sr: " + QString::number(codecAudioParams->sample_rate);
-    emit sendInfo(info);
+    if (audio_idx != -1)
+    {
+        AVCodecParameters* codecAudioParams = inputContext->streams[audio_idx]->codecpar;
+        if (!codecAudioParams)
+            return false;
+
+        auto codecAudioName = avcodec_get_name(codecAudioParams->codec_id);
+        info = "Audio Codec: " + QString(codecAudioName) + " sr: " + QString::number(codecAudioParams->sample_rate);
+        post_info(info);
 #if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
-    info = "Audio Format: " + QString(av_get_sample_fmt_name(audioCodecContext->sample_fmt)) + " Channels: " + QString::number(codecAudioParams->channels);
+        info = "Audio Format: " + QString(av_get_sample_fmt_name(audioCodecContext->sample_fmt)) + " Channels: " + QString::number(codecAudioParams->channels);
 #else
-    info = "Audio Format: " + QString(av_get_sample_fmt_name(audioCodecContext->sample_fmt)) + " Channels: " + QString::number(codecAudioParams->ch_layout.nb_channels);
+        info = "Audio Format: " + QString(av_get_sample_fmt_name(audioCodecContext->sample_fmt)) + " Channels: " + QString::number(codecAudioParams->ch_layout.nb_channels);
 #endif
-    emit sendInfo(info);
+        post_info(info);
+    }
+    else
+    {
+        post_info("No audio stream.");
+    }
 
     return true;
 }
 
-int ffmpeg_rtmp::init_swr_context(AVSampleFormat out_format)
+void ffmpeg_rtmp::start_streamer()
 {
+    if (!m_pipe || !prepare_ffmpeg())
+    {
+        emit sendConnectionStatus(false);
+        close_ffmpeg();
+        return;
+    }
 
-    swrAudioContext = swr_alloc();
-    if (!swrAudioContext) {
-        fprintf(stderr, "Error allocating SwrContext.\n");
-        return false;
+    // Print the codecs of the streams that are decoded
+    if (!set_parameters())
+    {
+        emit sendConnectionStatus(false);
+        close_ffmpeg();
+        return;
     }
 
-#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
-    av_opt_set_channel_layout(swrAudioContext, "in_channel_layout", audioCodecContext->channel_layout, 0);
-    av_opt_set_channel_layout(swrAudioContext, "out_channel_layout", audioCodecContext->channel_layout, 0);
-#else
-    av_opt_set_chlayout(swrAudioContext, "in_channel_layout", &audioCodecContext->ch_layout, 0);
-    av_opt_set_chlayout(swrAudioContext, "out_channel_layout", &audioCodecContext->ch_layout, 0);
-#endif
-    av_opt_set_int(swrAudioContext, "in_sample_rate", audioCodecContext->sample_rate, 0);
-    av_opt_set_int(swrAudioContext, "out_sample_rate", audioCodecContext->sample_rate, 0);
-    av_opt_set_sample_fmt(swrAudioContext, "in_sample_fmt", audioCodecContext->sample_fmt, 0);
-    av_opt_set_sample_fmt(swrAudioContext, "out_sample_fmt", out_format, 0);
+    emit sendConnectionStatus(true);
 
-    if (swr_init(swrAudioContext) < 0) {
-        fprintf(stderr, "Error initializing SwrContext.\n");
-        return false;
-    }
+    // Remux is the only stage allowed to push back on the reader, preview and
+    // playback stages drop packets instead of slowing the recording down.
+    m_readerDone = false;
+    QScopedPointer<QThread> remuxThread(QThread::create([this] { remux_stage(); }));
+    QScopedPointer<QThread> audioThread(QThread::create([this] { audio_stage(); }));
+    QScopedPointer<QThread> videoThread(QThread::create([this] { video_stage(); }));
+    remuxThread->start();
+    audioThread->start();
+    videoThread->start();
 
-    return true;
-}
+    read_stage();
 
-AVFrame* ffmpeg_rtmp::convert_audio_frame(AVSampleFormat out_format)
-{
-    AVFrame* convertedAudioFrame = av_frame_alloc();
-    if (!convertedAudioFrame) {
-        fprintf(stderr, "Error allocating converted audio AVFrame.\n");
-        return NULL;
-    }
+    m_readerDone = true;
+    remuxThread->wait();
+    audioThread->wait();
+    videoThread->wait();
 
-#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
-    convertedAudioFrame->channel_layout = audioCodecContext->channel_layout;
-#else
-    convertedAudioFrame->ch_layout = audioCodecContext->ch_layout;
-#endif
-    convertedAudioFrame->format = out_format;
-    convertedAudioFrame->sample_rate = audioCodecContext->sample_rate;
-    convertedAudioFrame->nb_samples = audio_frame->nb_samples;
+    emit sendConnectionStatus(false);
 
-    if (av_frame_get_buffer(convertedAudioFrame, 0) < 0) {
-        fprintf(stderr, "Error allocating converted frame buffer.\n");
-        av_frame_free(&convertedAudioFrame);
-        return NULL;
-    }
-    swr_convert_frame(swrAudioContext, convertedAudioFrame, audio_frame);
-    return convertedAudioFrame;
+    // Write the output file trailer and close input and output contexts
+    close_ffmpeg();
 }
 
-void ffmpeg_rtmp::start_streamer()
+void ffmpeg_rtmp::wait_for_queue()
 {
-    while (!prepare_ffmpeg())
-    {
-//        emit sendConnectionStatus(false);
-        QThread::msleep(100);
-    }
-
-    if (!start_audio_device())
-    {
-        emit sendConnectionStatus(false);
-        return;
-    }
+    QThread::usleep(PIPELINE_IDLE_WAIT_US);
+}
 
-    // Print the video codec
-    if (video_idx != -1 && audio_idx != -1) {
-        if (!set_parameters())
-        {
-            emit sendConnectionStatus(false);
-            return;
-        }
+bool ffmpeg_rtmp::pop_packet(spsc_queue<AVPacket*> &queue, AVPacket *&packet)
+{
+    // Back off while the queue stays empty, a stage without demand then
+    // costs a few hundred wakeups per second instead of thousands
+    unsigned long idleWait = PIPELINE_IDLE_WAIT_US;
 
-    } else {
-        info = "Video or Audio stream not found ";
-        emit sendInfo(info);
-        return;
+    while (!queue.pop(packet))
+    {
+        // The reader is done only after its last push, one more pop drains it
+        if (m_readerDone)
+            return queue.pop(packet);
+        QThread::usleep(idleWait);
+        idleWait = qMin<unsigned long>(idleWait * 2, PIPELINE_IDLE_MAX_WAIT_US);
     }
+    return true;
+}
 
-    emit sendConnectionStatus(true);
-
-    // Read packets from the input stream and write to the output file
+void ffmpeg_rtmp::read_stage()
+{
     AVPacket* packet = av_packet_alloc();
+    bool videoNeedsKeyframe = false;
+    int lastVideoDemand = VIDEO_DEMAND_NONE;
 
     while (!m_stop)
     {
@@ -381,178 +434,353 @@ void ffmpeg_rtmp::start_streamer()
             break;
         }
 
-        AVStream* inputStream = inputContext->streams[packet->stream_index];
-        AVStream* outputStream = outputContext->streams[packet->stream_index];
-
-        if (packet->stream_index >= 0 && (unsigned int)packet->stream_index < inputContext->nb_streams)
+        if (packet->stream_index < 0 || (unsigned int)packet->stream_index >= inputContext->nb_streams)
         {
+            av_packet_unref(packet);
+            continue;
+        }
 
-            if (packet->stream_index == audio_idx)
+        if (packet->stream_index == audio_idx)
+        {
+            // Nobody listens and no spectrum is shown, leave the AAC undecoded
+            if (m_audioDemand)
             {
-                int ret = avcodec_send_packet(audioCodecContext, packet);
-                if (ret < 0 || ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    std::cout << "audio avcodec_send_packet: " << ret << std::endl;
-                    break;
-                }
+                AVPacket *audioPacket = av_packet_clone(packet);
+                if (audioPacket && !m_audioQueue.push(audioPacket))
+                    av_packet_free(&audioPacket);
+            }
+            else
+            {
+                m_audioSkipped++;
+            }
+        }
+        // for preview
+        else if (packet->stream_index == video_idx)
+        {
+            int demand = m_videoDemand;
+            bool key = packet->flags & AV_PKT_FLAG_KEY;
 
-                while (ret >= 0) {
-                    ret = avcodec_receive_frame(audioCodecContext, audio_frame);
-                    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                        break;
-                    }
-
-                    if (m_ioAudioDevice)
-                    {
-                        if (av_sample_fmt_is_planar(audioCodecContext->sample_fmt) == 1)
-                        {
-                            // Calculate the total number of samples in the frame
-                            int numSamples = audio_frame->nb_samples;
-                            int channels = audioCodecContext->ch_layout.nb_channels;
-
-                            // Allocate memory for the PCM 16-bit frame
-                            int16_t* pcm16Frame = new int16_t[numSamples * channels];
-                            auto f_contstant = 32767.0f;
-
-                            // Convert planar float frame to PCM 16-bit frame
-                            for (int i = 0; i < numSamples; ++i)
-                            {
-                                const float* const* planarFloatData = reinterpret_cast<const float* const*>(audio_frame->extended_data);
-
-                                for (int channel = 0; channel < channels; ++channel)
-                                {
-                                    // Scale the float sample to the range of int16_t (-32768 to 32767)
-                                    float scaledSample = planarFloatData[channel][i] * f_contstant;
-
-                                    // Clamp the sample value to the valid range of int16_t
-                                    scaledSample = std::clamp<float>(scaledSample, -1 * f_contstant, f_contstant);
-
-                                    // Convert to int16_t with rounding
-                                    pcm16Frame[i * channels + channel] = static_cast<int16_t>(scaledSample + 0.5f);
-                                }
-                            }
-
-                            int bytesToWrite = numSamples * channels * sizeof(int16_t);
-
-                            // Write the PCM 16-bit frame to m_ioAudioDevice
-                            const char* pcm16FramePtr = reinterpret_cast<const char*>(pcm16Frame);
-                            emit sendAudioFrame(pcm16FramePtr, bytesToWrite);
-
-                            qint64 totalBytesWritten = 0;
-
-                            while (totalBytesWritten < bytesToWrite) {
-                                qint64 bytesWritten = m_ioAudioDevice->write(pcm16FramePtr + totalBytesWritten, bytesToWrite - totalBytesWritten);
-                                if (bytesWritten == -1) {
-                                    // Handle the error case
-                                    break;
-                                }
-                                totalBytesWritten += bytesWritten;
-                            }
-
-                            // Clean up the allocated memory
-                            delete[] pcm16Frame;
-                        }
-                        else
-                        {
-                            m_ioAudioDevice->write(reinterpret_cast<char*>(audio_frame->data[0]), audio_frame->linesize[0]);
-                        }
-                    }
-
-                    av_frame_unref(audio_frame);
-                }
+            // Frames decoded since the last keyframe are missing, resync first
+            if (demand == VIDEO_DEMAND_ALL && lastVideoDemand != VIDEO_DEMAND_ALL)
+                videoNeedsKeyframe = true;
+            lastVideoDemand = demand;
+
+            // After a drop the decoder can only resync on the next keyframe
+            if (videoNeedsKeyframe && key)
+                videoNeedsKeyframe = false;
+
+            if (demand == VIDEO_DEMAND_NONE || (demand == VIDEO_DEMAND_KEYFRAMES && !key))
+            {
+                m_videoSkipped++;
             }
-            // for preview
-            else if (packet->stream_index == video_idx)
+            else if (!videoNeedsKeyframe)
             {
-                int ret = avcodec_send_packet(videoCodecContext, packet);
-                if (ret < 0 || ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    std::cout << "video avcodec_send_packet: " << ret << std::endl;
-                    break;
-                }
-                while (ret  >= 0) {
-                    ret = avcodec_receive_frame(videoCodecContext, video_frame);
-                    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                        //std::cout << "video avcodec_receive_frame: " << ret << std::endl;
-                        break;
-                    }
-
-                    SwsContext* swsContext = sws_getContext(video_frame->width, video_frame->height, videoCodecContext->pix_fmt,
-                                                            video_frame->width, video_frame->height, AV_PIX_FMT_RGB32,
-                                                            SWS_BILINEAR, nullptr, nullptr, nullptr);
-                    if (!swsContext) {
-                        std::cout << "Failed to create SwsContext" << std::endl;
-                        break;
-                    }
-
-                    // Initialize the SwsContext
-                    auto ret = sws_init_context(swsContext, nullptr, nullptr);
-                    if (ret < 0) {
-                        std::cout << "Failed to init SwsContext" << std::endl;
-                        break;
-                    }
-
-                    uint8_t* destData[1] = { nullptr };
-                    int destLinesize[1] = { 0 };
-
-                    QImage image(video_frame->width, video_frame->height, QImage::Format_RGB32);
-
-                    destData[0] = image.bits();
-                    destLinesize[0] = image.bytesPerLine();
-
-                    sws_scale(swsContext, video_frame->data, video_frame->linesize, 0, video_frame->height, destData, destLinesize);
-                    emit sendVideoFrame(image);
-
-                    // Cleanup
-                    sws_freeContext(swsContext);
-                    av_frame_unref(video_frame);
+                AVPacket *videoPacket = av_packet_clone(packet);
+                if (videoPacket && !m_videoQueue.push(videoPacket))
+                {
+                    av_packet_free(&videoPacket);
+                    videoNeedsKeyframe = true;
                 }
             }
+        }
 
-            // Rescale packet timestamps
-            packet->pts = av_rescale_q(packet->pts, inputStream->time_base, outputStream->time_base);
-            packet->dts = av_rescale_q(packet->dts, inputStream->time_base, outputStream->time_base);
-            packet->duration = av_rescale_q(packet->duration, inputStream->time_base, outputStream->time_base);
-            packet->pos = -1;
-
-            int ret = av_interleaved_write_frame(outputContext, packet);
-            if (ret < 0) {
-                if (ret == AVERROR(EAGAIN)) {
-                    // Handle EAGAIN error
-                } else if (ret == AVERROR_EOF) {
-                    // Handle EOF error
-                } else {
-                    // Handle other errors
-                    char error_buffer[AV_ERROR_MAX_STRING_SIZE];
-                    av_strerror(ret, error_buffer, sizeof(error_buffer));
-                    qDebug() << "Error writing frame: " << error_buffer;
-                }
+        // Recording never drops, a full remux queue backs up into the publisher
+        AVPacket *remuxPacket = av_packet_alloc();
+        av_packet_move_ref(remuxPacket, packet);
+        while (m_remuxQueue.full() && !m_stop)
+            wait_for_queue();
+        if (!m_remuxQueue.push(remuxPacket))
+            av_packet_free(&remuxPacket);
+    }
+
+    av_packet_free(&packet);
+}
+
+void ffmpeg_rtmp::remux_stage()
+{
+    AVPacket *packet = nullptr;
+
+    while (pop_packet(m_remuxQueue, packet))
+    {
+
+        AVStream* inputStream = inputContext->streams[packet->stream_index];
+        AVStream* outputStream = outputContext->streams[packet->stream_index];
+
+        // Rescale packet timestamps
+        packet->pts = av_rescale_q(packet->pts, inputStream->time_base, outputStream->time_base);
+        packet->dts = av_rescale_q(packet->dts, inputStream->time_base, outputStream->time_base);
+        packet->duration = av_rescale_q(packet->duration, inputStream->time_base, outputStream->time_base);
+        packet->pos = -1;
+
+        int ret = av_interleaved_write_frame(outputContext, packet);
+        if (ret < 0) {
+            if (ret == AVERROR(EAGAIN)) {
+                // Handle EAGAIN error
+            } else if (ret == AVERROR_EOF) {
+                // Handle EOF error
+            } else {
+                // Handle other errors
+                char error_buffer[AV_ERROR_MAX_STRING_SIZE];
+                av_strerror(ret, error_buffer, sizeof(error_buffer));
+                qDebug() << "Error writing frame: " << error_buffer;
             }
         }
 
-        av_packet_unref(packet);
+        av_packet_free(&packet);
     }
+}
 
-    emit sendConnectionStatus(false);
-    m_audioSinkOutput->stop();
+void ffmpeg_rtmp::audio_stage()
+{
+    AVPacket *packet = nullptr;
+    bool playbackWanted = false;
+    bool playing = false;
 
-    // Write the output file trailer
-    av_write_trailer(outputContext);
+    while (pop_packet(m_audioQueue, packet))
+    {
+        // Only the previewed session plays audio and the user can turn it
+        // off, the output follows between packets
+        if (m_playback != playbackWanted)
+        {
+            playbackWanted = m_playback;
+            if (playing)
+                stop_audio_device();
+            playing = playbackWanted && start_audio_device();
+            if (playbackWanted && !playing)
+                post_info("Audio playback disabled.");
+        }
 
-    // Close input and output contexts
-    avformat_close_input(&inputContext);
-    if (outputContext && !(outputContext->oformat->flags & AVFMT_NOFILE))
-        avio_close(outputContext->pb);
-    avformat_free_context(outputContext);
+        int ret = avcodec_send_packet(audioCodecContext, packet);
+        av_packet_free(&packet);
+        if (ret < 0) {
+            std::cout << "audio avcodec_send_packet: " << ret << std::endl;
+            continue;
+        }
+
+        while (ret >= 0) {
+            ret = avcodec_receive_frame(audioCodecContext, audio_frame);
+            if (ret < 0)
+                break;
+
+            process_audio_frame();
+            av_frame_unref(audio_frame);
+        }
+    }
+
+    stop_audio_device();
+}
+
+void ffmpeg_rtmp::stop_audio_device()
+{
+    if (!m_audioOutputThread)
+        return;
+
+    QMetaObject::invokeMethod(m_audioContext, [this]() {
+        if (m_audioSinkOutput)
+            m_audioSinkOutput->stop();
+        m_audioSinkOutput.reset();
+        m_audioPullDevice.reset();
+    }, Qt::BlockingQueuedConnection);
+
+    m_audioOutputThread->quit();
+    m_audioOutputThread->wait();
+    delete m_audioContext;
+    m_audioContext = nullptr;
+    m_audioOutputThread.reset();
+}
 
-    if (m_stop)
+void ffmpeg_rtmp::video_stage()
+{
+    AVPacket *packet = nullptr;
+    int lastDemand = VIDEO_DEMAND_NONE;
+
+    while (pop_packet(m_videoQueue, packet))
+    {
+        // The reader only forwards what is demanded, the decoder is told as
+        // well so it does not reference frames it never saw
+        int demand = m_videoDemand;
+        if (demand != lastDemand)
+        {
+            if (demand == VIDEO_DEMAND_ALL)
+                avcodec_flush_buffers(videoCodecContext);
+            videoCodecContext->skip_frame = (demand == VIDEO_DEMAND_ALL) ? AVDISCARD_DEFAULT : AVDISCARD_NONKEY;
+            lastDemand = demand;
+        }
+
+        int ret = avcodec_send_packet(videoCodecContext, packet);
+        av_packet_free(&packet);
+        if (ret < 0) {
+            std::cout << "video avcodec_send_packet: " << ret << std::endl;
+            continue;
+        }
+
+        while (ret >= 0) {
+            ret = avcodec_receive_frame(videoCodecContext, video_frame);
+            if (ret < 0)
+                break;
+
+            process_video_frame();
+            av_frame_unref(video_frame);
+        }
+    }
+}
+
+void ffmpeg_rtmp::process_audio_frame()
+{
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
+    int channels = audio_frame->channels;
+#else
+    int channels = audio_frame->ch_layout.nb_channels;
+#endif
+    AVSampleFormat format = (AVSampleFormat)audio_frame->format;
+
+    // Playback and the spectrum take interleaved s16, surround is folded to stereo
+    if (!m_audioConverter.matches(audio_frame) &&
+        !m_audioConverter.configure(audio_frame, AV_SAMPLE_FMT_S16, qMin(channels, 2)))
     {
-        run();
+        std::cout << "Unsupported audio format " << av_get_sample_fmt_name(format)
+                  << " with " << channels << " channels" << std::endl;
+        return;
     }
 
+    // One pooled block shared by every consumer, converted straight into it
+    int outChannels = m_audioConverter.outChannels();
+    uint64_t mask = outChannels == 1 ? AV_CH_LAYOUT_MONO : AV_CH_LAYOUT_STEREO;
+    audio_buffer buffer = m_audioPool.get(m_audioConverter.outFormat(), outChannels,
+                                          audio_frame->sample_rate, audio_frame->nb_samples, mask);
+    uint8_t *out = buffer.writableData();
+    if (!out)
+        return;
+
+    m_audioConverter.convert(audio_frame->extended_data, audio_frame->nb_samples, out);
+    buffer.setPts(audio_frame->pts);
+
+    // Never blocks, a full ring drops the block and counts an overrun
+    if (m_audioSinkOutput)
+        m_audioRing.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+
+    m_audioMailbox.post(std::move(buffer));
+}
+
+void ffmpeg_rtmp::setPreviewGeometry(const QSize &targetSize, const QRectF &crop, qreal pixelRatio)
+{
+    QMutexLocker locker(&m_previewMutex);
+    m_previewSize = targetSize;
+    m_previewPixelRatio = pixelRatio;
+    m_previewCrop = crop.intersected(QRectF(0, 0, 1, 1));
+    if (m_previewCrop.isEmpty())
+        m_previewCrop = QRectF(0, 0, 1, 1);
+}
+
+void ffmpeg_rtmp::process_video_frame()
+{
+    QSize targetSize;
+    QRectF cropNorm;
+    qreal pixelRatio;
+    {
+        QMutexLocker locker(&m_previewMutex);
+        targetSize = m_previewSize;
+        cropNorm = m_previewCrop;
+        pixelRatio = m_previewPixelRatio;
+    }
+
+    const int srcW = video_frame->width;
+    const int srcH = video_frame->height;
+    const AVPixelFormat srcFmt = (AVPixelFormat)video_frame->format;
+
+    QRect crop(qFloor(cropNorm.x() * srcW), qFloor(cropNorm.y() * srcH),
+               qCeil(cropNorm.width() * srcW), qCeil(cropNorm.height() * srcH));
+    crop = sws_converter::align_crop(srcFmt, crop, srcW, srcH);
+
+    // Fit the visible region into the viewport, never upscale, the widget does that for free
+    QSize dstSize = crop.size();
+    if (targetSize.isValid() && !targetSize.isEmpty())
+        dstSize = crop.size().scaled(targetSize.boundedTo(crop.size()), Qt::KeepAspectRatio);
+    dstSize = dstSize.expandedTo(QSize(1, 1));
+
+    // Large downscales hide the difference, the fast path is several times cheaper
+    int flags = SWS_BILINEAR;
+    if (crop.width() >= PREVIEW_FAST_SCALE_RATIO * dstSize.width() &&
+        crop.height() >= PREVIEW_FAST_SCALE_RATIO * dstSize.height())
+        flags = SWS_FAST_BILINEAR;
+
+    // Reuse a ring slot nobody holds anymore, one of the same geometry if possible
+    QImage *image = nullptr;
+    for (QImage &slot : m_previewImages)
+    {
+        if (!slot.isNull() && !slot.isDetached())
+            continue;
+        image = &slot;
+        if (slot.size() == dstSize && slot.devicePixelRatio() == pixelRatio)
+            break;
+    }
+    // Everything still shared, the holders keep their buffer when the slot is replaced
+    if (!image)
+        image = &m_previewImages[0];
+
+    if (image->size() != dstSize || image->devicePixelRatio() != pixelRatio || !image->isDetached())
+    {
+        *image = QImage(dstSize, QImage::Format_RGB32);
+        // Tagged here so the surface can draw it 1:1 without retagging a shared copy
+        image->setDevicePixelRatio(pixelRatio);
+    }
+
+    uint8_t* destData[4] = { image->bits(), nullptr, nullptr, nullptr };
+    int destLinesize[4] = { (int)image->bytesPerLine(), 0, 0, 0 };
+
+    const uint8_t *srcData[4];
+    sws_converter::crop_planes(srcFmt, video_frame->data, video_frame->linesize, crop.x(), crop.y(), srcData);
+
+    // Contexts are cached per geometry for the whole session
+    if (!m_videoConverter.convert(srcData, video_frame->linesize, crop.width(), crop.height(), srcFmt,
+                                  dstSize.width(), dstSize.height(), AV_PIX_FMT_RGB32,
+                                  flags, destData, destLinesize)) {
+        std::cout << "Failed to convert video frame" << std::endl;
+        return;
+    }
+
+    m_videoMailbox.post(*image);
+}
+
+void ffmpeg_rtmp::post_info(const QString &message)
+{
+    m_infoMailbox.post(message);
+}
+
+ffmpeg_rtmp::pipeline_stats ffmpeg_rtmp::stats() const
+{
+    pipeline_stats st;
+    st.remuxDepth = m_remuxQueue.depth();
+    st.remuxMaxDepth = m_remuxQueue.maxDepth();
+    st.audioDepth = m_audioQueue.depth();
+    st.audioMaxDepth = m_audioQueue.maxDepth();
+    st.audioDropped = m_audioQueue.dropped();
+    st.videoDepth = m_videoQueue.depth();
+    st.videoMaxDepth = m_videoQueue.maxDepth();
+    st.videoDropped = m_videoQueue.dropped();
+
+    auto preview = m_videoMailbox.stats();
+    st.previewFramesDropped = preview.dropped;
+    st.previewFrameAgeUs = preview.lastAgeUs;
+    st.previewFrameMaxAgeUs = preview.maxAgeUs;
+    auto audio = m_audioMailbox.stats();
+    st.audioBlocksDropped = audio.dropped;
+    st.audioBlockMaxAgeUs = audio.maxAgeUs;
+    st.infoDropped = m_infoMailbox.stats().dropped;
+    st.videoSkipped = m_videoSkipped;
+    st.playbackUnderruns = m_audioRing.underruns();
+    st.playbackOverruns = m_audioRing.overruns();
+    st.playbackOverrunBytes = m_audioRing.overrunBytes();
+    st.audioSkipped = m_audioSkipped;
+    return st;
 }
 
 void ffmpeg_rtmp::run()
 {
-    m_stop = false;
-    emit sendInfo("Rtmp stream server is listening.");
+    post_info("Rtmp session started.");
     start_streamer();
+
+    // Whatever ended the session, a publisher blocked on a full pipe is let go
+    if (m_pipe)
+        m_pipe->close();
 }
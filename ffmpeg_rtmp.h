@@ -9,16 +9,25 @@
 #include <fstream>
 #include <cstdint>
 #include <algorithm>
+#include <atomic>
+#include <memory>
 
 #include <QDebug>
 #include <QThread>
-#include <QNetworkInterface>
 #include <QImage>
+#include <QMutex>
 #include <QWidget>
 #include <QMediaDevices>
 #include <QAudioSink>
 #include <QMediaMetaData>
 
+#include "spsc_queue.h"
+#include "sws_converter.h"
+#include "mailbox.h"
+#include "audio_converter.h"
+#include "audio_ring.h"
+#include "audio_buffer.h"
+
 
 #ifdef _WIN32
 //Windows
@@ -60,23 +69,118 @@ extern "C"
 #endif
 #endif
 
+#define PIPELINE_REMUX_QUEUE_SIZE   1024
+#define PIPELINE_AUDIO_QUEUE_SIZE   128
+#define PIPELINE_VIDEO_QUEUE_SIZE   64
+#define PIPELINE_IDLE_WAIT_US       500
+#define PIPELINE_IDLE_MAX_WAIT_US   8000
+#define PREVIEW_AUDIO_MAILBOX_SIZE  32
+#define PREVIEW_INFO_MAILBOX_SIZE   64
+#define PREVIEW_FAST_SCALE_RATIO    2
+#define PREVIEW_IMAGE_RING          3
+
+class flv_pipe;
+
 class ffmpeg_rtmp : public QThread
 {
     Q_OBJECT
 public:
     explicit ffmpeg_rtmp(QObject *parent = nullptr);
+    ~ffmpeg_rtmp();
     void stop();
-    void setUrl();
+    void setInput(const QString &streamKey, std::shared_ptr<flv_pipe> pipe, const QString &outputDir);
+    // Can change while the session runs, the audio stage opens or closes the output
+    void setPlaybackEnabled(bool enabled) { m_playback = enabled; }
+
+    // Decoding is driven by demand, recording is stream copy and never needs
+    // it. Sessions start with nothing decoded until a consumer asks.
+    enum video_demand
+    {
+        VIDEO_DEMAND_NONE,
+        VIDEO_DEMAND_KEYFRAMES,
+        VIDEO_DEMAND_ALL
+    };
+    void setVideoDemand(video_demand demand) { m_videoDemand = demand; }
+    void setAudioDemand(bool enabled) { m_audioDemand = enabled; }
+    QString streamKey() const { return m_streamKey; }
     int set_audio_device(QAudioDevice&);
+
+    struct pipeline_stats
+    {
+        size_t   remuxDepth {0};
+        size_t   remuxMaxDepth {0};
+        size_t   audioDepth {0};
+        size_t   audioMaxDepth {0};
+        uint64_t audioDropped {0};
+        size_t   videoDepth {0};
+        size_t   videoMaxDepth {0};
+        uint64_t videoDropped {0};
+        uint64_t previewFramesDropped {0};
+        int64_t  previewFrameAgeUs {0};
+        int64_t  previewFrameMaxAgeUs {0};
+        uint64_t audioBlocksDropped {0};
+        int64_t  audioBlockMaxAgeUs {0};
+        uint64_t infoDropped {0};
+        uint64_t videoSkipped {0};
+        uint64_t audioSkipped {0};
+        uint64_t playbackUnderruns {0};
+        uint64_t playbackOverruns {0};
+        uint64_t playbackOverrunBytes {0};
+    };
+    pipeline_stats stats() const;
+
+    // Preview frames are converted straight to this pixel size. crop is the
+    // normalized region of the source to show, an empty size keeps the
+    // source resolution.
+    void setPreviewGeometry(const QSize &targetSize, const QRectF &crop = QRectF(0, 0, 1, 1), qreal pixelRatio = 1.0);
+
+    // Polled by the GUI, only the latest entries survive a slow consumer
+    mailbox<QImage> &videoMailbox() { return m_videoMailbox; }
+    mailbox<audio_buffer> &audioMailbox() { return m_audioMailbox; }
+    mailbox<QString> &infoMailbox() { return m_infoMailbox; }
+
 private:
+    static int read_pipe(void *opaque, uint8_t *buf, int buf_size);
     int prepare_ffmpeg();
-    int start_audio_device();    
+    void close_ffmpeg();
+    bool open_decoder(AVStream *stream, AVCodecContext **context, AVFrame **frame);
+    int start_audio_device();
+    void stop_audio_device();    
     int set_parameters();
-    int init_swr_context(AVSampleFormat out_format);
-    AVFrame* convert_audio_frame(AVSampleFormat out_format);
     void start_streamer();
 
-    bool m_stop {false};
+    // Pipeline stages, each on its own thread
+    void read_stage();
+    void remux_stage();
+    void audio_stage();
+    void video_stage();
+    void process_audio_frame();
+    void process_video_frame();
+    bool pop_packet(spsc_queue<AVPacket*> &queue, AVPacket *&packet);
+    void wait_for_queue();
+    void post_info(const QString &message);
+
+    std::atomic<bool> m_stop {false};
+    std::atomic<bool> m_readerDone {false};
+    std::atomic<int> m_videoDemand {VIDEO_DEMAND_NONE};
+    std::atomic<bool> m_audioDemand {false};
+    std::atomic<uint64_t> m_videoSkipped {0};
+    std::atomic<uint64_t> m_audioSkipped {0};
+    spsc_queue<AVPacket*> m_remuxQueue {PIPELINE_REMUX_QUEUE_SIZE};
+    spsc_queue<AVPacket*> m_audioQueue {PIPELINE_AUDIO_QUEUE_SIZE};
+    spsc_queue<AVPacket*> m_videoQueue {PIPELINE_VIDEO_QUEUE_SIZE};
+    mutable QMutex m_previewMutex;
+    QSize m_previewSize;
+    QRectF m_previewCrop {0, 0, 1, 1};
+    qreal m_previewPixelRatio {1.0};
+    mailbox<QImage> m_videoMailbox {1};
+    // Video stage only. The surface and the mailbox hold at most one each
+    QImage m_previewImages[PREVIEW_IMAGE_RING];
+    mailbox<audio_buffer> m_audioMailbox {PREVIEW_AUDIO_MAILBOX_SIZE};
+    audio_buffer_pool m_audioPool;
+    mailbox<QString> m_infoMailbox {PREVIEW_INFO_MAILBOX_SIZE};
+    std::atomic<bool> m_playback {false};
+    bool outputHeaderWritten {false};
 
     //Input AVFormatContext and Output AVFormatContext
     AVFormatContext* inputContext{nullptr};
@@ -90,24 +194,27 @@ private:
     AVStream *outputStream{nullptr};
     AVStream *vid_stream{nullptr};
     AVStream *aud_stream{nullptr};    
-    SwrContext* swrAudioContext{nullptr};
+    audio_converter m_audioConverter;
+    sws_converter m_videoConverter;
+    AVIOContext* inputIoContext{nullptr};
+    std::shared_ptr<flv_pipe> m_pipe;
 
     int video_idx = -1;
     int audio_idx = -1;
-    QString in_filename, out_filename;
+    QString out_filename;
+    QString m_streamKey;
     QString info;
-    QIODevice *m_ioAudioDevice{nullptr};   
+    audio_ring_buffer m_audioRing;
+    QScopedPointer<audio_pull_device> m_audioPullDevice;
     QScopedPointer<QAudioSink> m_audioSinkOutput{nullptr};
+    QScopedPointer<QThread> m_audioOutputThread;
+    QObject *m_audioContext{nullptr};
 
 protected:
     void run();
 
 signals:
-    void sendInfo(QString);
-    void sendUrl(QString);
     void sendConnectionStatus(bool);
-    void sendVideoFrame(QImage);
-    void sendAudioFrame(const char*, int);
 
 };
 
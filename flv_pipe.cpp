@@ -0,0 +1,76 @@
+#include "flv_pipe.h"
+
+#include <algorithm>
+#include <cstring>
+
+flv_pipe::flv_pipe(int capacity)
+    : m_buffer(capacity, Qt::Uninitialized)
+{
+}
+
+bool flv_pipe::write(const char *data, int size)
+{
+    QMutexLocker locker(&m_mutex);
+
+    while (size > 0)
+    {
+        while (!m_closed && m_count == m_buffer.size())
+            m_notFull.wait(&m_mutex);
+
+        if (m_closed)
+            return false;
+
+        int tail = (m_head + m_count) % m_buffer.size();
+        int chunk = std::min(size, std::min(m_buffer.size() - m_count, m_buffer.size() - tail));
+        memcpy(m_buffer.data() + tail, data, chunk);
+        m_count += chunk;
+        data += chunk;
+        size -= chunk;
+        m_notEmpty.wakeAll();
+    }
+
+    return true;
+}
+
+int flv_pipe::read(uint8_t *data, int size)
+{
+    QMutexLocker locker(&m_mutex);
+
+    while (!m_closed && m_count == 0)
+        m_notEmpty.wait(&m_mutex);
+
+    int total = 0;
+    while (total < size && m_count > 0)
+    {
+        int chunk = std::min(size - total, std::min(m_count, m_buffer.size() - m_head));
+        memcpy(data + total, m_buffer.constData() + m_head, chunk);
+        m_head = (m_head + chunk) % m_buffer.size();
+        m_count -= chunk;
+        total += chunk;
+    }
+
+    if (total > 0)
+        m_notFull.wakeAll();
+
+    return total;
+}
+
+void flv_pipe::close()
+{
+    QMutexLocker locker(&m_mutex);
+    m_closed = true;
+    m_notEmpty.wakeAll();
+    m_notFull.wakeAll();
+}
+
+bool flv_pipe::isClosed() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_closed;
+}
+
+int flv_pipe::size() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_count;
+}
@@ -0,0 +1,41 @@
+#ifndef FLV_PIPE_H
+#define FLV_PIPE_H
+
+#include <QByteArray>
+#include <QMutex>
+#include <QWaitCondition>
+#include <cstdint>
+
+#define FLV_PIPE_CAPACITY (4 * 1024 * 1024)
+
+// Bounded byte pipe between an rtmp_connection (writer) and the demuxer of
+// its ffmpeg_rtmp session (reader). A full pipe only blocks the publisher
+// that owns it, so a slow session never stalls the other connections.
+class flv_pipe
+{
+public:
+    explicit flv_pipe(int capacity = FLV_PIPE_CAPACITY);
+
+    // Blocks while the pipe is full. Returns false once the pipe is closed,
+    // also when it is closed while waiting, so a dead reader never holds
+    // the writer.
+    bool write(const char *data, int size);
+    // Blocks while the pipe is empty. Returns 0 at end of stream.
+    int read(uint8_t *data, int size);
+    void close();
+
+    bool isClosed() const;
+    int size() const;
+    int capacity() const { return m_buffer.size(); }
+
+private:
+    mutable QMutex m_mutex;
+    QWaitCondition m_notEmpty;
+    QWaitCondition m_notFull;
+    QByteArray m_buffer;
+    int m_head {0};
+    int m_count {0};
+    bool m_closed {false};
+};
+
+#endif // FLV_PIPE_H
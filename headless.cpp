@@ -0,0 +1,123 @@
+#include "headless.h"
+#include "rtmp_server.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QSettings>
+#include <QFileInfo>
+#include <QDir>
+#include <QTimer>
+#include <iostream>
+#include <atomic>
+#include <csignal>
+
+// Set by the signal handler and polled from the event loop, a handler may
+// not call into Qt since that allocates and locks
+static std::atomic<bool> s_quitRequested {false};
+static_assert(std::atomic<bool>::is_always_lock_free, "signal handler needs a lock free flag");
+
+static void quit_on_signal(int)
+{
+    s_quitRequested = true;
+}
+
+int run_headless(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("video_process_ai");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("RTMP ingest and remux server without GUI.");
+    parser.addHelpOption();
+    parser.addOption({ "headless", "Run without GUI." });
+    parser.addOption({ { "c", "config" }, "Read settings from <file>.", "file" });
+    parser.addOption({ { "p", "port" }, "RTMP listen port.", "port" });
+    parser.addOption({ { "o", "output-dir" }, "Directory for the recorded files.", "dir" });
+    parser.addOption({ "stats-interval", "Print pipeline statistics every <seconds>, 0 disables.", "seconds" });
+    parser.process(app);
+
+    int port = RTMP_DEFAULT_PORT;
+    QString outputDir = QDir::currentPath();
+    int statsInterval = HEADLESS_DEFAULT_STATS_INTERVAL;
+
+    if (parser.isSet("config"))
+    {
+        QString file = parser.value("config");
+        if (!QFileInfo::exists(file))
+        {
+            std::cerr << "Config file not found: " << file.toStdString() << std::endl;
+            return 1;
+        }
+
+        QSettings settings(file, QSettings::IniFormat);
+        settings.beginGroup("rtmp");
+        port = settings.value("port", port).toInt();
+        outputDir = settings.value("output_dir", outputDir).toString();
+        statsInterval = settings.value("stats_interval", statsInterval).toInt();
+        settings.endGroup();
+    }
+
+    if (parser.isSet("port"))
+        port = parser.value("port").toInt();
+    if (parser.isSet("output-dir"))
+        outputDir = parser.value("output-dir");
+    if (parser.isSet("stats-interval"))
+        statsInterval = parser.value("stats-interval").toInt();
+
+    if (port <= 0 || port > 65535)
+    {
+        std::cerr << "Invalid port " << port << std::endl;
+        return 1;
+    }
+    if (!QDir().mkpath(outputDir))
+    {
+        std::cerr << "Can not create output directory " << outputDir.toStdString() << std::endl;
+        return 1;
+    }
+
+    rtmp_server server;
+    server.setOutputDirectory(outputDir);
+
+    QObject::connect(&server, &rtmp_server::sendInfo, [](QString info) {
+        std::cout << info.toStdString() << std::endl;
+    });
+    QObject::connect(&server, &rtmp_server::sendUrl, [](QString url) {
+        std::cout << url.toStdString() << std::endl;
+    });
+    QObject::connect(&app, &QCoreApplication::aboutToQuit, &server, &rtmp_server::stop);
+
+    if (!server.start(port))
+        return 1;
+    server.setUrl();
+
+    QTimer statsTimer;
+    if (statsInterval > 0)
+    {
+        QObject::connect(&statsTimer, &QTimer::timeout, [&server]() {
+            for (const QString &key : server.streamKeys())
+            {
+                ffmpeg_rtmp *session = server.session(key);
+                if (!session)
+                    continue;
+                auto st = session->stats();
+                std::cout << "[" << key.toStdString() << "] remux depth " << st.remuxDepth
+                          << " max " << st.remuxMaxDepth
+                          << " video skipped " << st.videoSkipped
+                          << " audio skipped " << st.audioSkipped << std::endl;
+            }
+        });
+        statsTimer.start(statsInterval * 1000);
+    }
+
+    QTimer signalTimer;
+    QObject::connect(&signalTimer, &QTimer::timeout, &app, [&app]() {
+        if (s_quitRequested)
+            app.quit();
+    });
+    signalTimer.start(HEADLESS_SIGNAL_POLL_MS);
+
+    std::signal(SIGINT, quit_on_signal);
+    std::signal(SIGTERM, quit_on_signal);
+
+    return app.exec();
+}
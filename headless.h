@@ -0,0 +1,18 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#define HEADLESS_DEFAULT_STATS_INTERVAL 0
+#define HEADLESS_SIGNAL_POLL_MS         100
+
+// Ingest and remux without any GUI, run with --headless. Settings come from
+// the command line and optionally an ini file given with --config:
+//
+//   [rtmp]
+//   port=8889
+//   output_dir=/var/lib/video_process_ai
+//   stats_interval=10
+//
+// Command line options override the file.
+int run_headless(int argc, char *argv[]);
+
+#endif // HEADLESS_H
@@ -0,0 +1,113 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <QMutex>
+#include <QMutexLocker>
+#include <QList>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <utility>
+
+// Bounded hand-off from a worker thread to a consumer that polls, usually the
+// GUI at display refresh rate. When full the oldest entry is replaced, so a
+// slow consumer only ever sees the latest items instead of an ever growing
+// event queue. A capacity of 1 makes it a latest-value slot.
+template <typename T>
+class mailbox
+{
+public:
+    explicit mailbox(int capacity = 1) : m_capacity(capacity > 0 ? capacity : 1) {}
+
+    mailbox(const mailbox&) = delete;
+    mailbox& operator=(const mailbox&) = delete;
+
+    void post(T item)
+    {
+        QMutexLocker locker(&m_mutex);
+        if ((int)m_items.size() >= m_capacity)
+        {
+            m_items.pop_front();
+            m_dropped++;
+        }
+        m_items.push_back({ std::move(item), clock::now() });
+        m_posted++;
+    }
+
+    bool take(T &item)
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_items.empty())
+            return false;
+
+        entry &e = m_items.front();
+        record_age(e.posted);
+        item = std::move(e.item);
+        m_items.pop_front();
+        return true;
+    }
+
+    // Drains everything queued so far, oldest first.
+    QList<T> takeAll()
+    {
+        QList<T> items;
+        QMutexLocker locker(&m_mutex);
+        items.reserve((int)m_items.size());
+        for (entry &e : m_items)
+        {
+            record_age(e.posted);
+            items.append(std::move(e.item));
+        }
+        m_items.clear();
+        return items;
+    }
+
+    void clear()
+    {
+        QMutexLocker locker(&m_mutex);
+        m_items.clear();
+    }
+
+    int capacity() const { return m_capacity; }
+
+    struct counters
+    {
+        uint64_t posted {0};
+        uint64_t dropped {0};
+        int64_t  lastAgeUs {0};
+        int64_t  maxAgeUs {0};
+    };
+
+    // Age is the time an item spent in the mailbox before it was taken.
+    counters stats() const
+    {
+        QMutexLocker locker(&m_mutex);
+        return { m_posted, m_dropped, m_lastAgeUs, m_maxAgeUs };
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct entry
+    {
+        T item;
+        clock::time_point posted;
+    };
+
+    void record_age(clock::time_point posted)
+    {
+        m_lastAgeUs = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - posted).count();
+        if (m_lastAgeUs > m_maxAgeUs)
+            m_maxAgeUs = m_lastAgeUs;
+    }
+
+    mutable QMutex m_mutex;
+    std::deque<entry> m_items;
+    int m_capacity;
+    uint64_t m_posted {0};
+    uint64_t m_dropped {0};
+    int64_t m_lastAgeUs {0};
+    int64_t m_maxAgeUs {0};
+};
+
+#endif // MAILBOX_H
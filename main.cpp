@@ -1,9 +1,22 @@
 #include "rtmp.h"
+#include "benchmark.h"
+#include "headless.h"
 
 #include <QtWidgets>
 
 int main(int argc, char *argv[])
 {
+    if (argc > 1 && qstrcmp(argv[1], "--benchmark") == 0)
+    {
+        QCoreApplication app(argc, argv);
+        return run_benchmarks();
+    }
+
+    // Display-less servers: no QApplication, no window, no device enumeration
+    for (int i = 1; i < argc; i++)
+        if (qstrcmp(argv[i], "--headless") == 0)
+            return run_headless(argc, argv);
+
     QApplication app(argc, argv);
 
     Rtmp rtmp;
@@ -0,0 +1,60 @@
+#include "peak_detector.h"
+
+#include <algorithm>
+#include <cmath>
+
+void peak_detector::detect(const spectrum_kernels &kernels, const qint32 *values, int count, int xmin,
+                           float c, std::vector<QPoint> &peaks)
+{
+    peaks.clear();
+    if (count <= 0 || c <= 0)
+    {
+        m_tracked.clear();
+        return;
+    }
+
+    double sum;
+    double sumSq;
+    kernels.moments(values, count, &sum, &sumSq);
+    const double mean = sum / count;
+    const double stdev = std::sqrt(std::max(0.0, sumSq / count - mean * mean));
+
+    // Smaller rows are stronger signals
+    const int enter = (int)std::ceil(mean - c * stdev);
+    const int keep = (int)std::ceil(mean - c * PEAK_HYSTERESIS * stdev);
+
+    m_candidates.resize(count);
+    const int found = kernels.below(values, count, keep, m_candidates.data());
+
+    size_t tracked = 0;
+    auto emit_peak = [&](int best) {
+        const int x = best + xmin;
+        const int y = values[best];
+        bool known = false;
+        if (y >= enter)
+        {
+            while (tracked < m_tracked.size() && m_tracked[tracked].x() < x - PEAK_TRACK_DISTANCE)
+                tracked++;
+            known = tracked < m_tracked.size() && m_tracked[tracked].x() <= x + PEAK_TRACK_DISTANCE;
+        }
+        if (y < enter || known)
+            peaks.emplace_back(x, y);
+    };
+
+    int best = -1;
+    for (int k = 0; k < found; k++)
+    {
+        const int i = m_candidates[k];
+        if (best != -1 && i - best > PEAK_H_TOLERANCE)
+        {
+            emit_peak(best);
+            best = -1;
+        }
+        if (best == -1 || values[i] < values[best])
+            best = i;
+    }
+    if (best != -1)
+        emit_peak(best);
+
+    m_tracked = peaks;
+}
@@ -0,0 +1,37 @@
+#ifndef PEAK_DETECTOR_H
+#define PEAK_DETECTOR_H
+
+#include <QPoint>
+#include <vector>
+
+#include "spectrum_kernels.h"
+
+#define PEAK_H_TOLERANCE    2       // pixels between two peaks of one signal
+#define PEAK_HYSTERESIS     0.75f   // share of the threshold a peak of the last frame has to keep
+#define PEAK_TRACK_DISTANCE 3       // pixels a peak may drift between frames and still be the same
+
+// Pandapter peak detection. A peak is the highest pixel (smallest y) of a
+// group of pixels that lie more than c standard deviations above the
+// mean, with groups split where the best pixel is more than
+// PEAK_H_TOLERANCE pixels from the next candidate.
+//
+// Peaks of the last frame stay peaks while they keep PEAK_HYSTERESIS of
+// the threshold, so markers do not flicker on signals right at the edge.
+// The mean and deviation and the candidate scan run in the SIMD kernels,
+// only the few candidates are looked at one by one.
+class peak_detector
+{
+public:
+    // values are the pixel rows of pixels xmin.., peaks comes out sorted by x
+    void detect(const spectrum_kernels &kernels, const qint32 *values, int count, int xmin,
+                float c, std::vector<QPoint> &peaks);
+
+    // Forgets the peaks of the last frame, when the pixels mean something else
+    void reset() { m_tracked.clear(); }
+
+private:
+    std::vector<int> m_candidates;
+    std::vector<QPoint> m_tracked;  // peaks of the last frame, sorted by x
+};
+
+#endif // PEAK_DETECTOR_H
@@ -0,0 +1,668 @@
+#include "plot_renderer.h"
+#include "waterfall_history.h"
+
+#include <QDateTime>
+#include <QPainter>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+
+/**
+ * Default waterfall color scheme, indexed by level 0..255 (0 = min). Built
+ * at compile time so a waterfall line is a table lookup per pixel.
+ */
+static constexpr std::array<QRgb, 256> make_waterfall_colors()
+{
+    std::array<QRgb, 256> tbl {};
+    for (int i = 0; i < 256; i++)
+    {
+        // level 0: black background
+        if (i < 20)
+            tbl[i] = qRgb(0, 0, 0);
+        // level 1: black -> blue
+        else if ((i >= 20) && (i < 70))
+            tbl[i] = qRgb(0, 0, 140*(i-20)/50);
+        // level 2: blue -> light-blue / greenish
+        else if ((i >= 70) && (i < 100))
+            tbl[i] = qRgb(60*(i-70)/30, 125*(i-70)/30, 115*(i-70)/30 + 140);
+        // level 3: light blue -> yellow
+        else if ((i >= 100) && (i < 150))
+            tbl[i] = qRgb(195*(i-100)/50 + 60, 130*(i-100)/50 + 125, 255-(255*(i-100)/50));
+        // level 4: yellow -> red
+        else if ((i >= 150) && (i < 250))
+            tbl[i] = qRgb(255, 255-255*(i-150)/100, 0);
+        // level 5: red -> white
+        else
+            tbl[i] = qRgb(255, 255*(i-250)/5, 255*(i-250)/5);
+    }
+    return tbl;
+}
+
+static constexpr std::array<QRgb, 256> s_waterfallColors = make_waterfall_colors();
+
+plot_renderer::plot_renderer(QObject *parent)
+    : QThread(parent)
+    , m_kernels(spectrum_kernels::select())
+{
+}
+
+plot_renderer::~plot_renderer()
+{
+    stop();
+    wait();
+}
+
+void plot_renderer::stop()
+{
+    m_stop = true;
+    m_wake.release();
+}
+
+void plot_renderer::setSource(spectrum_exchange *source)
+{
+    QMutexLocker locker(&m_sourceLock);
+    m_source = source;
+}
+
+void plot_renderer::setHistory(waterfall_history *history)
+{
+    QMutexLocker locker(&m_sourceLock);
+    m_history = history;
+}
+
+void plot_renderer::setView(const plot_view &view)
+{
+    {
+        QMutexLocker locker(&m_viewLock);
+        m_pendingView = view;
+        m_viewVersion++;
+    }
+    m_wake.release();
+}
+
+void plot_renderer::resetStats()
+{
+    m_updates = 0;
+    m_skipped = 0;
+}
+
+QImage plot_renderer::unrollWaterfall(const QImage &ring, int newestRow)
+{
+    const int h = ring.height();
+    if (newestRow == 0 || h == 0)
+        return ring.copy();
+
+    QImage image(ring.size(), ring.format());
+    const qsizetype bpl = ring.bytesPerLine();
+    for (int y = 0; y < h; y++)
+        memcpy(image.scanLine(y), ring.constScanLine((newestRow + y) % h), bpl);
+    return image;
+}
+
+QImage plot_renderer::colorWaterfall(const std::vector<float> &db, int width, int rows,
+                                     float mindB, float maxdB)
+{
+    QImage image(width, rows, QImage::Format_RGB32);
+    const float gain = 255.0f / fabs(maxdB - mindB);
+    const QRgb black = qRgb(0, 0, 0);
+
+    for (int y = 0; y < rows; y++)
+    {
+        const float *in = &db[(size_t)y * width];
+        QRgb *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < width; x++)
+            line[x] = std::isinf(in[x]) ? black
+                                        : s_waterfallColors[255 - qBound(0, (qint32)(gain * (maxdB - in[x])), 255)];
+    }
+    return image;
+}
+
+void plot_renderer::run()
+{
+    while (!m_stop)
+    {
+        m_wake.tryAcquire(1, PLOT_RENDERER_WAIT_MS);
+        m_wake.tryAcquire(m_wake.available());
+        if (m_stop)
+            break;
+
+        render();
+    }
+}
+
+// Draws a new picture if the view or the spectrum changed since the last one
+void plot_renderer::render()
+{
+    QMutexLocker locker(&m_sourceLock);
+    bool changed = take_view();
+
+    if (m_source != m_current)
+    {
+        m_current = m_source;
+        m_frame = nullptr;
+        m_lastSequence = 0;
+        changed = true;
+    }
+
+    if (m_history != m_currentHistory)
+    {
+        m_currentHistory = m_history;
+        m_historyDirty = true;
+        changed = true;
+    }
+
+    if (m_current && m_current->update())
+    {
+        m_frame = &m_current->readBuffer();
+        m_pandPyramid.reset(m_frame->average.data(), (int)m_frame->average.size());
+        m_updates++;
+        if (m_lastSequence && m_frame->sequence > m_lastSequence + 1)
+            m_skipped += m_frame->sequence - m_lastSequence - 1;
+        m_lastSequence = m_frame->sequence;
+
+        add_waterfall_line(*m_frame);
+        changed = true;
+    }
+
+    if (!changed || m_view.width <= 0)
+        return;
+
+    if (m_historyDirty)
+    {
+        render_history();
+        m_historyDirty = false;
+    }
+
+    plot_image &out = m_output.writeBuffer();
+    draw_spectrum(out);
+    sync_waterfall(out);
+    out.lastLineMs = m_lastLineMs;
+    out.history = m_historyImage;
+    out.historyEnd = m_view.historyEnd;
+    out.historySpan = m_view.historySpan;
+    out.hasData = m_frame != nullptr;
+    out.sampleRate = m_frame ? m_frame->sampleRate : 0;
+    out.fftSize = m_frame ? m_frame->fftSize : 0;
+    out.hop = m_frame ? m_frame->hop : 0;
+
+    // An unread picture means a notification is still on its way
+    if (m_output.publish())
+        emit frameRendered();
+}
+
+bool plot_renderer::take_view()
+{
+    plot_view view;
+    {
+        QMutexLocker locker(&m_viewLock);
+        if (m_viewVersion == m_appliedVersion)
+            return false;
+        view = m_pendingView;
+        m_appliedVersion = m_viewVersion;
+    }
+
+    apply_view(view);
+    return true;
+}
+
+void plot_renderer::apply_view(const plot_view &view)
+{
+    if (view.width != m_view.width || view.waterfallHeight != m_view.waterfallHeight)
+    {
+        // the history is kept across resizes, scaled to the new size
+        if (view.width <= 0 || view.waterfallHeight <= 0)
+            m_waterfall = QImage();
+        else if (m_waterfall.isNull())
+        {
+            m_waterfall = QImage(view.width, view.waterfallHeight, QImage::Format_RGB32);
+            m_waterfall.fill(Qt::black);
+        }
+        else
+        {
+            m_waterfall = unrollWaterfall(m_waterfall, m_waterfallRow)
+                              .scaled(view.width, view.waterfallHeight,
+                                      Qt::IgnoreAspectRatio, Qt::SmoothTransformation)
+                              .convertToFormat(QImage::Format_RGB32);
+        }
+        m_waterfallRow = 0;
+        m_waterfallLines = 0;
+        m_waterfallGeneration++;
+    }
+
+    if (view.width != m_view.width)
+    {
+        // per pixel buffers, the polygon needs two extra corner points
+        m_fftbuf.assign(qMax(0, view.width), 0);
+        m_wfbuf.assign(qMax(0, view.width), 255);
+        m_peakHoldBuf.assign(qMax(0, view.width), 0);
+        m_lineBuf.resize(qMax(0, view.width) + 2);
+    }
+
+    if (view.waterfallClears != m_view.waterfallClears)
+    {
+        m_waterfall.fill(Qt::black);
+        m_waterfallRow = 0;
+        m_waterfallLines = 0;
+        m_waterfallGeneration++;
+        std::fill(m_wfbuf.begin(), m_wfbuf.end(), 255);
+    }
+
+    // scrollback is in pixels and colors of the view
+    if (view.historyEnd != m_view.historyEnd || view.historySpan != m_view.historySpan ||
+        view.width != m_view.width || view.waterfallHeight != m_view.waterfallHeight ||
+        view.startFreq != m_view.startFreq || view.stopFreq != m_view.stopFreq ||
+        view.centerFreq != m_view.centerFreq || view.wfMindB != m_view.wfMindB ||
+        view.wfMaxdB != m_view.wfMaxdB || view.detector != m_view.detector)
+        m_historyDirty = true;
+
+    if (view.peakHoldResets != m_view.peakHoldResets || view.width != m_view.width ||
+        view.spectrumHeight != m_view.spectrumHeight)
+        m_peakHoldValid = false;
+
+    // tracked peaks are pixels, they move with the range and scale
+    if (view.width != m_view.width || view.spectrumHeight != m_view.spectrumHeight ||
+        view.startFreq != m_view.startFreq || view.stopFreq != m_view.stopFreq ||
+        view.centerFreq != m_view.centerFreq || view.pandMindB != m_view.pandMindB ||
+        view.pandMaxdB != m_view.pandMaxdB || view.peakDetection <= 0)
+        m_peakDetector.reset();
+
+    m_view = view;
+}
+
+// Stored lines over the waterfall, or nothing when the live one is shown
+void plot_renderer::render_history()
+{
+    const int w = m_view.width;
+    const int h = m_view.waterfallHeight;
+    if (!m_currentHistory || m_view.historyEnd <= 0 || w <= 0 || h <= 0)
+    {
+        m_historyImage = QImage();
+        return;
+    }
+
+    const qint64 start = m_view.centerFreq + m_view.startFreq;
+    const qint64 stop = m_view.centerFreq + m_view.stopFreq;
+    m_currentHistory->render(m_view.historyEnd - m_view.historySpan, m_view.historyEnd, start, stop,
+                             w, h, m_view.detector, m_historyDb);
+    m_historyImage = colorWaterfall(m_historyDb, w, h, m_view.wfMindB, m_view.wfMaxdB);
+}
+
+/**
+ * Add the waterfall data of a new frame as a line, or fold it into the
+ * pending line when the user set a time span longer than the frame rate.
+ */
+void plot_renderer::add_waterfall_line(const spectrum_frame &frame)
+{
+    const int w = m_waterfall.width();
+    const int h = m_waterfall.height();
+    int xmin, xmax;
+
+    // no need to draw if the waterfall is invisible
+    if (w == 0 || h == 0)
+        return;
+
+    const quint64 tnow_ms = QDateTime::currentMSecsSinceEpoch();
+    const quint64 msec_per_wfline = m_view.msecPerLine;
+    const int n = qMin(w, (int)m_fftbuf.size());
+
+    // get scaled FFT data, always the peak of the bins so narrow signals
+    // stay visible at any zoom
+    m_wfPyramid.reset(frame.waterfall.data(), (int)frame.waterfall.size());
+    screen_data(255, n, m_view.wfMaxdB, m_view.wfMindB,
+                frame, m_wfPyramid, SPECTRUM_STAT_MAX, m_fftbuf.data(),
+                &xmin, &xmax);
+
+    if (msec_per_wfline > 0)
+    {
+        // not in "auto" mode, so accumulate waterfall data, peak (0..255 where 255 is min)
+        for (int i = 0; i < n; i++)
+            if (m_fftbuf[i] < m_wfbuf[i])
+                m_wfbuf[i] = m_fftbuf[i];
+    }
+
+    // is it time to update waterfall?
+    if (tnow_ms - m_lastLineMs < msec_per_wfline)
+        return;
+
+    m_lastLineMs = tnow_ms;
+
+    // the new line replaces the oldest one, which sits just above the newest
+    m_waterfallRow = (m_waterfallRow + h - 1) % h;
+    m_waterfallLines++;
+    QRgb *line = reinterpret_cast<QRgb *>(m_waterfall.scanLine(m_waterfallRow));
+    const QRgb black = qRgb(0, 0, 0);
+
+    xmin = qBound(0, xmin, w);
+    xmax = qBound(xmin, xmax, n);
+    std::fill(line, line + xmin, black);
+    std::fill(line + xmax, line + w, black);
+
+    if (msec_per_wfline > 0)
+    {
+        // user set time span
+        for (int i = xmin; i < xmax; i++)
+        {
+            line[i] = s_waterfallColors[255 - m_wfbuf[i]];
+            m_wfbuf[i] = 255;
+        }
+    }
+    else
+    {
+        for (int i = xmin; i < xmax; i++)
+            line[i] = s_waterfallColors[255 - m_fftbuf[i]];
+    }
+}
+
+// Pandapter, detected peaks and peak hold on a transparent layer
+void plot_renderer::draw_spectrum(plot_image &out)
+{
+    const int w = m_view.width;
+    const int h = m_view.spectrumHeight;
+    int xmin, xmax;
+
+    out.peaks.clear();
+    if (w <= 0 || h <= 0)
+    {
+        out.trace = QImage();
+        out.traceRect = QRect();
+        return;
+    }
+
+    // only what the previous trace in this buffer covered needs clearing
+    if (out.trace.size() != QSize(w, h))
+    {
+        out.trace = QImage(w, h, QImage::Format_ARGB32_Premultiplied);
+        out.trace.fill(Qt::transparent);
+    }
+    else if (!out.traceRect.isEmpty())
+    {
+        const QRect &r = out.traceRect;
+        for (int y = r.top(); y <= r.bottom(); y++)
+            memset(out.trace.scanLine(y) + r.left() * sizeof(QRgb), 0, r.width() * sizeof(QRgb));
+    }
+    out.traceRect = QRect();
+
+    if (!m_frame)
+        return;
+
+    QPainter painter(&out.trace);
+
+// workaround for "fixed" line drawing since Qt 5
+// see http://stackoverflow.com/questions/16990326
+#if QT_VERSION >= 0x050000
+    painter.translate(0.5, 0.5);
+#endif
+
+    // get new scaled fft data
+    screen_data(h, qMin(w, (int)m_fftbuf.size()), m_view.pandMaxdB, m_view.pandMindB,
+                *m_frame, m_pandPyramid, m_view.detector, m_fftbuf.data(),
+                &xmin, &xmax);
+
+    // draw the pandapter
+    painter.setPen(m_view.fftColor);
+    QPoint *LineBuf = m_lineBuf.data();
+    const int n = xmax - xmin;
+    int ytop = h;
+    int ybottom = 0;
+    for (int i = 0; i < n; i++)
+    {
+        LineBuf[i].setX(i + xmin);
+        LineBuf[i].setY(m_fftbuf[i + xmin]);
+        ytop = qMin(ytop, m_fftbuf[i + xmin]);
+        ybottom = qMax(ybottom, m_fftbuf[i + xmin]);
+    }
+    if (m_view.fftFill)
+        ybottom = h;
+
+    if (m_view.fftFill)
+    {
+        painter.setBrush(QBrush(m_view.fftFillColor, Qt::SolidPattern));
+        LineBuf[n].setX(xmax-1);
+        LineBuf[n].setY(h);
+        LineBuf[n+1].setX(xmin);
+        LineBuf[n+1].setY(h);
+        painter.drawPolygon(LineBuf, n+2);
+    }
+    else
+    {
+        painter.drawPolyline(LineBuf, n);
+    }
+
+    // Peak detection
+    if (m_view.peakDetection > 0 && n > 0)
+    {
+        m_peakDetector.detect(m_kernels, m_fftbuf.data() + xmin, n, xmin, m_view.peakDetection, out.peaks);
+        for (const QPoint &peak : out.peaks)
+            painter.drawEllipse(peak.x() - 5, peak.y() - 5, 10, 10);
+    }
+
+    // Peak hold
+    if (m_view.peakHold)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if(!m_peakHoldValid || m_fftbuf[i] < m_peakHoldBuf[i])
+                m_peakHoldBuf[i] = m_fftbuf[i];
+
+            LineBuf[i].setX(i + xmin);
+            LineBuf[i].setY(m_peakHoldBuf[i + xmin]);
+            ytop = qMin(ytop, m_peakHoldBuf[i + xmin]);
+            ybottom = qMax(ybottom, m_peakHoldBuf[i + xmin]);
+        }
+        painter.setPen(m_view.peakHoldColor);
+        painter.drawPolyline(LineBuf, n);
+
+        m_peakHoldValid = true;
+    }
+
+    // peak markers reach 5 pixels around the trace, plus the pen
+    if (n > 0)
+        out.traceRect = QRect(QPoint(xmin - PEAK_MARKER_MARGIN, ytop - PEAK_MARKER_MARGIN),
+                              QPoint(xmax + PEAK_MARKER_MARGIN, ybottom + PEAK_MARKER_MARGIN))
+                        & out.trace.rect();
+}
+
+// Bring the ring of a published picture up to date with the renderer's
+void plot_renderer::sync_waterfall(plot_image &out)
+{
+    const int h = m_waterfall.height();
+
+    if (h == 0 || out.waterfallGeneration != m_waterfallGeneration ||
+        out.waterfall.size() != m_waterfall.size() ||
+        m_waterfallLines - out.waterfallLines >= (quint64)h)
+    {
+        if (out.waterfall.size() != m_waterfall.size())
+            out.waterfall = h ? QImage(m_waterfall.size(), QImage::Format_RGB32) : QImage();
+        if (h)
+            memcpy(out.waterfall.bits(), m_waterfall.constBits(), m_waterfall.sizeInBytes());
+    }
+    else
+    {
+        // line k of a generation went to row -k modulo the height
+        const qsizetype bpl = m_waterfall.bytesPerLine();
+        for (quint64 k = out.waterfallLines + 1; k <= m_waterfallLines; k++)
+        {
+            const int row = (h - (int)(k % h)) % h;
+            memcpy(out.waterfall.scanLine(row), m_waterfall.constScanLine(row), bpl);
+        }
+    }
+
+    out.waterfallRow = m_waterfallRow;
+    out.waterfallLines = m_waterfallLines;
+    out.waterfallGeneration = m_waterfallGeneration;
+}
+
+/**
+ * Rebuild the bin to pixel mapping. The FFT is a centered array of fftSize
+ * bins spanning sampleFreq. When there are more bins than pixels each
+ * pixel owns a contiguous run of bins, stored as edges in values of the
+ * pyramid level picked for the run length; otherwise each pixel samples
+ * one bin. Either way the cost is one step per pixel.
+ */
+void plot_renderer::update_bin_map(qint32 fftSize, qint32 plotWidth, qint64 startFreq, qint64 stopFreq,
+                                   float sampleFreq)
+{
+    bin_map &map = m_binMap;
+    qint32 BinMin, BinMax, minbin, maxbin;
+
+    map.fftSize = fftSize;
+    map.plotWidth = plotWidth;
+    map.startFreq = startFreq;
+    map.stopFreq = stopFreq;
+    map.sampleFreq = sampleFreq;
+
+    /** FIXME: qint64 -> qint32 **/
+    BinMin = (qint32)((float)startFreq * (float)fftSize / sampleFreq);
+    BinMin += (fftSize/2);
+    BinMax = (qint32)((float)stopFreq * (float)fftSize / sampleFreq);
+    BinMax += (fftSize/2);
+
+    minbin = BinMin < 0 ? 0 : BinMin;
+    if (BinMin > fftSize)
+        BinMin = fftSize - 1;
+    if (BinMax <= BinMin)
+        BinMax = BinMin + 1;
+    maxbin = BinMax < fftSize ? BinMax : fftSize;
+    map.largeFft = (BinMax-BinMin) > plotWidth; // true if more fft point than plot points
+
+    if (map.largeFft)
+    {
+        // more FFT points than plot points, consecutive bins land on the
+        // same or the next pixel so every pixel in [xmin, xmax) gets a run.
+        // Pixel x starts at the first bin i with (i - BinMin) * W / D >= x.
+        const qint64 D = BinMax - BinMin;
+        const qint64 W = plotWidth;
+        auto xFromBin = [=](qint32 i) {
+            return (qint32)(((qint64)(i-BinMin)*W) / D);
+        };
+        auto binFromX = [=](qint32 x) {
+            return (qint32)(BinMin + (x*D + W - 1) / W);
+        };
+
+        map.xmin = minbin < maxbin ? xFromBin(minbin) : 0;
+        map.xmax = minbin < maxbin ? xFromBin(maxbin - 1) + 1 : 0;    // exclusive, like the small FFT map
+        int count = map.xmax - map.xmin;
+        map.index.resize(count + 1);
+        map.values.resize(count);
+
+        // Runs move to the level closest to the zoom. Edges round down to
+        // whole level values, the end rounds up to take in the last bins,
+        // and no run is left empty.
+        const int level = spectrum_pyramid::levelFor((int)(D / W));
+        const qint32 levelEnd = (maxbin + (1 << level) - 1) >> level;
+        map.level = level;
+        if (count > 0)
+        {
+            map.index[0] = minbin >> level;
+            for (int k = 1; k < count; k++)
+                map.index[k] = qMin(qMax(binFromX(map.xmin + k) >> level, map.index[k - 1] + 1),
+                                    levelEnd - 1);
+            map.index[count] = levelEnd;
+        }
+        else
+        {
+            map.index[0] = levelEnd;
+        }
+    }
+    else
+    {
+        // more plot points than FFT points
+        map.index.resize(plotWidth);
+        for (qint32 i = 0; i < plotWidth; i++)
+            map.index[i] = BinMin + (i*(BinMax - BinMin)) / plotWidth;
+        map.level = 0;
+        map.xmin = 0;
+        map.xmax = plotWidth;
+    }
+}
+
+// Smallest and mean value of each run [edges[k], edges[k + 1]), see spectrum_kernels::range_max
+static void range_min(const float *in, const int *edges, int count, float *out)
+{
+    for (int k = 0; k < count; k++)
+    {
+        float m = HUGE_VALF;
+        for (int i = edges[k]; i < edges[k + 1]; i++)
+            m = std::min(m, in[i]);
+        out[k] = m;
+    }
+}
+
+static void range_mean(const float *in, const int *edges, int count, float *out)
+{
+    for (int k = 0; k < count; k++)
+    {
+        float sum = 0;
+        for (int i = edges[k]; i < edges[k + 1]; i++)
+            sum += in[i];
+        out[k] = sum / qMax(1, edges[k + 1] - edges[k]);
+    }
+}
+
+// dB values of the shown range as y coordinates, one per pixel
+void plot_renderer::screen_data(qint32 plotHeight, qint32 plotWidth, float maxdB, float mindB,
+                                const spectrum_frame &frame, spectrum_pyramid &data, spectrum_statistic stat,
+                                qint32 *outBuf, qint32 *xmin, qint32 *xmax)
+{
+    bin_map &map = m_binMap;
+    const qint32 fftSize = data.size();
+    const float dBGainFactor = ((float)plotHeight) / fabs(maxdB - mindB);
+    qint64 startFreq = m_view.startFreq;
+    qint64 stopFreq = m_view.stopFreq;
+    float sampleFreq = m_view.sampleFreq;
+
+    // A zoomed frame covers just its band, centered on the zoom center
+    // instead of the FFT center
+    if (frame.bandWidth > 0)
+    {
+        const qint64 offset = m_view.centerFreq - (qint64)(frame.bandStart + frame.bandWidth / 2);
+        startFreq += offset;
+        stopFreq += offset;
+        sampleFreq = (float)frame.bandWidth;
+    }
+
+    if (map.fftSize != fftSize || map.plotWidth != plotWidth ||
+        map.startFreq != startFreq || map.stopFreq != stopFreq ||
+        map.sampleFreq != sampleFreq)
+        update_bin_map(fftSize, plotWidth, startFreq, stopFreq, sampleFreq);
+
+    *xmin = map.xmin;
+    *xmax = map.xmax;
+
+    auto toY = [=](float dB) {
+        return qBound(0, (qint32)(dBGainFactor*(maxdB-dB)), plotHeight);
+    };
+
+    if (map.largeFft)
+    {
+        // more FFT points than plot points, the bins of each pixel are
+        // combined from the pyramid level the map was built for
+        const int count = (int)map.values.size();
+        const float *in = data.level(map.level, stat);
+        switch (stat)
+        {
+        case SPECTRUM_STAT_MAX:
+            m_kernels.range_max(in, map.index.data(), count, map.values.data());
+            break;
+        case SPECTRUM_STAT_MIN:
+            range_min(in, map.index.data(), count, map.values.data());
+            break;
+        case SPECTRUM_STAT_MEAN:
+            range_mean(in, map.index.data(), count, map.values.data());
+            break;
+        }
+        for (int k = 0; k < count; k++)
+            outBuf[map.xmin + k] = toY(map.values[k]);
+    }
+    else
+    {
+        // more plot points than FFT points
+        const float *inBuf = data.level(0, stat);
+        for (qint32 x = 0; x < plotWidth; x++)
+        {
+            qint32 i = map.index[x]; // get plot to fft bin coordinate transform
+            outBuf[x] = (i < 0 || i >= fftSize) ? plotHeight : toY(inBuf[i]);
+        }
+    }
+}
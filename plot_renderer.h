@@ -0,0 +1,201 @@
+#ifndef PLOT_RENDERER_H
+#define PLOT_RENDERER_H
+
+#include <QThread>
+#include <QColor>
+#include <QImage>
+#include <QMutex>
+#include <QPoint>
+#include <QRect>
+#include <QSemaphore>
+#include <atomic>
+#include <vector>
+
+#include "peak_detector.h"
+#include "spectrum_frame.h"
+#include "spectrum_kernels.h"
+#include "spectrum_pyramid.h"
+#include "triple_buffer.h"
+
+#define PLOT_RENDERER_WAIT_MS   100
+#define PEAK_MARKER_MARGIN 7
+
+class waterfall_history;
+
+// Everything a frame is drawn with besides the spectrum itself. Owned by
+// the GUI thread, the renderer draws with the copy last given to setView().
+struct plot_view
+{
+    int     width {0};
+    int     spectrumHeight {0};
+    int     waterfallHeight {0};
+    float   sampleFreq {0};
+    qint64  centerFreq {0};         // frequency at the FFT center, places zoomed frames
+    qint64  startFreq {0};          // shown range, relative to the FFT center
+    qint64  stopFreq {0};
+    float   pandMindB {0};
+    float   pandMaxdB {0};
+    float   wfMindB {0};
+    float   wfMaxdB {0};
+    QColor  fftColor;
+    QColor  fftFillColor;
+    QColor  peakHoldColor;
+    bool    fftFill {false};
+    bool    peakHold {false};
+    float   peakDetection {-1};     // peak distance from the mean in standard deviations, <= 0 is off
+    spectrum_statistic detector {SPECTRUM_STAT_MAX};   // how the bins of one pandapter pixel are combined
+    quint64 msecPerLine {0};        // waterfall line period, 0 adds a line per frame
+    int     peakHoldResets {0};     // a new value restarts peak hold
+    int     waterfallClears {0};    // a new value clears the waterfall
+    qint64  historyEnd {0};         // ms since epoch of the newest stored line shown, 0 shows the live waterfall
+    qint64  historySpan {0};        // ms of stored lines over the waterfall height
+};
+
+// A finished picture, ready to be blitted
+struct plot_image
+{
+    QImage  trace;                  // pandapter, peaks and peak hold over transparent
+    QRect   traceRect;              // part of trace that is not transparent
+    QImage  waterfall;              // ring of lines, waterfallRow is the newest
+    int     waterfallRow {0};
+    quint64 lastLineMs {0};         // ms since epoch of the newest waterfall line
+    QImage  history;                // stored waterfall shown instead of the ring, null when live
+    qint64  historyEnd {0};         // what history shows, as in plot_view
+    qint64  historySpan {0};
+    std::vector<QPoint> peaks;      // detected peaks, sorted by x
+    bool    hasData {false};        // false until there is a spectrum to draw
+    int     sampleRate {0};         // format of the spectrum drawn, 0 if unknown
+    int     fftSize {0};
+    int     hop {0};
+
+    // Lets the renderer bring the ring up to date by copying new lines only
+    quint64 waterfallLines {0};
+    quint64 waterfallGeneration {0};
+};
+
+using plot_exchange = triple_buffer<plot_image>;
+
+// Rasterizes the pandapter and the waterfall of one plotter off the GUI
+// thread. On every requestFrame() the newest spectrum is pulled from the
+// source exchange, drawn into QImages with QPainter and published through
+// output(); frameRendered() is emitted when a picture is waiting, so the
+// GUI thread is left with blitting it. The trace is drawn on a transparent
+// layer that goes over the plotter's cached grid, only its bounding
+// rectangle is cleared and repainted.
+//
+// When a pixel covers many bins it is drawn from the spectrum pyramid level
+// closest to the zoom, so a frame costs about the same at any span.
+//
+// The waterfall is kept as a ring of lines in the renderer, each published
+// picture catches up by copying just the lines added since it was last
+// written instead of the whole image.
+//
+// Scrollback from a waterfall_history is drawn here as well, only when the
+// view it depends on changes, so it is coalesced with the view updates.
+class plot_renderer : public QThread
+{
+    Q_OBJECT
+public:
+    explicit plot_renderer(QObject *parent = nullptr);
+    ~plot_renderer();
+
+    // Returns once the old source is no longer read, so it may be deleted
+    void setSource(spectrum_exchange *source);
+    // Same for the store scrollback is read from
+    void setHistory(waterfall_history *history);
+    void setView(const plot_view &view);
+    void requestFrame() { m_wake.release(); }
+    void stop();
+
+    plot_exchange *output() { return &m_output; }
+    const plot_exchange *output() const { return &m_output; }
+
+    quint64 dataUpdates() const { return m_updates; }
+    // Spectra the analyzer replaced before the renderer took them
+    quint64 skippedUpdates() const { return m_skipped; }
+    void resetStats();
+
+    // Ring of lines with the newest at newestRow, unrolled newest on top
+    static QImage unrollWaterfall(const QImage &ring, int newestRow);
+    // rows x width dB values in the waterfall colors, -infinity is black
+    static QImage colorWaterfall(const std::vector<float> &db, int width, int rows,
+                                 float mindB, float maxdB);
+
+signals:
+    void frameRendered();
+
+protected:
+    void run() override;
+
+private:
+    // Bin to pixel mapping, rebuilt only on span, zoom, resize or a new FFT size
+    struct bin_map
+    {
+        qint32  fftSize {0};
+        qint32  plotWidth {0};
+        qint64  startFreq {0};
+        qint64  stopFreq {0};
+        float   sampleFreq {0};
+        bool    largeFft {false};
+        int     level {0};          // largeFft: pyramid level the runs are taken from
+        int     xmin {0};           // pixels [xmin, xmax) have bins
+        int     xmax {0};
+        std::vector<qint32> index;  // largeFft: run edges in level values of pixels xmin..xmax, else bin per pixel
+        std::vector<float>  values; // largeFft: reduced value per pixel
+    };
+
+    void render();
+    bool take_view();
+    void apply_view(const plot_view &view);
+    void add_waterfall_line(const spectrum_frame &frame);
+    void draw_spectrum(plot_image &out);
+    void sync_waterfall(plot_image &out);
+    void render_history();
+    void update_bin_map(qint32 fftSize, qint32 plotWidth, qint64 startFreq, qint64 stopFreq,
+                        float sampleFreq);
+    void screen_data(qint32 plotHeight, qint32 plotWidth, float maxdB, float mindB,
+                     const spectrum_frame &frame, spectrum_pyramid &data, spectrum_statistic stat,
+                     qint32 *outBuf, qint32 *xmin, qint32 *xmax);
+
+    plot_exchange m_output;
+    QSemaphore m_wake;
+    std::atomic<bool> m_stop {false};
+    std::atomic<quint64> m_updates {0};
+    std::atomic<quint64> m_skipped {0};
+
+    QMutex m_viewLock;
+    plot_view m_pendingView;        // guarded by m_viewLock
+    int m_viewVersion {0};          // guarded by m_viewLock
+
+    QMutex m_sourceLock;            // held while a frame is rendered
+    spectrum_exchange *m_source {nullptr};
+    waterfall_history *m_history {nullptr};
+
+    // Render thread only
+    spectrum_kernels m_kernels;
+    plot_view m_view;
+    int m_appliedVersion {0};
+    spectrum_exchange *m_current {nullptr};
+    const spectrum_frame *m_frame {nullptr};    // stays valid until the next update() of m_current
+    quint64 m_lastSequence {0};
+    bin_map m_binMap;
+    spectrum_pyramid m_pandPyramid; // of m_frame->average
+    spectrum_pyramid m_wfPyramid;   // of the waterfall data of the newest frame
+    std::vector<qint32> m_fftbuf;   // one entry per pixel
+    std::vector<quint8> m_wfbuf;    // used for accumulating waterfall data at high time spans
+    peak_detector m_peakDetector;
+    std::vector<qint32> m_peakHoldBuf;
+    bool m_peakHoldValid {false};
+    std::vector<QPoint> m_lineBuf;  // pandapter polyline plus two fill corners
+    QImage m_waterfall;
+    int m_waterfallRow {0};
+    quint64 m_waterfallLines {0};   // lines added in this generation
+    quint64 m_waterfallGeneration {1};
+    quint64 m_lastLineMs {0};
+    waterfall_history *m_currentHistory {nullptr};
+    bool m_historyDirty {false};
+    QImage m_historyImage;
+    std::vector<float> m_historyDb;
+};
+
+#endif // PLOT_RENDERER_H
@@ -7,6 +7,7 @@
 #include "videosettings.h"
 #include "imagesettings.h"
 #include "metadatadialog.h"
+#include "videosurface.h"
 
 #include <QMediaRecorder>
 #include <QVideoWidget>
@@ -23,10 +24,6 @@
 #include <QtWidgets>
 #include <QMediaDevices>
 
-static fftw_plan  planFft;
-static fftw_complex* in= (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*DEFAULT_FFT_SIZE);
-static fftw_complex* out= (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*DEFAULT_FFT_SIZE);
-
 Rtmp::Rtmp()
     : ui(new Ui::Camera)
 {
@@ -38,7 +35,12 @@ Rtmp::Rtmp()
     ui->textTerminal->setStyleSheet("font: 10pt; color: #00cccc; background-color: #001a1a;");
     //    ui->audioOutputDeviceBox->setStyleSheet("font-size: 10pt; font-weight: bold; color: white;background-color:orange; padding: 6px; spacing: 6px;");
     connect(ui->audioOutputDeviceBox, QOverload<int>::of(&QComboBox::activated), this, &Rtmp::outputDeviceChanged);
-    QObject::connect(this, SIGNAL(spectValueChanged(int)),this, SLOT(onSpectrumProcessed(int)));
+
+    QMenu *audioMenu = menuBar()->addMenu(tr("Audio"));
+    QAction *playbackAction = audioMenu->addAction(tr("Play preview audio"));
+    playbackAction->setCheckable(true);
+    playbackAction->setChecked(m_previewPlayback);
+    connect(playbackAction, &QAction::toggled, this, &Rtmp::setPreviewPlayback);
 
     ui->graphicsView->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
 
@@ -50,15 +52,29 @@ Rtmp::Rtmp()
     m_audioInput.reset(new QAudioInput);
     m_captureSession.setAudioInput(m_audioInput.get());
 
-    m_ffmpeg_rtmp = new ffmpeg_rtmp();
-    if(m_ffmpeg_rtmp)
+    // Preview is pulled once per display refresh instead of pushed per decoded frame
+    qreal refreshRate = QGuiApplication::primaryScreen() ? QGuiApplication::primaryScreen()->refreshRate() : 0;
+    if (refreshRate <= 0)
+        refreshRate = PREVIEW_DEFAULT_REFRESH_HZ;
+    m_previewTimer.setTimerType(Qt::PreciseTimer);
+    m_previewTimer.setInterval(qMax(1, qRound(1000.0 / refreshRate)));
+    m_refreshRate = qRound(refreshRate);
+    ui->Plotter->setRefreshRate(refreshRate);
+    connect(&m_previewTimer, &QTimer::timeout, this, &Rtmp::pollPreview);
+
+    connect(ui->graphicsView, &VideoSurface::viewportChanged, this, [this](QSize size, QRectF crop) {
+        if (m_previewSession)
+            m_previewSession->setPreviewGeometry(size, crop, ui->graphicsView->devicePixelRatioF());
+    });
+
+    m_rtmp_server = new rtmp_server(this);
+    if(m_rtmp_server)
     {
-        connect(m_ffmpeg_rtmp,&ffmpeg_rtmp::sendUrl,this, &Rtmp::setUrl);
-        connect(m_ffmpeg_rtmp,&ffmpeg_rtmp::sendInfo,this, &Rtmp::setInfo);
-        connect(m_ffmpeg_rtmp,&ffmpeg_rtmp::sendConnectionStatus,this, &Rtmp::setConnectionStatus);
-        connect(m_ffmpeg_rtmp,&ffmpeg_rtmp::sendVideoFrame,this, &Rtmp::setVideoFrame);
-        connect(m_ffmpeg_rtmp,&ffmpeg_rtmp::sendAudioFrame,this, &Rtmp::setAudioFrame);
-        m_ffmpeg_rtmp->setUrl();
+        connect(m_rtmp_server,&rtmp_server::sendUrl,this, &Rtmp::setUrl);
+        connect(m_rtmp_server,&rtmp_server::sendInfo,this, &Rtmp::setInfo);
+        connect(m_rtmp_server,&rtmp_server::sessionCreated,this, &Rtmp::onSessionCreated);
+        connect(m_rtmp_server,&rtmp_server::sessionFinished,this, &Rtmp::onSessionFinished);
+        m_rtmp_server->setUrl();
     }
 
     //Camera devices:
@@ -70,16 +86,21 @@ Rtmp::Rtmp()
 
     connect(videoDevicesGroup, &QActionGroup::triggered, this, &Rtmp::updateCameraDevice);
     connect(ui->captureWidget, &QTabWidget::currentChanged, this, &Rtmp::updateCaptureMode);
+    connect(ui->captureWidget, &QTabWidget::currentChanged, this, &Rtmp::updateDecodeDemand);
 
-    scene = new QGraphicsScene;
-    QBrush brush(Qt::black); // Set the desired background color
-    scene->setBackgroundBrush(brush);
-    view = ui->graphicsView;
-    view->setScene(scene);
     setCamera(QMediaDevices::defaultVideoInput());
     initSpectrumGraph();
 }
 
+Rtmp::~Rtmp()
+{
+    // The server is a child and would go after the widgets, its sessions
+    // have to end while the slots they report to can still use the UI
+    m_previewTimer.stop();
+    m_rtmp_server->stop();
+    disconnect(m_rtmp_server, nullptr, this, nullptr);
+    delete ui;
+}
 
 void Rtmp::resizeEvent(QResizeEvent *event)
 {
@@ -89,9 +110,153 @@ void Rtmp::resizeEvent(QResizeEvent *event)
 //    ui->graphicsView->setFixedSize(2 * width, height);
 }
 
-void Rtmp::onSpectrumProcessed(int fftSize)
+/**
+ * The plotter maps its data array onto [-fs/2, fs/2) around the FFT centre.
+ * Handing it the one-sided bins as if sampled at fs/2 and centring at fs/4
+ * lines bin i up with i * fs / fftSize on the axis, DC at the left edge.
+ */
+void Rtmp::setSpectrumAxis(int sampleRate, int fftSize, int hop)
+{
+    // Zooming changes the hop, only a new sample rate resets the axis
+    if (sampleRate != m_spectrumRate)
+    {
+        m_spectrumRate = sampleRate;
+        ui->Plotter->setSampleRate(sampleRate / 2);
+        ui->Plotter->setSpanFreq((quint32)(sampleRate / 2));
+        ui->Plotter->setCenterFreq(sampleRate / 4);
+        ui->Plotter->setFftCenterFreq(0);
+        m_spectrum->setZoom(0, 0);
+    }
+    // One spectrum per hop, but the waterfall gets at most one line per refresh
+    int rate = qMax(1, sampleRate / qMax(1, hop));
+    ui->Plotter->setFftRate(qMin(rate, m_refreshRate));
+}
+
+// The analyzer resolves the shown band by itself once the plotter is zoomed in
+void Rtmp::setSpectrumZoom(float level)
+{
+    qint64 center = ui->Plotter->getCenterFreq() + ui->Plotter->getFftCenterFreq();
+    m_spectrum->setZoom(center, level > 1.0f ? ui->Plotter->getSpanFreq() : 0);
+}
+
+void Rtmp::initSpectrumMenu()
 {
-    ui->Plotter->setNewFttData(d_iirFftData, d_realFftData, fftSize/2);
+    QMenu *menu = menuBar()->addMenu(tr("Spectrum"));
+
+    QMenu *sizeMenu = menu->addMenu(tr("FFT size"));
+    auto *sizeGroup = new QActionGroup(this);
+    for (int size = SPECTRUM_MIN_FFT_SIZE; size <= SPECTRUM_MAX_FFT_SIZE; size *= 2)
+    {
+        QAction *action = sizeMenu->addAction(QString::number(size));
+        action->setCheckable(true);
+        action->setChecked(size == DEFAULT_FFT_SIZE);
+        action->setData(size);
+        sizeGroup->addAction(action);
+    }
+    connect(sizeGroup, &QActionGroup::triggered, this, [this](QAction *action) {
+        m_spectrum->setFftSize(action->data().toInt());
+    });
+
+    QMenu *overlapMenu = menu->addMenu(tr("Overlap"));
+    auto *overlapGroup = new QActionGroup(this);
+    for (float overlap : { 0.0f, 0.5f, 0.75f, 0.875f, SPECTRUM_MAX_OVERLAP })
+    {
+        QAction *action = overlapMenu->addAction(QString("%1 %").arg(overlap * 100.0f));
+        action->setCheckable(true);
+        action->setChecked(overlap == SPECTRUM_DEFAULT_OVERLAP);
+        action->setData(overlap);
+        overlapGroup->addAction(action);
+    }
+    connect(overlapGroup, &QActionGroup::triggered, this, [this](QAction *action) {
+        m_spectrum->setOverlap(action->data().toFloat());
+    });
+
+    QMenu *averageMenu = menu->addMenu(tr("Averaged segments"));
+    auto *averageGroup = new QActionGroup(this);
+    for (int segments = 1; segments <= SPECTRUM_MAX_SEGMENTS; segments *= 2)
+    {
+        QAction *action = averageMenu->addAction(QString::number(segments));
+        action->setCheckable(true);
+        action->setChecked(segments == SPECTRUM_DEFAULT_SEGMENTS);
+        action->setData(segments);
+        averageGroup->addAction(action);
+    }
+    connect(averageGroup, &QActionGroup::triggered, this, [this](QAction *action) {
+        m_spectrum->setSegments(action->data().toInt());
+    });
+
+    QMenu *windowMenu = menu->addMenu(tr("Window"));
+    auto *windowGroup = new QActionGroup(this);
+    const QList<QPair<QString, spectrum_window>> windows = {
+        { tr("Rectangular"), SPECTRUM_WINDOW_RECT },
+        { tr("Hann"), SPECTRUM_WINDOW_HANN },
+        { tr("Blackman-Harris"), SPECTRUM_WINDOW_BLACKMAN_HARRIS },
+    };
+    for (const auto &window : windows)
+    {
+        QAction *action = windowMenu->addAction(window.first);
+        action->setCheckable(true);
+        action->setChecked(window.second == SPECTRUM_WINDOW_HANN);
+        action->setData(int(window.second));
+        windowGroup->addAction(action);
+    }
+    connect(windowGroup, &QActionGroup::triggered, this, [this](QAction *action) {
+        m_spectrum->setWindow(spectrum_window(action->data().toInt()));
+    });
+
+    QMenu *detectorMenu = menu->addMenu(tr("Detector"));
+    auto *detectorGroup = new QActionGroup(this);
+    const QList<QPair<QString, spectrum_statistic>> detectors = {
+        { tr("Peak"), SPECTRUM_STAT_MAX },
+        { tr("Minimum"), SPECTRUM_STAT_MIN },
+        { tr("Average"), SPECTRUM_STAT_MEAN },
+    };
+    for (const auto &detector : detectors)
+    {
+        QAction *action = detectorMenu->addAction(detector.first);
+        action->setCheckable(true);
+        action->setChecked(detector.second == SPECTRUM_STAT_MAX);
+        action->setData(int(detector.second));
+        detectorGroup->addAction(action);
+    }
+    connect(detectorGroup, &QActionGroup::triggered, this, [this](QAction *action) {
+        ui->Plotter->setDetector(spectrum_statistic(action->data().toInt()));
+    });
+
+    QMenu *historyMenu = menu->addMenu(tr("Waterfall history"));
+    auto *historyGroup = new QActionGroup(this);
+    const QList<QPair<QString, int>> spans = {
+        { tr("Live"), 0 },
+        { tr("Last 10 minutes"), 10 * 60 },
+        { tr("Last hour"), 60 * 60 },
+        { tr("Last 4 hours"), 4 * 60 * 60 },
+    };
+    for (const auto &span : spans)
+    {
+        QAction *action = historyMenu->addAction(span.first);
+        action->setCheckable(true);
+        action->setChecked(span.second == 0);
+        action->setData(span.second);
+        historyGroup->addAction(action);
+    }
+    connect(historyGroup, &QActionGroup::triggered, this, [this](QAction *action) {
+        qint64 span = action->data().toInt() * 1000LL;
+        ui->Plotter->showWaterfallHistory(span ? QDateTime::currentMSecsSinceEpoch() : 0, span);
+    });
+
+    historyMenu->addSeparator();
+    historyMenu->addAction(tr("Save..."), this, [this]() {
+        qint64 first, last;
+        if (!m_spectrum->history()->timeRange(&first, &last))
+        {
+            setInfo("Waterfall history is empty");
+            return;
+        }
+        QString fileName = QFileDialog::getSaveFileName(this, tr("Save waterfall history"), QString(),
+                                                        tr("Images (*.png *.jpg)"));
+        if (!fileName.isEmpty() && !ui->Plotter->saveWaterfall(fileName, first, last + 1))
+            setInfo("Can not save waterfall history to " + fileName);
+    });
 }
 
 void Rtmp::initSpectrumGraph()
@@ -99,23 +264,27 @@ void Rtmp::initSpectrumGraph()
     auto fftSize = DEFAULT_FFT_SIZE;
     auto sampleRate = DEFAULT_SAMPLE_RATE;
 
-    d_realFftData = new float[fftSize];
-    d_iirFftData = new float[fftSize]();
-
-    for (int i = 0; i < fftSize; i++)
-        d_iirFftData[i] = RESET_FFT_FACTOR;  // dBFS
-
-    for (int i = 0; i < fftSize; i++)
-        d_realFftData[i] = RESET_FFT_FACTOR;
 
     d_fftAvg = 1.0 - 1.0e-2 * ((float)75);
 
+    // FFTs run on their own thread, the GUI only picks up finished spectra
+    m_spectrum = new spectrum_worker(this);
+    m_spectrum->setFftSize(fftSize);
+    m_spectrum->setAveraging(d_fftAvg);
+    m_spectrum->setWindow(SPECTRUM_WINDOW_HANN);
+    m_spectrum->setOverlap(SPECTRUM_DEFAULT_OVERLAP);
+    m_spectrum->setSegments(SPECTRUM_DEFAULT_SEGMENTS);
+    m_spectrum->start(QThread::LowPriority);
+    initSpectrumMenu();
+
+    // The plotter pulls finished spectra itself, once per display refresh
+    ui->Plotter->setSpectrumSource(m_spectrum->exchange());
+    ui->Plotter->setWaterfallHistory(m_spectrum->history());
+    connect(ui->Plotter, &CPlotter::spectrumFormatChanged, this, &Rtmp::setSpectrumAxis);
+    connect(ui->Plotter, &CPlotter::newZoomLevel, this, &Rtmp::setSpectrumZoom);
+
     ui->Plotter->setTooltipsEnabled(true);
-    ui->Plotter->setSampleRate(sampleRate);
-    ui->Plotter->setSpanFreq((quint32)sampleRate);
-    ui->Plotter->setCenterFreq(sampleRate/2);
-    ui->Plotter->setFftCenterFreq(0);
-    ui->Plotter->setFftRate(sampleRate/fftSize);
+    setSpectrumAxis(sampleRate, fftSize, int(fftSize * (1.0f - SPECTRUM_DEFAULT_OVERLAP)));
     ui->Plotter->setFftRange(-140.0f, 20.0f);
 
     ui->Plotter->setFreqUnits(1000);
@@ -133,66 +302,22 @@ void Rtmp::initSpectrumGraph()
 
 void Rtmp::setVideoFrame(QImage image)
 {
-    scene->clear();
-    QGraphicsPixmapItem *pixmapItem = scene->addPixmap(QPixmap::fromImage(image));
-    view->fitInView(scene->sceneRect(), Qt::KeepAspectRatio);
-    view->update();
-}
-
-void Rtmp::setAudioFrame(const char * payloadbuf, int payloadlen)
-{
-
-    for (int i = 0; i < payloadlen; i++)
-    {
-        if(sampleCount < DEFAULT_FFT_SIZE)
-        {
-            signalInput[sampleCount] = payloadbuf[i];
-            sampleCount ++;
-        }
-        else
-        {
-            runFFTW(signalInput,DEFAULT_FFT_SIZE);
-            sampleCount = 0;
-        }
-    }
+    ui->graphicsView->setFrame(image);
 }
 
-void Rtmp::runFFTW(float *buffer, int fftsize)
+void Rtmp::setPreviewPlayback(bool enabled)
 {
-    if(fftsize > 0)
-    {
-        float pwr, lpwr;
-        float pwr_scale = 1.0 / ((float)fftsize * (float)fftsize);
-        int i;
-
-        planFft = fftw_plan_dft_1d(fftsize, in, out, FFTW_FORWARD, FFTW_ESTIMATE);
-
-        for (i=0; i < fftsize; i++)
-        {
-            in[i][0] = (float)buffer[i] / 127.5f - 1.f;
-            in[i][1] = (float)-buffer[i+1] / 127.5f - 1.f;
-        }
-
-        fftw_execute(planFft);
-
-        for (i = 0; i < fftsize; ++i)
-        {
-            pwr  = sqrt(out[i][REAL] * out[i][REAL] + out[i][IMAG] * out[i][IMAG]);
-            lpwr = 15.f * log10f(pwr_scale * pwr);
-
-            if(d_realFftData[i] < lpwr)
-                d_realFftData[i] = lpwr;
-            else d_realFftData[i] -= (d_realFftData[i] - lpwr) / 5.f;
-                d_iirFftData[i] += d_fftAvg * (d_realFftData[i] - d_iirFftData[i]);
-        }
-        emit spectValueChanged(fftsize);
-    }
+    m_previewPlayback = enabled;
+    if (m_previewSession)
+        m_previewSession->setPlaybackEnabled(enabled);
+    updateDecodeDemand();
 }
 
 void Rtmp::outputDeviceChanged(int index)
 {
     QAudioDevice ouputDevice = ui->audioOutputDeviceBox->itemData(index).value<QAudioDevice>();
-    m_ffmpeg_rtmp->set_audio_device(ouputDevice);
+    if (m_previewSession)
+        m_previewSession->set_audio_device(ouputDevice);
 }
 
 
@@ -522,13 +647,14 @@ void Rtmp::on_pushStream_clicked()
 {
     if(ui->pushStream->text() == "Start")
     {
-        m_ffmpeg_rtmp->start();
-        ui->pushStream->setText("Stop");
+        if (m_rtmp_server->start())
+            ui->pushStream->setText("Stop");
     }
     else
     {
-        m_ffmpeg_rtmp->stop();
+        m_rtmp_server->stop();
         ui->pushStream->setText("Start");
+        setInfo("Rtmp stream server stopped.");
     }
 }
 
@@ -544,18 +670,136 @@ void Rtmp::setUrl(QString url)
 
 void Rtmp::setConnectionStatus(bool status)
 {
+    // The start/stop button follows the listener, not the individual publishers
     if(status)
-    {
-        ui->pushStream->setText("Stop");
         setInfo("Rtmp stream started.");
-    }
     else
-    {
-        ui->pushStream->setText("Start");
         setInfo("Rtmp stream stopped.");
+}
+
+void Rtmp::onSessionCreated(QString key, ffmpeg_rtmp *session)
+{
+    // The first publisher gets the preview and the audio output, the rest only record
+    if (m_previewSession)
+    {
+        session->setPlaybackEnabled(false);
+        return;
+    }
+
+    startPreview(key, session);
+}
+
+void Rtmp::startPreview(const QString &key, ffmpeg_rtmp *session)
+{
+    m_previewSession = session;
+    session->setPlaybackEnabled(m_previewPlayback);
+    connect(session,&ffmpeg_rtmp::sendConnectionStatus,this, &Rtmp::setConnectionStatus, Qt::UniqueConnection);
+    session->videoMailbox().clear();
+    session->setPreviewGeometry(ui->graphicsView->viewportSize(), ui->graphicsView->cropRect(),
+                                ui->graphicsView->devicePixelRatioF());
+    ui->graphicsView->resetStats();
+    session->audioMailbox().clear();
+    updateDecodeDemand();
+    m_previewTimer.start();
+    setInfo("Previewing stream key " + key);
+
+    // Scrollback continues where the last session of this key stopped
+    if (!m_spectrum->history()->open(waterfall_history::pathFor(key)))
+        setInfo("No waterfall history for stream key " + key);
+}
+
+void Rtmp::onSessionFinished(QString key)
+{
+    if (m_previewSession && m_previewSession->streamKey() == key)
+    {
+        auto st = m_previewSession->stats();
+        setInfo("Preview frames dropped: " + QString::number(st.previewFramesDropped) +
+                " max age: " + QString::number(st.previewFrameMaxAgeUs / 1000) + " ms");
+        setInfo("Playback underruns: " + QString::number(st.playbackUnderruns) +
+                " overruns: " + QString::number(st.playbackOverruns));
+        auto paint = ui->graphicsView->stats();
+        setInfo("Preview frames shown: " + QString::number(paint.frames) +
+                " paint avg: " + QString::number(paint.avgPaintUs, 'f', 1) + " us" +
+                " max: " + QString::number(paint.maxPaintUs) + " us");
+        setInfo("Spectrum frames: " + QString::number(ui->Plotter->dataUpdates()) +
+                " drawn at " + QString::number(ui->Plotter->drawFps(), 'f', 1) + " fps" +
+                " skipped: " + QString::number(ui->Plotter->skippedUpdates()) +
+                " overwritten: " + QString::number(m_spectrum->framesOverwritten()));
+        ui->Plotter->resetDrawStats();
+        m_spectrum->history()->close();
+        ui->graphicsView->clear();
+        ui->graphicsView->resetZoom();
+        m_previewSession->setPlaybackEnabled(false);
+        m_previewSession = nullptr;
+        m_previewTimer.stop();
+
+        // Another publisher that is still live takes over the preview
+        for (const QString &other : m_rtmp_server->streamKeys())
+        {
+            ffmpeg_rtmp *session = m_rtmp_server->session(other);
+            if (other != key && session)
+            {
+                startPreview(other, session);
+                break;
+            }
+        }
     }
 }
 
+void Rtmp::updateDecodeDemand()
+{
+    if (!m_previewSession)
+        return;
+
+    // Minimized or hidden preview decodes nothing, an unexposed window keeps
+    // a keyframe-only picture so it is not stale when it comes back
+    ffmpeg_rtmp::video_demand video = ffmpeg_rtmp::VIDEO_DEMAND_ALL;
+    if (isMinimized() || !ui->graphicsView->isVisible())
+        video = ffmpeg_rtmp::VIDEO_DEMAND_NONE;
+    else if (windowHandle() && !windowHandle()->isExposed())
+        video = ffmpeg_rtmp::VIDEO_DEMAND_KEYFRAMES;
+    m_previewSession->setVideoDemand(video);
+
+    // Playback always needs the decoded audio, the spectrum only while
+    // visible; with both off the AAC is left undecoded
+    bool spectrum = !isMinimized() && ui->Plotter->isVisible();
+    m_previewSession->setAudioDemand(m_previewPlayback || spectrum);
+}
+
+void Rtmp::changeEvent(QEvent *event)
+{
+    QMainWindow::changeEvent(event);
+    if (event->type() == QEvent::WindowStateChange || event->type() == QEvent::ActivationChange)
+        updateDecodeDemand();
+}
+
+void Rtmp::showEvent(QShowEvent *event)
+{
+    QMainWindow::showEvent(event);
+    updateDecodeDemand();
+}
+
+void Rtmp::hideEvent(QHideEvent *event)
+{
+    QMainWindow::hideEvent(event);
+    updateDecodeDemand();
+}
+
+void Rtmp::pollPreview()
+{
+    if (!m_previewSession)
+        return;
+
+    // Only the newest frame is kept, whatever arrived in between is dropped
+    QImage image;
+    if (m_previewSession->videoMailbox().take(image))
+        setVideoFrame(image);
+
+    const QList<audio_buffer> blocks = m_previewSession->audioMailbox().takeAll();
+    for (const audio_buffer &block : blocks)
+        m_spectrum->pushAudio(block);
+}
+
 void Rtmp::on_pushExit_clicked()
 {
     QApplication::quit();
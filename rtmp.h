@@ -12,11 +12,10 @@
 #include <QMediaPlayer>
 #include <QMainWindow>
 #include <QMediaFormat>
-#include <QGraphicsView>
-#include <QGraphicsScene>
 #include <QTimer>
-#include <fftw3.h>
 #include "ffmpeg_rtmp.h"
+#include "spectrum_worker.h"
+#include "rtmp_server.h"
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class Camera; }
@@ -25,9 +24,7 @@ QT_END_NAMESPACE
 
 #define DEFAULT_SAMPLE_RATE		44100
 #define DEFAULT_FFT_SIZE        4096
-#define RESET_FFT_FACTOR        -72.0f
-#define REAL 0
-#define IMAG 1
+#define PREVIEW_DEFAULT_REFRESH_HZ 60
 
 class MetaDataDialog;
 
@@ -37,6 +34,7 @@ class Rtmp : public QMainWindow
 
 public:
     Rtmp();
+    ~Rtmp();
 
 public slots:
     void saveMetaData();
@@ -86,31 +84,36 @@ private slots:
     void setInfo(QString);
     void setUrl(QString);
     void setConnectionStatus(bool);
+    void onSessionCreated(QString, ffmpeg_rtmp*);
+    void onSessionFinished(QString);
+    void pollPreview();
+    void updateDecodeDemand();
+    void setPreviewPlayback(bool enabled);
     void setVideoFrame(QImage);
-    void setAudioFrame(const char*, int);
 
     void on_pushStream_clicked();
     void on_pushExit_clicked();
     void outputDeviceChanged(int index);
 
     void initSpectrumGraph();
-    void runFFTW(float *buffer, int fftsize);
-    void onSpectrumProcessed(int fftSize);
-
-signals:
-    void spectValueChanged(int fftSize);
 
 protected:
     void keyPressEvent(QKeyEvent *event) override;
     void keyReleaseEvent(QKeyEvent *event) override;
     void closeEvent(QCloseEvent *event) override;
+    void changeEvent(QEvent *event) override;
+    void showEvent(QShowEvent *event) override;
+    void hideEvent(QHideEvent *event) override;
     void resizeEvent(QResizeEvent* event) override;
     void handleResizeEvent(QResizeEvent* event);
 
 private:
     Ui::Camera *ui;
 
-    ffmpeg_rtmp* m_ffmpeg_rtmp = nullptr;
+    rtmp_server* m_rtmp_server = nullptr;
+    ffmpeg_rtmp* m_previewSession = nullptr;
+    QTimer m_previewTimer;
+    bool m_previewPlayback = true;      // user choice, Audio menu
     QActionGroup *videoDevicesGroup  = nullptr;
     QMediaDevices m_devices;
     QMediaCaptureSession m_captureSession;
@@ -119,18 +122,19 @@ private:
     QImageCapture *m_imageCapture;
     QScopedPointer<QMediaRecorder> m_mediaRecorder;
 
-    QGraphicsScene *scene;
-    QGraphicsView *view;
-
     bool m_isCapturingImage = false;
     bool m_applicationExiting = false;
     bool m_doImageCapture = true;
 
-    unsigned int sampleCount = 0;
-    float   *d_realFftData;
-    float   *d_iirFftData;
-    float signalInput[DEFAULT_FFT_SIZE];
+    void startPreview(const QString &key, ffmpeg_rtmp *session);
+    void initSpectrumMenu();
+    void setSpectrumAxis(int sampleRate, int fftSize, int hop);
+    void setSpectrumZoom(float level);
+
+    spectrum_worker *m_spectrum = nullptr;
+    int m_spectrumRate = 0;
     float d_fftAvg;
+    int m_refreshRate = PREVIEW_DEFAULT_REFRESH_HZ;
 
     MetaDataDialog *m_metaDataDialog = nullptr;
 };
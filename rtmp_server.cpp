@@ -0,0 +1,806 @@
+#include "rtmp_server.h"
+
+#include <QNetworkInterface>
+#include <QRandomGenerator>
+#include <QElapsedTimer>
+#include <QStandardPaths>
+#include <QtEndian>
+#include <cstring>
+#include <utility>
+
+// RTMP message types
+#define RTMP_MSG_SET_CHUNK_SIZE     1
+#define RTMP_MSG_ABORT              2
+#define RTMP_MSG_ACK                3
+#define RTMP_MSG_USER_CONTROL       4
+#define RTMP_MSG_WINDOW_ACK_SIZE    5
+#define RTMP_MSG_SET_PEER_BW        6
+#define RTMP_MSG_AUDIO              8
+#define RTMP_MSG_VIDEO              9
+#define RTMP_MSG_DATA_AMF3          15
+#define RTMP_MSG_COMMAND_AMF3       17
+#define RTMP_MSG_DATA_AMF0          18
+#define RTMP_MSG_COMMAND_AMF0       20
+
+#define RTMP_CSID_CONTROL           2
+#define RTMP_CSID_COMMAND           3
+#define RTMP_CSID_STATUS            5
+#define RTMP_PUBLISH_STREAM_ID      1
+#define RTMP_MAX_MESSAGE_SIZE       (16 * 1024 * 1024)
+
+#define FLV_TAG_AUDIO               8
+#define FLV_TAG_VIDEO               9
+#define FLV_TAG_SCRIPT              18
+
+// AMF0 markers
+#define AMF0_NUMBER                 0x00
+#define AMF0_BOOLEAN                0x01
+#define AMF0_STRING                 0x02
+#define AMF0_OBJECT                 0x03
+#define AMF0_NULL                   0x05
+#define AMF0_UNDEFINED              0x06
+#define AMF0_ECMA_ARRAY             0x08
+#define AMF0_OBJECT_END             0x09
+#define AMF0_STRICT_ARRAY           0x0A
+#define AMF0_DATE                   0x0B
+#define AMF0_LONG_STRING            0x0C
+
+static inline void put_be16(QByteArray &out, quint16 v)
+{
+    out.append(char(v >> 8));
+    out.append(char(v));
+}
+
+static inline void put_be24(QByteArray &out, quint32 v)
+{
+    out.append(char(v >> 16));
+    out.append(char(v >> 8));
+    out.append(char(v));
+}
+
+static inline void put_be32(QByteArray &out, quint32 v)
+{
+    out.append(char(v >> 24));
+    out.append(char(v >> 16));
+    out.append(char(v >> 8));
+    out.append(char(v));
+}
+
+static inline void put_le32(QByteArray &out, quint32 v)
+{
+    out.append(char(v));
+    out.append(char(v >> 8));
+    out.append(char(v >> 16));
+    out.append(char(v >> 24));
+}
+
+static inline quint32 get_be24(const uchar *p)
+{
+    return (quint32(p[0]) << 16) | (quint32(p[1]) << 8) | quint32(p[2]);
+}
+
+/** Decode one AMF0 value at pos. Only the types RTMP publishers send are supported. */
+static bool amf0_read_value(const QByteArray &buf, int &pos, QVariant &value, int depth = 0)
+{
+    const uchar *p = reinterpret_cast<const uchar*>(buf.constData());
+    const int size = buf.size();
+
+    if (pos >= size || depth > 8)
+        return false;
+
+    quint8 type = p[pos++];
+    switch (type)
+    {
+    case AMF0_NUMBER:
+    {
+        if (pos + 8 > size)
+            return false;
+        quint64 bits = qFromBigEndian<quint64>(p + pos);
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        value = d;
+        pos += 8;
+        return true;
+    }
+    case AMF0_BOOLEAN:
+        if (pos + 1 > size)
+            return false;
+        value = p[pos++] != 0;
+        return true;
+    case AMF0_STRING:
+    case AMF0_LONG_STRING:
+    {
+        int hdr = (type == AMF0_STRING) ? 2 : 4;
+        if (pos + hdr > size)
+            return false;
+        quint32 len = (type == AMF0_STRING) ? qFromBigEndian<quint16>(p + pos) : qFromBigEndian<quint32>(p + pos);
+        pos += hdr;
+        if (len > quint32(size - pos))
+            return false;
+        value = QString::fromUtf8(buf.constData() + pos, int(len));
+        pos += int(len);
+        return true;
+    }
+    case AMF0_OBJECT:
+    case AMF0_ECMA_ARRAY:
+    {
+        if (type == AMF0_ECMA_ARRAY)
+        {
+            if (pos + 4 > size)
+                return false;
+            pos += 4; // approximate count, the end marker is authoritative
+        }
+        QVariantMap map;
+        while (pos + 2 <= size)
+        {
+            quint16 klen = qFromBigEndian<quint16>(p + pos);
+            pos += 2;
+            if (klen == 0 && pos < size && p[pos] == AMF0_OBJECT_END)
+            {
+                pos++;
+                value = map;
+                return true;
+            }
+            if (klen > size - pos)
+                return false;
+            QString key = QString::fromUtf8(buf.constData() + pos, klen);
+            pos += klen;
+            QVariant v;
+            if (!amf0_read_value(buf, pos, v, depth + 1))
+                return false;
+            map.insert(key, v);
+        }
+        return false;
+    }
+    case AMF0_STRICT_ARRAY:
+    {
+        if (pos + 4 > size)
+            return false;
+        quint32 count = qFromBigEndian<quint32>(p + pos);
+        pos += 4;
+        QVariantList list;
+        for (quint32 i = 0; i < count; i++)
+        {
+            QVariant v;
+            if (!amf0_read_value(buf, pos, v, depth + 1))
+                return false;
+            list.append(v);
+        }
+        value = list;
+        return true;
+    }
+    case AMF0_DATE:
+        if (pos + 10 > size)
+            return false;
+        pos += 10;
+        value = QVariant();
+        return true;
+    case AMF0_NULL:
+    case AMF0_UNDEFINED:
+        value = QVariant();
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void amf0_write_string(QByteArray &out, const QString &s)
+{
+    QByteArray utf8 = s.toUtf8();
+    out.append(char(AMF0_STRING));
+    put_be16(out, quint16(utf8.size()));
+    out.append(utf8);
+}
+
+static void amf0_write_number(QByteArray &out, double d)
+{
+    quint64 bits;
+    memcpy(&bits, &d, sizeof(bits));
+    out.append(char(AMF0_NUMBER));
+    for (int shift = 56; shift >= 0; shift -= 8)
+        out.append(char(bits >> shift));
+}
+
+static void amf0_write_null(QByteArray &out)
+{
+    out.append(char(AMF0_NULL));
+}
+
+static void amf0_write_object(QByteArray &out, const QList<QPair<QString, QVariant>> &fields)
+{
+    out.append(char(AMF0_OBJECT));
+    for (const auto &field : fields)
+    {
+        QByteArray key = field.first.toUtf8();
+        put_be16(out, quint16(key.size()));
+        out.append(key);
+        if (field.second.typeId() == QMetaType::QString)
+            amf0_write_string(out, field.second.toString());
+        else if (field.second.typeId() == QMetaType::Bool)
+        {
+            out.append(char(AMF0_BOOLEAN));
+            out.append(char(field.second.toBool() ? 1 : 0));
+        }
+        else
+            amf0_write_number(out, field.second.toDouble());
+    }
+    put_be16(out, 0);
+    out.append(char(AMF0_OBJECT_END));
+}
+
+rtmp_connection::rtmp_connection(qintptr socketDescriptor, rtmp_server *server)
+    : QThread{nullptr}
+    , m_socketDescriptor(socketDescriptor)
+    , m_server(server)
+    , m_pipe(std::make_shared<flv_pipe>())
+{
+}
+
+rtmp_connection::~rtmp_connection()
+{
+    stop();
+    wait();
+}
+
+void rtmp_connection::stop()
+{
+    m_stop = true;
+    m_pipe->close();
+}
+
+bool rtmp_connection::read_exact(char *data, int size)
+{
+    QElapsedTimer idle;
+    idle.start();
+
+    int total = 0;
+    while (total < size)
+    {
+        if (m_stop)
+            return false;
+
+        if (m_socket->bytesAvailable() == 0 && !m_socket->waitForReadyRead(RTMP_IO_TIMEOUT_MS))
+        {
+            if (m_socket->state() != QAbstractSocket::ConnectedState)
+                return false;
+            if (idle.elapsed() > RTMP_CONNECT_TIMEOUT_MS)
+                return false;
+            continue;
+        }
+
+        qint64 n = m_socket->read(data + total, size - total);
+        if (n < 0)
+            return false;
+
+        total += int(n);
+        m_bytesReceived += quint64(n);
+        idle.restart();
+    }
+    return true;
+}
+
+bool rtmp_connection::write_all(const QByteArray &data)
+{
+    if (m_socket->write(data) != data.size())
+        return false;
+
+    while (m_socket->bytesToWrite() > 0)
+    {
+        if (m_stop || m_socket->state() != QAbstractSocket::ConnectedState)
+            return false;
+        m_socket->waitForBytesWritten(RTMP_IO_TIMEOUT_MS);
+    }
+    return true;
+}
+
+bool rtmp_connection::handshake()
+{
+    QByteArray c0c1(1 + RTMP_HANDSHAKE_SIZE, Qt::Uninitialized);
+    if (!read_exact(c0c1.data(), c0c1.size()))
+        return false;
+
+    if (c0c1[0] != 3)
+    {
+        emit sendInfo("Unsupported RTMP version " + QString::number(int(c0c1[0])));
+        return false;
+    }
+
+    // Plain handshake: zero version field in S1 tells clients to skip digest checks.
+    QByteArray s0s1s2;
+    s0s1s2.reserve(1 + 2 * RTMP_HANDSHAKE_SIZE);
+    s0s1s2.append(char(3));
+    QByteArray s1(RTMP_HANDSHAKE_SIZE, 0);
+    for (int i = 8; i < RTMP_HANDSHAKE_SIZE; i++)
+        s1[i] = char(QRandomGenerator::global()->bounded(256));
+    s0s1s2.append(s1);
+    s0s1s2.append(c0c1.constData() + 1, RTMP_HANDSHAKE_SIZE);
+    if (!write_all(s0s1s2))
+        return false;
+
+    QByteArray c2(RTMP_HANDSHAKE_SIZE, Qt::Uninitialized);
+    return read_exact(c2.data(), c2.size());
+}
+
+bool rtmp_connection::read_chunk()
+{
+    uchar hdr[11];
+
+    if (!read_exact(reinterpret_cast<char*>(hdr), 1))
+        return false;
+
+    int fmt = hdr[0] >> 6;
+    quint32 csid = hdr[0] & 0x3f;
+    if (csid == 0)
+    {
+        if (!read_exact(reinterpret_cast<char*>(hdr), 1))
+            return false;
+        csid = 64 + hdr[0];
+    }
+    else if (csid == 1)
+    {
+        if (!read_exact(reinterpret_cast<char*>(hdr), 2))
+            return false;
+        csid = 64 + hdr[0] + hdr[1] * 256;
+    }
+
+    chunk_stream &cs = m_chunkStreams[csid];
+    static const int headerSize[4] = { 11, 7, 3, 0 };
+    if (headerSize[fmt] > 0 && !read_exact(reinterpret_cast<char*>(hdr), headerSize[fmt]))
+        return false;
+
+    bool newMessage = cs.payload.isEmpty();
+    quint32 field = cs.timestampField;
+    if (fmt <= 2)
+    {
+        field = get_be24(hdr);
+        cs.extended = (field == 0xFFFFFF);
+    }
+    if (fmt <= 1)
+    {
+        cs.length = get_be24(hdr + 3);
+        cs.typeId = hdr[6];
+        if (cs.length > RTMP_MAX_MESSAGE_SIZE)
+            return false;
+    }
+    if (fmt == 0)
+        cs.streamId = qFromLittleEndian<quint32>(hdr + 7);
+    if (cs.extended)
+    {
+        uchar ext[4];
+        if (!read_exact(reinterpret_cast<char*>(ext), 4))
+            return false;
+        if (fmt <= 2)
+            field = qFromBigEndian<quint32>(ext);
+    }
+
+    if (fmt == 0)
+        cs.timestamp = field;
+    else if (fmt <= 2 || newMessage)
+        cs.timestamp += field;
+    cs.timestampField = field;
+
+    int remaining = int(cs.length) - cs.payload.size();
+    int chunk = qMin(remaining, m_inChunkSize);
+    if (chunk > 0)
+    {
+        int offset = cs.payload.size();
+        cs.payload.resize(offset + chunk);
+        if (!read_exact(cs.payload.data() + offset, chunk))
+            return false;
+    }
+
+    if (!send_ack_if_needed())
+        return false;
+
+    if (cs.payload.size() < int(cs.length))
+        return true;
+
+    bool ok = handle_message(cs);
+    cs.payload.clear();
+    return ok;
+}
+
+bool rtmp_connection::handle_message(const chunk_stream &cs)
+{
+    const QByteArray &payload = cs.payload;
+
+    switch (cs.typeId)
+    {
+    case RTMP_MSG_SET_CHUNK_SIZE:
+        if (payload.size() >= 4)
+            m_inChunkSize = qBound(1, int(qFromBigEndian<quint32>(payload.constData()) & 0x7fffffff), RTMP_MAX_MESSAGE_SIZE);
+        return true;
+    case RTMP_MSG_WINDOW_ACK_SIZE:
+        if (payload.size() >= 4)
+            m_ackWindow = qFromBigEndian<quint32>(payload.constData());
+        return true;
+    case RTMP_MSG_USER_CONTROL:
+        return handle_user_control(payload);
+    case RTMP_MSG_AUDIO:
+        return !m_publishing || write_flv_tag(FLV_TAG_AUDIO, cs.timestamp, payload);
+    case RTMP_MSG_VIDEO:
+        return !m_publishing || write_flv_tag(FLV_TAG_VIDEO, cs.timestamp, payload);
+    case RTMP_MSG_DATA_AMF0:
+    case RTMP_MSG_DATA_AMF3:
+    {
+        if (!m_publishing)
+            return true;
+        // @setDataFrame wrapper is an RTMP artefact, FLV script tags start at onMetaData
+        int pos = (cs.typeId == RTMP_MSG_DATA_AMF3) ? 1 : 0;
+        int start = pos;
+        QVariant name;
+        if (amf0_read_value(payload, pos, name) && name.toString() == "@setDataFrame")
+            start = pos;
+        return write_flv_tag(FLV_TAG_SCRIPT, cs.timestamp, payload.mid(start));
+    }
+    case RTMP_MSG_COMMAND_AMF3:
+        return handle_command(payload.mid(1), cs.streamId);
+    case RTMP_MSG_COMMAND_AMF0:
+        return handle_command(payload, cs.streamId);
+    default:
+        return true;
+    }
+}
+
+bool rtmp_connection::handle_user_control(const QByteArray &payload)
+{
+    if (payload.size() < 6)
+        return true;
+
+    // Ping request -> ping response with the same timestamp
+    if (qFromBigEndian<quint16>(payload.constData()) == 6)
+    {
+        QByteArray reply;
+        put_be16(reply, 7);
+        reply.append(payload.constData() + 2, 4);
+        return send_message(RTMP_CSID_CONTROL, RTMP_MSG_USER_CONTROL, 0, reply);
+    }
+    return true;
+}
+
+bool rtmp_connection::handle_command(const QByteArray &payload, quint32 streamId)
+{
+    QVariantList args;
+    int pos = 0;
+    while (pos < payload.size())
+    {
+        QVariant v;
+        if (!amf0_read_value(payload, pos, v))
+            break;
+        args.append(v);
+    }
+
+    QString command = args.value(0).toString();
+    double txn = args.value(1).toDouble();
+
+    if (command == "connect")
+    {
+        QVariantMap obj = args.value(2).toMap();
+        m_app = obj.value("app").toString();
+
+        if (!send_control(RTMP_MSG_WINDOW_ACK_SIZE, RTMP_WINDOW_ACK_SIZE) ||
+            !send_control(RTMP_MSG_SET_PEER_BW, RTMP_WINDOW_ACK_SIZE, 2) ||
+            !send_control(RTMP_MSG_SET_CHUNK_SIZE, RTMP_OUT_CHUNK_SIZE))
+            return false;
+
+        QByteArray reply;
+        amf0_write_string(reply, "_result");
+        amf0_write_number(reply, txn);
+        amf0_write_object(reply, { { "fmsVer", QString("FMS/3,0,1,123") },
+                                   { "capabilities", 31.0 } });
+        amf0_write_object(reply, { { "level", QString("status") },
+                                   { "code", QString("NetConnection.Connect.Success") },
+                                   { "description", QString("Connection succeeded.") },
+                                   { "objectEncoding", obj.value("objectEncoding", 0.0).toDouble() } });
+        return send_message(RTMP_CSID_COMMAND, RTMP_MSG_COMMAND_AMF0, 0, reply);
+    }
+    else if (command == "createStream")
+    {
+        QByteArray reply;
+        amf0_write_string(reply, "_result");
+        amf0_write_number(reply, txn);
+        amf0_write_null(reply);
+        amf0_write_number(reply, RTMP_PUBLISH_STREAM_ID);
+        return send_message(RTMP_CSID_COMMAND, RTMP_MSG_COMMAND_AMF0, 0, reply);
+    }
+    else if (command == "releaseStream" || command == "FCPublish")
+    {
+        QByteArray reply;
+        amf0_write_string(reply, "_result");
+        amf0_write_number(reply, txn);
+        amf0_write_null(reply);
+        reply.append(char(AMF0_UNDEFINED));
+        return send_message(RTMP_CSID_COMMAND, RTMP_MSG_COMMAND_AMF0, 0, reply);
+    }
+    else if (command == "publish")
+    {
+        // publish(txn, null, name, type); the name may carry "?query" auth tokens
+        QString key = args.value(3).toString().section('?', 0, 0);
+        bool accepted = !m_publishing && !key.isEmpty() && m_server->claimStreamKey(key);
+
+        QByteArray reply;
+        amf0_write_string(reply, "onStatus");
+        amf0_write_number(reply, 0);
+        amf0_write_null(reply);
+        if (accepted)
+        {
+            amf0_write_object(reply, { { "level", QString("status") },
+                                       { "code", QString("NetStream.Publish.Start") },
+                                       { "description", key + " is now published." } });
+        }
+        else
+        {
+            amf0_write_object(reply, { { "level", QString("error") },
+                                       { "code", QString("NetStream.Publish.BadName") },
+                                       { "description", "Stream key " + key + " is already in use." } });
+        }
+
+        if (!accepted)
+        {
+            send_message(RTMP_CSID_STATUS, RTMP_MSG_COMMAND_AMF0, streamId, reply);
+            emit sendInfo("Rejected publisher for stream key '" + key + "'");
+            return false;
+        }
+
+        m_streamKey = key;
+        m_publishing = write_flv_header();
+        emit published(key);
+
+        return m_publishing && send_message(RTMP_CSID_STATUS, RTMP_MSG_COMMAND_AMF0, streamId, reply);
+    }
+    else if (command == "FCUnpublish" || command == "deleteStream" || command == "closeStream")
+    {
+        // Publisher is done, end of stream for the session
+        return !m_publishing;
+    }
+
+    return true;
+}
+
+bool rtmp_connection::send_message(int csid, quint8 typeId, quint32 streamId, const QByteArray &payload)
+{
+    QByteArray out;
+    out.reserve(12 + payload.size() + payload.size() / m_outChunkSize + 1);
+
+    out.append(char(csid & 0x3f)); // fmt 0
+    put_be24(out, 0);
+    put_be24(out, quint32(payload.size()));
+    out.append(char(typeId));
+    put_le32(out, streamId);
+
+    for (int pos = 0; pos < payload.size(); pos += m_outChunkSize)
+    {
+        if (pos > 0)
+            out.append(char(0xC0 | (csid & 0x3f))); // fmt 3 continuation
+        out.append(payload.constData() + pos, qMin(m_outChunkSize, payload.size() - pos));
+    }
+
+    return write_all(out);
+}
+
+bool rtmp_connection::send_control(quint8 typeId, quint32 value, int extra)
+{
+    QByteArray payload;
+    put_be32(payload, value);
+    if (extra >= 0)
+        payload.append(char(extra));
+
+    if (!send_message(RTMP_CSID_CONTROL, typeId, 0, payload))
+        return false;
+
+    if (typeId == RTMP_MSG_SET_CHUNK_SIZE)
+        m_outChunkSize = int(value);
+    return true;
+}
+
+bool rtmp_connection::send_ack_if_needed()
+{
+    if (m_ackWindow == 0 || m_bytesReceived - m_lastAck < m_ackWindow)
+        return true;
+
+    m_lastAck = m_bytesReceived;
+    return send_control(RTMP_MSG_ACK, quint32(m_bytesReceived));
+}
+
+bool rtmp_connection::write_flv_header()
+{
+    static const char header[] = { 'F', 'L', 'V', 0x01, 0x05, 0x00, 0x00, 0x00, 0x09,
+                                   0x00, 0x00, 0x00, 0x00 };
+    return m_pipe->write(header, sizeof(header));
+}
+
+bool rtmp_connection::write_flv_tag(quint8 tagType, quint32 timestamp, const QByteArray &data)
+{
+    QByteArray tag;
+    tag.reserve(11 + data.size() + 4);
+    tag.append(char(tagType));
+    put_be24(tag, quint32(data.size()));
+    put_be24(tag, timestamp & 0xFFFFFF);
+    tag.append(char(timestamp >> 24));
+    put_be24(tag, 0);
+    tag.append(data);
+    put_be32(tag, quint32(11 + data.size()));
+
+    return m_pipe->write(tag.constData(), tag.size());
+}
+
+void rtmp_connection::run()
+{
+    QTcpSocket socket;
+    if (!socket.setSocketDescriptor(m_socketDescriptor))
+        return;
+
+    m_socket = &socket;
+    QString peer = socket.peerAddress().toString();
+
+    if (handshake())
+    {
+        emit sendInfo("Rtmp publisher connected: " + peer);
+        while (!m_stop && read_chunk())
+            ;
+    }
+
+    m_pipe->close();
+
+    socket.disconnectFromHost();
+    if (socket.state() != QAbstractSocket::UnconnectedState)
+        socket.waitForDisconnected(RTMP_IO_TIMEOUT_MS);
+    m_socket = nullptr;
+
+    emit sendInfo("Rtmp publisher disconnected: " + peer);
+}
+
+rtmp_server::rtmp_server(QObject *parent)
+    : QTcpServer{parent}
+{
+    m_outputDir = QStandardPaths::writableLocation(QStandardPaths::DesktopLocation);
+
+    m_infoTimer.setInterval(RTMP_INFO_POLL_MS);
+    connect(&m_infoTimer, &QTimer::timeout, this, [this]() {
+        for (auto it = m_sessions.cbegin(); it != m_sessions.cend(); ++it)
+            drainInfo(it.key(), it.value());
+    });
+}
+
+void rtmp_server::drainInfo(const QString &key, ffmpeg_rtmp *session)
+{
+    const QStringList messages = session->infoMailbox().takeAll();
+    for (const QString &info : messages)
+        emit sendInfo("[" + key + "] " + info);
+}
+
+rtmp_server::~rtmp_server()
+{
+    stop();
+}
+
+bool rtmp_server::start(quint16 port)
+{
+    if (isListening())
+        return true;
+
+    if (!listen(QHostAddress::Any, port))
+    {
+        emit sendInfo("Rtmp server can not listen on port " + QString::number(port) + ": " + errorString());
+        return false;
+    }
+
+    m_infoTimer.start();
+    emit sendInfo("Rtmp stream server is listening.");
+    return true;
+}
+
+void rtmp_server::stop()
+{
+    close();
+    m_infoTimer.stop();
+
+    for (auto *connection : std::as_const(m_connections))
+        connection->stop();
+    for (auto *session : std::as_const(m_sessions))
+        session->stop();
+
+    // Pending queued notifications find empty containers and bail out.
+    for (auto *connection : std::as_const(m_connections))
+        delete connection;
+    m_connections.clear();
+
+    // Taken out first, listeners looking for another live session must not
+    // find one that is about to be deleted
+    const QHash<QString, ffmpeg_rtmp*> sessions = std::exchange(m_sessions, {});
+    for (auto it = sessions.cbegin(); it != sessions.cend(); ++it)
+    {
+        it.value()->wait();
+        drainInfo(it.key(), it.value());
+        // Listeners drop their pointer to the session before it goes away
+        emit sessionFinished(it.key());
+        delete it.value();
+    }
+
+    QMutexLocker locker(&m_keyMutex);
+    m_claimedKeys.clear();
+}
+
+void rtmp_server::setUrl()
+{
+    bool found = false;
+    quint16 port = isListening() ? serverPort() : RTMP_DEFAULT_PORT;
+    foreach(QNetworkInterface interface, QNetworkInterface::allInterfaces())
+    {
+        if (interface.flags().testFlag(QNetworkInterface::IsUp) && !interface.flags().testFlag(QNetworkInterface::IsLoopBack))
+            foreach (QNetworkAddressEntry entry, interface.addressEntries())
+            {
+                if ( !found && interface.hardwareAddress() != "00:00:00:00:00:00" && entry.ip().toString().contains(".")
+                     && !interface.humanReadableName().contains("VM") && !interface.hardwareAddress().startsWith("00:") && interface.hardwareAddress() != "")
+                {
+                    QString url = "rtmp://" + entry.ip().toString() + ":" + QString::number(port) + "/" RTMP_DEFAULT_APP "/<stream key>";
+                    qDebug() << url;
+                    emit sendUrl(url);
+                    found = true;
+                }
+            }
+    }
+}
+
+QStringList rtmp_server::streamKeys() const
+{
+    return m_sessions.keys();
+}
+
+ffmpeg_rtmp *rtmp_server::session(const QString &key) const
+{
+    return m_sessions.value(key, nullptr);
+}
+
+bool rtmp_server::claimStreamKey(const QString &key)
+{
+    QMutexLocker locker(&m_keyMutex);
+    if (m_claimedKeys.contains(key))
+        return false;
+    m_claimedKeys.insert(key);
+    return true;
+}
+
+void rtmp_server::releaseStreamKey(const QString &key)
+{
+    QMutexLocker locker(&m_keyMutex);
+    m_claimedKeys.remove(key);
+}
+
+void rtmp_server::incomingConnection(qintptr socketDescriptor)
+{
+    auto *connection = new rtmp_connection(socketDescriptor, this);
+    m_connections.insert(connection);
+
+    connect(connection, &rtmp_connection::sendInfo, this, &rtmp_server::sendInfo);
+    connect(connection, &rtmp_connection::published, this, [this, connection](QString key) {
+        if (m_connections.contains(connection))
+            onPublished(connection, key);
+    });
+    connect(connection, &QThread::finished, this, [this, connection]() {
+        if (m_connections.remove(connection))
+            connection->deleteLater();
+    });
+
+    connection->start();
+}
+
+void rtmp_server::onPublished(rtmp_connection *connection, const QString &key)
+{
+    auto *session = new ffmpeg_rtmp();
+    session->setInput(key, connection->pipe(), m_outputDir);
+    m_sessions.insert(key, session);
+
+    connect(session, &QThread::finished, this, [this, key, session]() {
+        if (m_sessions.value(key) != session)
+            return;
+        drainInfo(key, session);
+        m_sessions.remove(key);
+        releaseStreamKey(key);
+        emit sessionFinished(key);
+        session->deleteLater();
+    });
+
+    emit sessionCreated(key, session);
+    session->start();
+}
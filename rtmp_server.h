@@ -0,0 +1,140 @@
+#ifndef RTMP_SERVER_H
+#define RTMP_SERVER_H
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+#include <QMutex>
+#include <QHash>
+#include <QSet>
+#include <QVariant>
+#include <QTimer>
+#include <atomic>
+#include <memory>
+
+#include "flv_pipe.h"
+#include "ffmpeg_rtmp.h"
+
+#define RTMP_DEFAULT_PORT       8889
+#define RTMP_DEFAULT_APP        "live"
+#define RTMP_HANDSHAKE_SIZE     1536
+#define RTMP_DEFAULT_CHUNK_SIZE 128
+#define RTMP_OUT_CHUNK_SIZE     4096
+#define RTMP_WINDOW_ACK_SIZE    2500000
+#define RTMP_IO_TIMEOUT_MS      100
+#define RTMP_CONNECT_TIMEOUT_MS 30000
+#define RTMP_INFO_POLL_MS       100
+
+class rtmp_server;
+
+// One publisher connection. Speaks just enough of the RTMP server side
+// (handshake, connect/createStream/publish) to learn the stream key, then
+// rewraps the audio/video/data messages as an FLV byte stream into a
+// flv_pipe that the session's demuxer reads from.
+class rtmp_connection : public QThread
+{
+    Q_OBJECT
+public:
+    rtmp_connection(qintptr socketDescriptor, rtmp_server *server);
+    ~rtmp_connection();
+
+    void stop();
+    QString streamKey() const { return m_streamKey; }
+    std::shared_ptr<flv_pipe> pipe() const { return m_pipe; }
+
+protected:
+    void run() override;
+
+private:
+    struct chunk_stream
+    {
+        quint32 timestamp {0};
+        quint32 timestampField {0};
+        quint32 length {0};
+        quint8  typeId {0};
+        quint32 streamId {0};
+        bool    extended {false};
+        QByteArray payload;
+    };
+
+    bool read_exact(char *data, int size);
+    bool write_all(const QByteArray &data);
+    bool handshake();
+    bool read_chunk();
+    bool handle_message(const chunk_stream &cs);
+    bool handle_command(const QByteArray &payload, quint32 streamId);
+    bool handle_user_control(const QByteArray &payload);
+
+    bool send_message(int csid, quint8 typeId, quint32 streamId, const QByteArray &payload);
+    bool send_control(quint8 typeId, quint32 value, int extra = -1);
+    bool send_ack_if_needed();
+
+    bool write_flv_header();
+    bool write_flv_tag(quint8 tagType, quint32 timestamp, const QByteArray &data);
+
+    qintptr m_socketDescriptor;
+    rtmp_server *m_server;
+    QTcpSocket *m_socket {nullptr};
+    std::atomic<bool> m_stop {false};
+
+    QHash<quint32, chunk_stream> m_chunkStreams;
+    int m_inChunkSize {RTMP_DEFAULT_CHUNK_SIZE};
+    int m_outChunkSize {RTMP_DEFAULT_CHUNK_SIZE};
+    quint64 m_bytesReceived {0};
+    quint64 m_lastAck {0};
+    quint32 m_ackWindow {RTMP_WINDOW_ACK_SIZE};
+
+    QString m_app;
+    QString m_streamKey;
+    bool m_publishing {false};
+    const std::shared_ptr<flv_pipe> m_pipe;     // made up front, stop() closes it from other threads
+
+signals:
+    void sendInfo(QString);
+    void published(QString);
+};
+
+// Single RTMP listener shared by every publisher. Each stream key gets its
+// own rtmp_connection and ffmpeg_rtmp session, so dozens of cameras can
+// publish to one port of one process.
+class rtmp_server : public QTcpServer
+{
+    Q_OBJECT
+public:
+    explicit rtmp_server(QObject *parent = nullptr);
+    ~rtmp_server();
+
+    bool start(quint16 port = RTMP_DEFAULT_PORT);
+    void stop();
+    void setUrl();
+    void setOutputDirectory(const QString &dir) { m_outputDir = dir; }
+
+    QStringList streamKeys() const;
+    ffmpeg_rtmp *session(const QString &key) const;
+
+    // Called from connection threads.
+    bool claimStreamKey(const QString &key);
+    void releaseStreamKey(const QString &key);
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
+
+private:
+    void onPublished(rtmp_connection *connection, const QString &key);
+    void drainInfo(const QString &key, ffmpeg_rtmp *session);
+
+    mutable QMutex m_keyMutex;
+    QSet<QString> m_claimedKeys;
+    QHash<QString, ffmpeg_rtmp*> m_sessions;
+    QSet<rtmp_connection*> m_connections;
+    QString m_outputDir;
+    QTimer m_infoTimer;
+
+signals:
+    void sendInfo(QString);
+    void sendUrl(QString);
+    void sessionCreated(QString, ffmpeg_rtmp*);
+    void sessionFinished(QString);
+};
+
+#endif // RTMP_SERVER_H
@@ -0,0 +1,34 @@
+#ifndef SPECTRUM_FRAME_H
+#define SPECTRUM_FRAME_H
+
+#include <cstdint>
+#include <vector>
+
+#include "triple_buffer.h"
+
+// One-sided spectrum in dBFS, bin i is centred on i * sampleRate / fftSize
+// for i in [0, fftSize / 2). A full scale sine reads 0 dB in its bin.
+// A new frame is produced every hop samples.
+//
+// A zoomed frame instead has fftSize bins evenly covering
+// [bandStart, bandStart + bandWidth), the band around the zoom center.
+struct spectrum_frame
+{
+    std::vector<float> peak;        // fast attack, slow decay
+    std::vector<float> average;     // IIR smoothed peak
+    std::vector<float> waterfall;   // peak, max-held over frames the consumer missed
+    int fftSize {0};
+    int hop {0};
+    int sampleRate {0};             // 0 if unknown, e.g. data pushed into the plotter
+    double bandStart {0};           // Hz, zoomed frames only
+    double bandWidth {0};           // Hz, 0 for the full one-sided band
+    int64_t timestamp {0};          // ms since epoch when it was computed
+    uint64_t sequence {0};          // counts every computed frame
+
+    int bins() const { return (int)average.size(); }
+};
+
+// Analyzer to display hand-off, the display always reads a whole frame
+using spectrum_exchange = triple_buffer<spectrum_frame>;
+
+#endif // SPECTRUM_FRAME_H
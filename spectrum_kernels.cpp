@@ -0,0 +1,527 @@
+#include "spectrum_kernels.h"
+
+#include <QElapsedTimer>
+#include <QtAlgorithms>
+#include <QtGlobal>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SPECTRUM_KERNELS_X86 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define SPECTRUM_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SPECTRUM_TARGET_AVX2
+#endif
+#endif
+
+#define PEAK_DECAY 0.2f
+
+/* Scalar reference */
+
+static void power_c(const float *complex, float scale, float *row, float *sum, int bins)
+{
+    for (int i = 0; i < bins; i++)
+    {
+        float re = complex[2 * i];
+        float im = complex[2 * i + 1];
+        float pwr = (re * re + im * im) * scale;
+        sum[i] += pwr - row[i];
+        row[i] = pwr;
+    }
+}
+
+static void to_db_c(const float *power, float norm, float *db, int bins)
+{
+    for (int i = 0; i < bins; i++)
+        db[i] = 10.0f * log10f(std::max(0.0f, power[i] * norm) + SPECTRUM_POWER_FLOOR);
+}
+
+static void smooth_c(const float *db, float *peak, float *average, int bins, float alpha)
+{
+    for (int i = 0; i < bins; i++)
+    {
+        if (peak[i] < db[i])
+            peak[i] = db[i];
+        else
+            peak[i] -= (peak[i] - db[i]) * PEAK_DECAY;
+        average[i] += alpha * (peak[i] - average[i]);
+    }
+}
+
+static void range_max_c(const float *in, const int *edges, int count, float *out)
+{
+    for (int k = 0; k < count; k++)
+    {
+        float m = -HUGE_VALF;
+        for (int i = edges[k]; i < edges[k + 1]; i++)
+            m = std::max(m, in[i]);
+        out[k] = m;
+    }
+}
+
+static void moments_c(const int *values, int count, double *sum, double *sumSq)
+{
+    double s = 0;
+    double s2 = 0;
+    for (int i = 0; i < count; i++)
+    {
+        s += values[i];
+        s2 += (double)values[i] * values[i];
+    }
+    *sum = s;
+    *sumSq = s2;
+}
+
+static int below_c(const int *values, int count, int threshold, int *indices)
+{
+    int found = 0;
+    for (int i = 0; i < count; i++)
+        if (values[i] < threshold)
+            indices[found++] = i;
+    return found;
+}
+
+#ifdef SPECTRUM_KERNELS_X86
+
+/*
+ * 10 * log10(x) for normal positive x. With x = m * 2^e and m moved into
+ * [sqrt(1/2), sqrt(2)), log(m) = 2 * atanh(z) with z = (m - 1) / (m + 1),
+ * |z| < 0.172. Four terms of the atanh series leave a truncation error
+ * below 1e-6 dB, float rounding dominates.
+ */
+#define DB_PER_OCTAVE   3.0102999566f       // 10 * log10(2)
+#define DB_ATANH_1      8.6858896381f       // 20 / ln(10)
+#define DB_ATANH_3      (DB_ATANH_1 / 3.0f)
+#define DB_ATANH_5      (DB_ATANH_1 / 5.0f)
+#define DB_ATANH_7      (DB_ATANH_1 / 7.0f)
+
+static inline __m128 db_sse2(__m128 x)
+{
+    const __m128i bits = _mm_castps_si128(x);
+    __m128i e = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)),
+                                             _mm_set1_epi32(0x3f800000)));
+
+    // m in [1, 2), halve the upper part and count it as one more octave
+    __m128 big = _mm_cmpgt_ps(m, _mm_set1_ps(1.41421356f));
+    m = _mm_sub_ps(m, _mm_and_ps(big, _mm_mul_ps(m, _mm_set1_ps(0.5f))));
+    e = _mm_sub_epi32(e, _mm_castps_si128(big));        // mask is -1
+
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 z = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+    __m128 z2 = _mm_mul_ps(z, z);
+    __m128 p = _mm_add_ps(_mm_set1_ps(DB_ATANH_5), _mm_mul_ps(z2, _mm_set1_ps(DB_ATANH_7)));
+    p = _mm_add_ps(_mm_set1_ps(DB_ATANH_3), _mm_mul_ps(z2, p));
+    p = _mm_add_ps(_mm_set1_ps(DB_ATANH_1), _mm_mul_ps(z2, p));
+
+    return _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(e), _mm_set1_ps(DB_PER_OCTAVE)), _mm_mul_ps(z, p));
+}
+
+static void power_sse2(const float *complex, float scale, float *row, float *sum, int bins)
+{
+    const __m128 s = _mm_set1_ps(scale);
+
+    int i = 0;
+    for (; i + 4 <= bins; i += 4)
+    {
+        __m128 a = _mm_loadu_ps(complex + 2 * i);
+        __m128 b = _mm_loadu_ps(complex + 2 * i + 4);
+        a = _mm_mul_ps(a, a);
+        b = _mm_mul_ps(b, b);
+        __m128 re = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 im = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 pwr = _mm_mul_ps(_mm_add_ps(re, im), s);
+
+        __m128 old = _mm_loadu_ps(row + i);
+        _mm_storeu_ps(sum + i, _mm_add_ps(_mm_loadu_ps(sum + i), _mm_sub_ps(pwr, old)));
+        _mm_storeu_ps(row + i, pwr);
+    }
+
+    power_c(complex + 2 * i, scale, row + i, sum + i, bins - i);
+}
+
+static void to_db_sse2(const float *power, float norm, float *db, int bins)
+{
+    const __m128 n = _mm_set1_ps(norm);
+    const __m128 floor = _mm_set1_ps(SPECTRUM_POWER_FLOOR);
+
+    int i = 0;
+    for (; i + 4 <= bins; i += 4)
+    {
+        __m128 x = _mm_max_ps(_mm_mul_ps(_mm_loadu_ps(power + i), n), _mm_setzero_ps());
+        _mm_storeu_ps(db + i, db_sse2(_mm_add_ps(x, floor)));
+    }
+
+    to_db_c(power + i, norm, db + i, bins - i);
+}
+
+static void smooth_sse2(const float *db, float *peak, float *average, int bins, float alpha)
+{
+    const __m128 a = _mm_set1_ps(alpha);
+    const __m128 decay = _mm_set1_ps(PEAK_DECAY);
+
+    int i = 0;
+    for (; i + 4 <= bins; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(db + i);
+        __m128 p = _mm_loadu_ps(peak + i);
+        __m128 decayed = _mm_sub_ps(p, _mm_mul_ps(_mm_sub_ps(p, x), decay));
+        __m128 rise = _mm_cmplt_ps(p, x);
+        p = _mm_or_ps(_mm_and_ps(rise, x), _mm_andnot_ps(rise, decayed));
+        _mm_storeu_ps(peak + i, p);
+
+        __m128 avg = _mm_loadu_ps(average + i);
+        _mm_storeu_ps(average + i, _mm_add_ps(avg, _mm_mul_ps(a, _mm_sub_ps(p, avg))));
+    }
+
+    smooth_c(db + i, peak + i, average + i, bins - i, alpha);
+}
+
+static inline float hmax_sse2(__m128 v)
+{
+    v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(v);
+}
+
+static void range_max_sse2(const float *in, const int *edges, int count, float *out)
+{
+    for (int k = 0; k < count; k++)
+    {
+        int i = edges[k];
+        const int end = edges[k + 1];
+        float m = -HUGE_VALF;
+
+        if (end - i >= 4)
+        {
+            __m128 v = _mm_loadu_ps(in + i);
+            for (i += 4; i + 4 <= end; i += 4)
+                v = _mm_max_ps(v, _mm_loadu_ps(in + i));
+            m = hmax_sse2(v);
+        }
+        for (; i < end; i++)
+            m = std::max(m, in[i]);
+        out[k] = m;
+    }
+}
+
+// Doubles keep the squares of pixel rows exact, two lanes of each half
+static void moments_sse2(const int *values, int count, double *sum, double *sumSq)
+{
+    __m128d s = _mm_setzero_pd();
+    __m128d s2 = _mm_setzero_pd();
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(values + i));
+        __m128d lo = _mm_cvtepi32_pd(v);
+        __m128d hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        s = _mm_add_pd(s, _mm_add_pd(lo, hi));
+        s2 = _mm_add_pd(s2, _mm_add_pd(_mm_mul_pd(lo, lo), _mm_mul_pd(hi, hi)));
+    }
+
+    double tail;
+    double tailSq;
+    moments_c(values + i, count - i, &tail, &tailSq);
+    *sum = _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s))) + tail;
+    *sumSq = _mm_cvtsd_f64(_mm_add_sd(s2, _mm_unpackhi_pd(s2, s2))) + tailSq;
+}
+
+// Compares four at a time and walks the set bits of the mask, most pixels are skipped whole
+static int below_sse2(const int *values, int count, int threshold, int *indices)
+{
+    const __m128i t = _mm_set1_epi32(threshold);
+    int found = 0;
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(values + i));
+        unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(v, t)));
+        while (mask)
+        {
+            indices[found++] = i + qCountTrailingZeroBits(mask);
+            mask &= mask - 1;
+        }
+    }
+
+    for (; i < count; i++)
+        if (values[i] < threshold)
+            indices[found++] = i;
+    return found;
+}
+
+SPECTRUM_TARGET_AVX2
+static void moments_avx2(const int *values, int count, double *sum, double *sumSq)
+{
+    __m256d s = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd();
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256d lo = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i *>(values + i)));
+        __m256d hi = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i *>(values + i + 4)));
+        s = _mm256_add_pd(s, _mm256_add_pd(lo, hi));
+        s2 = _mm256_add_pd(s2, _mm256_add_pd(_mm256_mul_pd(lo, lo), _mm256_mul_pd(hi, hi)));
+    }
+
+    double tail;
+    double tailSq;
+    moments_sse2(values + i, count - i, &tail, &tailSq);
+
+    __m128d h = _mm_add_pd(_mm256_castpd256_pd128(s), _mm256_extractf128_pd(s, 1));
+    __m128d h2 = _mm_add_pd(_mm256_castpd256_pd128(s2), _mm256_extractf128_pd(s2, 1));
+    *sum = _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h))) + tail;
+    *sumSq = _mm_cvtsd_f64(_mm_add_sd(h2, _mm_unpackhi_pd(h2, h2))) + tailSq;
+}
+
+SPECTRUM_TARGET_AVX2
+static int below_avx2(const int *values, int count, int threshold, int *indices)
+{
+    const __m256i t = _mm256_set1_epi32(threshold);
+    int found = 0;
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(values + i));
+        unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(t, v)));
+        while (mask)
+        {
+            indices[found++] = i + qCountTrailingZeroBits(mask);
+            mask &= mask - 1;
+        }
+    }
+
+    const int tail = below_sse2(values + i, count - i, threshold, indices + found);
+    for (int k = found; k < found + tail; k++)
+        indices[k] += i;
+    return found + tail;
+}
+
+SPECTRUM_TARGET_AVX2
+static void range_max_avx2(const float *in, const int *edges, int count, float *out)
+{
+    for (int k = 0; k < count; k++)
+    {
+        int i = edges[k];
+        const int end = edges[k + 1];
+        float m = -HUGE_VALF;
+
+        if (end - i >= 8)
+        {
+            __m256 v = _mm256_loadu_ps(in + i);
+            for (i += 8; i + 8 <= end; i += 8)
+                v = _mm256_max_ps(v, _mm256_loadu_ps(in + i));
+            m = hmax_sse2(_mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+        }
+        if (end - i >= 4)
+        {
+            m = std::max(m, hmax_sse2(_mm_loadu_ps(in + i)));
+            i += 4;
+        }
+        for (; i < end; i++)
+            m = std::max(m, in[i]);
+        out[k] = m;
+    }
+}
+
+SPECTRUM_TARGET_AVX2
+static inline __m256 db_avx2(__m256 x)
+{
+    const __m256i bits = _mm256_castps_si256(x);
+    __m256i e = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127));
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+                                                   _mm256_set1_epi32(0x3f800000)));
+
+    __m256 big = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356f), _CMP_GT_OQ);
+    m = _mm256_sub_ps(m, _mm256_and_ps(big, _mm256_mul_ps(m, _mm256_set1_ps(0.5f))));
+    e = _mm256_sub_epi32(e, _mm256_castps_si256(big));
+
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 z = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+    __m256 z2 = _mm256_mul_ps(z, z);
+    __m256 p = _mm256_add_ps(_mm256_set1_ps(DB_ATANH_5), _mm256_mul_ps(z2, _mm256_set1_ps(DB_ATANH_7)));
+    p = _mm256_add_ps(_mm256_set1_ps(DB_ATANH_3), _mm256_mul_ps(z2, p));
+    p = _mm256_add_ps(_mm256_set1_ps(DB_ATANH_1), _mm256_mul_ps(z2, p));
+
+    return _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(e), _mm256_set1_ps(DB_PER_OCTAVE)),
+                         _mm256_mul_ps(z, p));
+}
+
+SPECTRUM_TARGET_AVX2
+static void power_avx2(const float *complex, float scale, float *row, float *sum, int bins)
+{
+    const __m256 s = _mm256_set1_ps(scale);
+
+    int i = 0;
+    for (; i + 8 <= bins; i += 8)
+    {
+        __m256 a = _mm256_loadu_ps(complex + 2 * i);
+        __m256 b = _mm256_loadu_ps(complex + 2 * i + 8);
+        a = _mm256_mul_ps(a, a);
+        b = _mm256_mul_ps(b, b);
+        // Shuffles stay within 128 bit lanes, bins come out as 0 1 4 5 | 2 3 6 7
+        __m256 re = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 im = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m256 pwr = _mm256_mul_ps(_mm256_add_ps(re, im), s);
+        pwr = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(pwr), _MM_SHUFFLE(3, 1, 2, 0)));
+
+        __m256 old = _mm256_loadu_ps(row + i);
+        _mm256_storeu_ps(sum + i, _mm256_add_ps(_mm256_loadu_ps(sum + i), _mm256_sub_ps(pwr, old)));
+        _mm256_storeu_ps(row + i, pwr);
+    }
+
+    power_sse2(complex + 2 * i, scale, row + i, sum + i, bins - i);
+}
+
+SPECTRUM_TARGET_AVX2
+static void to_db_avx2(const float *power, float norm, float *db, int bins)
+{
+    const __m256 n = _mm256_set1_ps(norm);
+    const __m256 floor = _mm256_set1_ps(SPECTRUM_POWER_FLOOR);
+
+    int i = 0;
+    for (; i + 8 <= bins; i += 8)
+    {
+        __m256 x = _mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(power + i), n), _mm256_setzero_ps());
+        _mm256_storeu_ps(db + i, db_avx2(_mm256_add_ps(x, floor)));
+    }
+
+    to_db_sse2(power + i, norm, db + i, bins - i);
+}
+
+SPECTRUM_TARGET_AVX2
+static void smooth_avx2(const float *db, float *peak, float *average, int bins, float alpha)
+{
+    const __m256 a = _mm256_set1_ps(alpha);
+    const __m256 decay = _mm256_set1_ps(PEAK_DECAY);
+
+    int i = 0;
+    for (; i + 8 <= bins; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(db + i);
+        __m256 p = _mm256_loadu_ps(peak + i);
+        __m256 decayed = _mm256_sub_ps(p, _mm256_mul_ps(_mm256_sub_ps(p, x), decay));
+        p = _mm256_blendv_ps(decayed, x, _mm256_cmp_ps(p, x, _CMP_LT_OQ));
+        _mm256_storeu_ps(peak + i, p);
+
+        __m256 avg = _mm256_loadu_ps(average + i);
+        _mm256_storeu_ps(average + i, _mm256_add_ps(avg, _mm256_mul_ps(a, _mm256_sub_ps(p, avg))));
+    }
+
+    smooth_sse2(db + i, peak + i, average + i, bins - i, alpha);
+}
+
+#endif // SPECTRUM_KERNELS_X86
+
+spectrum_kernels spectrum_kernels::select(simd_level maxLevel)
+{
+    spectrum_kernels k;
+    k.power = power_c;
+    k.to_db = to_db_c;
+    k.smooth = smooth_c;
+    k.range_max = range_max_c;
+    k.moments = moments_c;
+    k.below = below_c;
+    k.level = audio_converter::SIMD_NONE;
+
+#ifdef SPECTRUM_KERNELS_X86
+    simd_level level = std::min(maxLevel, audio_converter::cpuLevel());
+    if (level >= audio_converter::SIMD_AVX2)
+    {
+        k.power = power_avx2;
+        k.to_db = to_db_avx2;
+        k.smooth = smooth_avx2;
+        k.range_max = range_max_avx2;
+        k.moments = moments_avx2;
+        k.below = below_avx2;
+        k.level = audio_converter::SIMD_AVX2;
+    }
+    else if (level >= audio_converter::SIMD_SSE2)
+    {
+        k.power = power_sse2;
+        k.to_db = to_db_sse2;
+        k.smooth = smooth_sse2;
+        k.range_max = range_max_sse2;
+        k.moments = moments_sse2;
+        k.below = below_sse2;
+        k.level = audio_converter::SIMD_SSE2;
+    }
+#else
+    (void)maxLevel;
+#endif
+
+    return k;
+}
+
+float spectrum_kernels::maxDbError(simd_level level)
+{
+    // Log spaced sweep, plus exact octaves where the mantissa wraps
+    std::vector<float> power;
+    for (double x = 1e-18; x < 1e3; x *= 1.0007)
+        power.push_back((float)x);
+    for (int e = -59; e < 10; e++)
+    {
+        power.push_back(std::ldexp(1.0f, e));
+        power.push_back(std::nextafter(std::ldexp(1.41421356f, e), 0.0f));
+        power.push_back(std::ldexp(1.41421356f, e));
+    }
+
+    const int bins = (int)power.size();
+    std::vector<float> fast(bins);
+    std::vector<float> reference(bins);
+    select(level).to_db(power.data(), 1.0f, fast.data(), bins);
+    to_db_c(power.data(), 1.0f, reference.data(), bins);
+
+    float worst = 0.0f;
+    for (int i = 0; i < bins; i++)
+        worst = std::max(worst, std::fabs(fast[i] - reference[i]));
+    return worst;
+}
+
+/**
+ * Time power + dB + smoothing over one frame of bins, scalar reference
+ * against the best SIMD level, and check the dB accuracy of that level.
+ */
+spectrum_kernels::benchmark_result spectrum_kernels::benchmark(int bins, int iterations)
+{
+    benchmark_result result;
+
+    // Noise-like bins over a wide dynamic range
+    std::vector<float> complex(2 * bins);
+    for (int i = 0; i < 2 * bins; i++)
+        complex[i] = (float)(std::sin(i * 0.37) * std::pow(10.0, -(i % 97) / 16.0));
+
+    std::vector<float> row(bins, 0.0f);
+    std::vector<float> sum(bins, 0.0f);
+    std::vector<float> db(bins);
+    std::vector<float> peak(bins, -72.0f);
+    std::vector<float> average(bins, -72.0f);
+
+    auto run = [&](const spectrum_kernels &k) {
+        QElapsedTimer timer;
+        timer.start();
+        for (int n = 0; n < iterations; n++)
+        {
+            k.power(complex.data(), 1e-6f, row.data(), sum.data(), bins);
+            k.to_db(sum.data(), 0.25f, db.data(), bins);
+            k.smooth(db.data(), peak.data(), average.data(), bins, 0.25f);
+        }
+        return (double)bins * iterations / qMax<qint64>(1, timer.nsecsElapsed()) * 1e3;
+    };
+
+    result.scalarMbps = run(select(audio_converter::SIMD_NONE));
+
+    spectrum_kernels best = select(audio_converter::SIMD_AUTO);
+    result.simd = best.level;
+    result.simdMbps = run(best);
+    result.maxErrorDb = maxDbError(best.level);
+
+    return result;
+}
@@ -0,0 +1,64 @@
+#ifndef SPECTRUM_KERNELS_H
+#define SPECTRUM_KERNELS_H
+
+#include "audio_converter.h"
+
+// Floor added to every power value so silence maps to a finite dB value
+#define SPECTRUM_POWER_FLOOR    1e-20f
+// Worst case difference of the fast dB kernels against 10 * log10f
+#define SPECTRUM_DB_MAX_ERROR   1e-3f
+
+// Batch post-processing of one FFT output, run once per bin and frame:
+//
+//   power()   squared magnitude of interleaved complex bins times scale,
+//             stored in row while sum gets the difference to the old row
+//             (the Welch running sum)
+//   to_db()   10 * log10(power * norm + floor)
+//   smooth()  peak hold with decay towards the new value, then the IIR
+//             average of the peak
+//   range_max() largest value of each run of bins [edges[k], edges[k + 1]),
+//             the display reduction of many bins onto one pixel
+//   moments() sum and sum of squares of the pandapter pixel rows, the
+//             mean and deviation peak detection compares against
+//   below()   indices of the values under a threshold, in order; the peak
+//             candidates of one frame
+//
+// The scalar versions are the reference. The SSE2 and AVX2 versions
+// compute dB from the float exponent plus a short atanh series of the
+// mantissa, within SPECTRUM_DB_MAX_ERROR of the reference. The level is
+// picked from the CPU flags FFmpeg detects, like audio_converter.
+struct spectrum_kernels
+{
+    using simd_level = audio_converter::simd_level;
+
+    using power_fn = void (*)(const float *complex, float scale, float *row, float *sum, int bins);
+    using db_fn = void (*)(const float *power, float norm, float *db, int bins);
+    using smooth_fn = void (*)(const float *db, float *peak, float *average, int bins, float alpha);
+    using range_max_fn = void (*)(const float *in, const int *edges, int count, float *out);
+    using moments_fn = void (*)(const int *values, int count, double *sum, double *sumSq);
+    using below_fn = int (*)(const int *values, int count, int threshold, int *indices);
+
+    power_fn power {nullptr};
+    db_fn to_db {nullptr};
+    smooth_fn smooth {nullptr};
+    range_max_fn range_max {nullptr};
+    moments_fn moments {nullptr};
+    below_fn below {nullptr};       // returns the number of indices written, at most count
+    simd_level level {audio_converter::SIMD_NONE};
+
+    static spectrum_kernels select(simd_level maxLevel = audio_converter::SIMD_AUTO);
+
+    // Largest |fast - reference| in dB over power values from 1e-18 to 1e3
+    static float maxDbError(simd_level level);
+
+    struct benchmark_result
+    {
+        double scalarMbps {0};      // million bins per second, all three kernels
+        double simdMbps {0};
+        float maxErrorDb {0};
+        simd_level simd {audio_converter::SIMD_NONE};
+    };
+    static benchmark_result benchmark(int bins, int iterations);
+};
+
+#endif // SPECTRUM_KERNELS_H
@@ -0,0 +1,62 @@
+#include "spectrum_pyramid.h"
+
+#include <algorithm>
+
+void spectrum_pyramid::reset(const float *bins, int size)
+{
+    m_bins = bins;
+    m_size = size;
+    std::fill(std::begin(m_built), std::end(m_built), 0);
+}
+
+int spectrum_pyramid::levelFor(int runLength)
+{
+    // runs split on whole values of the level, so a run boundary is off
+    // by less than half a run
+    int l = 0;
+    while (l + 1 < SPECTRUM_PYRAMID_MAX_LEVELS && (2 << (l + 1)) <= runLength)
+        l++;
+    return l;
+}
+
+const float *spectrum_pyramid::level(int l, spectrum_statistic stat)
+{
+    l = std::min(l, SPECTRUM_PYRAMID_MAX_LEVELS - 1);
+    if (l <= 0 || !m_bins)
+        return m_bins;
+
+    while (m_built[stat] < l)
+        build(m_built[stat] + 1, stat);
+    return m_levels[stat][l].data();
+}
+
+// Level l from level l - 1, pairwise; an odd last value is taken as is
+void spectrum_pyramid::build(int l, spectrum_statistic stat)
+{
+    const float *in = l == 1 ? m_bins : m_levels[stat][l - 1].data();
+    const int inSize = levelSize(l - 1);
+    const int pairs = inSize / 2;
+    std::vector<float> &out = m_levels[stat][l];
+    out.resize(levelSize(l));
+
+    switch (stat)
+    {
+    case SPECTRUM_STAT_MAX:
+        for (int i = 0; i < pairs; i++)
+            out[i] = std::max(in[2 * i], in[2 * i + 1]);
+        break;
+    case SPECTRUM_STAT_MIN:
+        for (int i = 0; i < pairs; i++)
+            out[i] = std::min(in[2 * i], in[2 * i + 1]);
+        break;
+    case SPECTRUM_STAT_MEAN:
+        for (int i = 0; i < pairs; i++)
+            out[i] = 0.5f * (in[2 * i] + in[2 * i + 1]);
+        break;
+    }
+
+    if (inSize & 1)
+        out[pairs] = in[inSize - 1];
+
+    m_built[stat] = l;
+}
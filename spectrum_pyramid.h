@@ -0,0 +1,46 @@
+#ifndef SPECTRUM_PYRAMID_H
+#define SPECTRUM_PYRAMID_H
+
+#include <vector>
+
+#define SPECTRUM_PYRAMID_MAX_LEVELS 20
+
+enum spectrum_statistic
+{
+    SPECTRUM_STAT_MAX,
+    SPECTRUM_STAT_MIN,
+    SPECTRUM_STAT_MEAN
+};
+
+// Min, max and mean of one spectrum at 2x decimation steps. Level 0 is
+// the bins themselves, value i of level l summarizes bins
+// [i * 2^l, (i + 1) * 2^l). A display that puts r bins on a pixel reads
+// level levelFor(r) and reduces two to five values per pixel instead of
+// r bins.
+//
+// Levels are built on demand, per statistic and only as deep as asked
+// for, since a frame is normally shown at one zoom level with one
+// statistic. The storage is kept from frame to frame.
+class spectrum_pyramid
+{
+public:
+    // Starts over with a new spectrum, which must stay valid until the next reset()
+    void reset(const float *bins, int size);
+
+    const float *level(int l, spectrum_statistic stat);
+    int levelSize(int l) const { return (m_size + (1 << l) - 1) >> l; }
+    int size() const { return m_size; }
+
+    // Deepest level that still has at least two values per run of runLength bins
+    static int levelFor(int runLength);
+
+private:
+    void build(int l, spectrum_statistic stat);
+
+    const float *m_bins {nullptr};
+    int m_size {0};
+    std::vector<float> m_levels[3][SPECTRUM_PYRAMID_MAX_LEVELS];   // level 0 unused
+    int m_built[3] {0, 0, 0};       // deepest valid level per statistic
+};
+
+#endif // SPECTRUM_PYRAMID_H
@@ -0,0 +1,503 @@
+#include "spectrum_worker.h"
+
+#include <QStandardPaths>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDebug>
+#include <QDateTime>
+#include <QtMath>
+#include <algorithm>
+#include <cmath>
+
+// The FFTW planner is not thread safe, and wisdom is process wide
+static QMutex s_plannerMutex;
+static bool s_wisdomLoaded = false;
+
+spectrum_worker::spectrum_worker(QObject *parent)
+    : QThread(parent)
+    , m_kernels(spectrum_kernels::select())
+{
+}
+
+spectrum_worker::~spectrum_worker()
+{
+    stop();
+    wait();
+    free_plans();
+}
+
+void spectrum_worker::stop()
+{
+    m_stop = true;
+    m_wake.release();
+}
+
+void spectrum_worker::setFftSize(int size)
+{
+    size = qBound(SPECTRUM_MIN_FFT_SIZE, size, SPECTRUM_MAX_FFT_SIZE);
+    m_requestedSize = (int)qNextPowerOfTwo((quint32)size - 1);
+}
+
+void spectrum_worker::setOverlap(float overlap)
+{
+    m_requestedOverlap = qBound(0.0f, overlap, SPECTRUM_MAX_OVERLAP);
+}
+
+void spectrum_worker::setSegments(int segments)
+{
+    m_requestedSegments = qBound(1, segments, SPECTRUM_MAX_SEGMENTS);
+}
+
+void spectrum_worker::setZoom(double center, double span)
+{
+    m_requestedZoomCenter = center;
+    m_requestedZoomSpan = qMax(0.0, span);
+}
+
+void spectrum_worker::pushAudio(const audio_buffer &block)
+{
+    m_input.post(block);
+    m_wake.release();
+}
+
+QString spectrum_worker::wisdomPath()
+{
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    return QDir(dir).filePath(SPECTRUM_WISDOM_FILE);
+}
+
+void spectrum_worker::load_wisdom()
+{
+    if (s_wisdomLoaded)
+        return;
+    s_wisdomLoaded = true;
+
+    QByteArray path = QFile::encodeName(wisdomPath());
+    if (QFile::exists(wisdomPath()) && !fftwf_import_wisdom_from_filename(path.constData()))
+        qWarning() << "Ignoring unreadable FFTW wisdom" << wisdomPath();
+}
+
+void spectrum_worker::save_wisdom()
+{
+    QDir().mkpath(QFileInfo(wisdomPath()).absolutePath());
+    QByteArray path = QFile::encodeName(wisdomPath());
+    if (!fftwf_export_wisdom_to_filename(path.constData()))
+        qWarning() << "Can not write FFTW wisdom" << wisdomPath();
+}
+
+spectrum_worker::fft_plan *spectrum_worker::plan_for(int size, bool complex)
+{
+    const int key = complex ? -size : size;
+    auto it = m_plans.find(key);
+    if (it != m_plans.end())
+        return &it.value();
+
+    fft_plan p;
+    p.in = fftwf_alloc_real(complex ? 2 * size : size);
+    p.out = fftwf_alloc_complex(complex ? size : size / 2 + 1);
+    if (!p.in || !p.out)
+    {
+        fftwf_free(p.in);
+        fftwf_free(p.out);
+        return nullptr;
+    }
+
+    {
+        QMutexLocker locker(&s_plannerMutex);
+        load_wisdom();
+
+        // MEASURE scribbles over the arrays, fine before any data is in them.
+        // With wisdom for this size it returns immediately.
+        if (complex)
+            p.plan = fftwf_plan_dft_1d(size, reinterpret_cast<fftwf_complex *>(p.in), p.out,
+                                       FFTW_FORWARD, FFTW_MEASURE);
+        else
+            p.plan = fftwf_plan_dft_r2c_1d(size, p.in, p.out, FFTW_MEASURE);
+        if (p.plan)
+            save_wisdom();
+    }
+
+    if (!p.plan)
+    {
+        fftwf_free(p.in);
+        fftwf_free(p.out);
+        return nullptr;
+    }
+
+    return &m_plans.insert(key, p).value();
+}
+
+void spectrum_worker::free_plans()
+{
+    QMutexLocker locker(&s_plannerMutex);
+    for (fft_plan &p : m_plans)
+    {
+        fftwf_destroy_plan(p.plan);
+        fftwf_free(p.in);
+        fftwf_free(p.out);
+    }
+    m_plans.clear();
+}
+
+void spectrum_worker::reset(int size)
+{
+    m_fftSize = size;
+    build_zoom();
+    m_bins = m_decimation > 1 ? size : size / 2;
+    m_ring.assign(m_decimation > 1 ? 2 * size : size, 0.0f);
+    m_writePos = 0;
+    m_filled = 0;
+    m_sinceLast = 0;
+    m_db.resize(m_bins);
+    m_peak.assign(m_bins, SPECTRUM_RESET_DB);
+    m_average.assign(m_bins, SPECTRUM_RESET_DB);
+    m_waterfall.assign(m_bins, SPECTRUM_RESET_DB);
+    reset_segments();
+    build_window();
+}
+
+void spectrum_worker::reset_segments()
+{
+    const int bins = m_bins;
+    m_segments = m_requestedSegments;
+    m_segmentPower.assign((size_t)m_segments * bins, 0.0f);
+    m_powerSum.assign(bins, 0.0f);
+    m_segmentIndex = 0;
+    m_segmentCount = 0;
+}
+
+/**
+ * Precompute the window for the current size. Periodic (DFT-even) forms are
+ * used since the window feeds an FFT. The amplitude scale undoes the
+ * coherent gain so a full scale sine still peaks at 0 dBFS whichever
+ * window is selected.
+ */
+void spectrum_worker::build_window()
+{
+    const int n = m_fftSize;
+    m_window = m_requestedWindow;
+    m_coefficients.resize(n);
+
+    double sum = 0.0;
+    for (int i = 0; i < n; i++)
+    {
+        const double x = 2.0 * M_PI * i / n;
+        double w;
+        switch (m_window)
+        {
+        case SPECTRUM_WINDOW_HANN:
+            w = 0.5 - 0.5 * std::cos(x);
+            break;
+        case SPECTRUM_WINDOW_BLACKMAN_HARRIS:
+            w = 0.35875 - 0.48829 * std::cos(x) + 0.14128 * std::cos(2.0 * x) - 0.01168 * std::cos(3.0 * x);
+            break;
+        default:
+            w = 1.0;
+            break;
+        }
+        m_coefficients[i] = (float)w;
+        sum += w;
+    }
+
+    // One-sided spectrum: the negative frequency half folds onto the positive
+    m_amplitudeScale = sum > 0.0 ? (float)(2.0 / sum) : 1.0f;
+}
+
+/**
+ * Pick the decimation for the requested zoom band and design its low-pass
+ * filter, a Blackman windowed sinc cut off at half the decimated rate.
+ * The band is kept within SPECTRUM_ZOOM_USABLE of the decimated rate, the
+ * part the filter's transition band does not fold back into.
+ */
+void spectrum_worker::build_zoom()
+{
+    m_zoomCenter = m_requestedZoomCenter;
+    m_zoomSpan = m_requestedZoomSpan;
+    m_decimation = 1;
+    m_zoomTaps.clear();
+    m_zoomHistory.clear();
+
+    if (m_zoomSpan <= 0.0 || m_sampleRate <= 0)
+        return;
+
+    while (m_decimation < SPECTRUM_MAX_DECIMATION &&
+           m_sampleRate / (2.0 * m_decimation) * SPECTRUM_ZOOM_USABLE >= m_zoomSpan)
+        m_decimation *= 2;
+    if (m_decimation == 1)
+        return;
+
+    const int taps = SPECTRUM_ZOOM_TAPS_PER_PHASE * m_decimation + 1;
+    const double cutoff = 0.5 / m_decimation;     // of the input rate
+    const double mid = (taps - 1) / 2.0;
+    double sum = 0.0;
+    m_zoomTaps.resize(taps);
+    for (int i = 0; i < taps; i++)
+    {
+        const double t = i - mid;
+        const double x = 2.0 * M_PI * i / (taps - 1);
+        const double sinc = t == 0.0 ? 2.0 * cutoff : std::sin(2.0 * M_PI * cutoff * t) / (M_PI * t);
+        const double h = sinc * (0.42 - 0.5 * std::cos(x) + 0.08 * std::cos(2.0 * x));
+        m_zoomTaps[i] = (float)h;
+        sum += h;
+    }
+    // Unity gain at the band center
+    for (float &h : m_zoomTaps)
+        h = (float)(h / sum);
+
+    m_zoomHistory.assign(2 * taps, std::complex<float>());
+    m_zoomPos = 0;
+    m_zoomPhase = 0;
+
+    const double center = qBound(0.0, m_zoomCenter, m_sampleRate / 2.0);
+    m_bandStart = center - m_sampleRate / (2.0 * m_decimation);
+    m_nco = 1.0;
+    m_ncoStep = std::polar(1.0, -2.0 * M_PI * center / m_sampleRate);
+}
+
+void spectrum_worker::run()
+{
+    reset(m_requestedSize);
+    plan_for(m_fftSize);
+
+    while (!m_stop)
+    {
+        m_wake.tryAcquire(1, SPECTRUM_WAIT_MS);
+        m_wake.tryAcquire(m_wake.available());
+        if (m_stop)
+            break;
+
+        if (m_requestedSize != m_fftSize ||
+            m_requestedZoomCenter != m_zoomCenter || m_requestedZoomSpan != m_zoomSpan)
+            reset(m_requestedSize);
+        if (m_requestedWindow != m_window)
+            build_window();
+        if (m_requestedSegments != m_segments)
+            reset_segments();
+        m_hop = qMax(1, (int)std::lround(m_fftSize * (1.0f - m_requestedOverlap)));
+
+        const QList<audio_buffer> blocks = m_input.takeAll();
+        for (const audio_buffer &block : blocks)
+            process_block(block);
+    }
+}
+
+template <typename T>
+void spectrum_worker::append_samples(const T *samples, int channels, int frames, float scale)
+{
+    const int channel = m_channel;
+    const bool mix = channel < 0 || channel >= channels;
+    const int mask = m_fftSize - 1;
+
+    if (mix)
+        scale /= channels;
+    else
+        samples += channel;
+
+    for (int i = 0; i < frames; i++)
+    {
+        float value;
+        if (mix)
+        {
+            // Average of all channels, a mono mix of what is being played
+            float sum = 0.0f;
+            for (int c = 0; c < channels; c++)
+                sum += samples[i * channels + c];
+            value = sum * scale;
+        }
+        else
+        {
+            value = samples[i * channels] * scale;
+        }
+
+        if (m_decimation > 1)
+        {
+            zoom_sample(value);
+            continue;
+        }
+
+        m_ring[m_writePos] = value;
+        m_writePos = (m_writePos + 1) & mask;
+        if (m_filled < m_fftSize)
+            m_filled++;
+
+        if (++m_sinceLast >= m_hop && m_filled == m_fftSize)
+        {
+            compute();
+            m_sinceLast = 0;
+        }
+    }
+}
+
+/**
+ * Mix one sample down to the zoom band, and for every decimation-th one
+ * run the low-pass filter over the last taps and append its output to the
+ * complex ring.
+ */
+void spectrum_worker::zoom_sample(float value)
+{
+    const int taps = (int)m_zoomTaps.size();
+    const std::complex<float> mixed((float)(value * m_nco.real()), (float)(value * m_nco.imag()));
+    m_nco *= m_ncoStep;
+
+    m_zoomHistory[m_zoomPos] = m_zoomHistory[m_zoomPos + taps] = mixed;
+    if (++m_zoomPos == taps)
+        m_zoomPos = 0;
+
+    if (++m_zoomPhase < m_decimation)
+        return;
+    m_zoomPhase = 0;
+    // Keeps rounding from changing the oscillator amplitude
+    m_nco /= std::abs(m_nco);
+
+    // Oldest sample first; the taps are symmetric
+    const std::complex<float> *x = &m_zoomHistory[m_zoomPos];
+    const float *h = m_zoomTaps.data();
+    float re = 0.0f;
+    float im = 0.0f;
+    for (int i = 0; i < taps; i++)
+    {
+        re += h[i] * x[i].real();
+        im += h[i] * x[i].imag();
+    }
+
+    m_ring[2 * m_writePos] = re;
+    m_ring[2 * m_writePos + 1] = im;
+    m_writePos = (m_writePos + 1) & (m_fftSize - 1);
+    if (m_filled < m_fftSize)
+        m_filled++;
+
+    if (++m_sinceLast >= m_hop && m_filled == m_fftSize)
+    {
+        compute();
+        m_sinceLast = 0;
+    }
+}
+
+void spectrum_worker::process_block(const audio_buffer &block)
+{
+    if (block.channels() <= 0 || block.sampleRate() <= 0)
+        return;
+
+    // Bins and the zoom filter move with the sample rate, old history no
+    // longer lines up
+    if (block.sampleRate() != m_sampleRate)
+    {
+        m_sampleRate = block.sampleRate();
+        reset(m_fftSize);
+    }
+
+    switch (block.format())
+    {
+    case AV_SAMPLE_FMT_S16:
+        append_samples(block.samples<int16_t>(), block.channels(), block.frames(), 1.0f / 32768.0f);
+        break;
+    case AV_SAMPLE_FMT_FLT:
+        append_samples(block.samples<float>(), block.channels(), block.frames(), 1.0f);
+        break;
+    default:
+        break;
+    }
+}
+
+void spectrum_worker::compute()
+{
+    const bool zoomed = m_decimation > 1;
+    fft_plan *p = plan_for(m_fftSize, zoomed);
+    if (!p)
+        return;
+
+    // The oldest sample sits at the write position, window the two halves
+    // of the ring straight into the plan input
+    const int n = m_fftSize;
+    const int head = n - m_writePos;
+    const float *w = m_coefficients.data();
+    if (zoomed)
+    {
+        for (int i = 0; i < head; i++)
+        {
+            p->in[2 * i] = m_ring[2 * (m_writePos + i)] * w[i];
+            p->in[2 * i + 1] = m_ring[2 * (m_writePos + i) + 1] * w[i];
+        }
+        for (int i = 0; i < m_writePos; i++)
+        {
+            p->in[2 * (head + i)] = m_ring[2 * i] * w[head + i];
+            p->in[2 * (head + i) + 1] = m_ring[2 * i + 1] * w[head + i];
+        }
+    }
+    else
+    {
+        for (int i = 0; i < head; i++)
+            p->in[i] = m_ring[m_writePos + i] * w[i];
+        for (int i = 0; i < m_writePos; i++)
+            p->in[head + i] = m_ring[i] * w[head + i];
+    }
+
+    fftwf_execute(p->plan);
+
+    // Power relative to a full scale sine, 10*log10 of power is dB. Mixing
+    // halves a real sine like folding the one-sided spectrum doubles it, so
+    // the zoomed band takes the same scale.
+    const float scale = m_amplitudeScale * m_amplitudeScale;
+    const float alpha = m_alpha;
+    const int bins = m_bins;
+    const float *out = reinterpret_cast<const float *>(p->out);
+
+    // Welch: running sum over the last m_segments periodograms. It is
+    // rebuilt from the stored rows once per cycle so float error can not
+    // accumulate.
+    float *row = &m_segmentPower[(size_t)m_segmentIndex * bins];
+    if (zoomed)
+    {
+        // Negative frequencies first, so the bins run up from the low band edge
+        m_kernels.power(out + n, scale, row, m_powerSum.data(), n / 2);
+        m_kernels.power(out, scale, row + n / 2, m_powerSum.data() + n / 2, n / 2);
+    }
+    else
+    {
+        m_kernels.power(out, scale, row, m_powerSum.data(), bins);
+    }
+    if (m_segmentCount < m_segments)
+        m_segmentCount++;
+    if (++m_segmentIndex == m_segments)
+    {
+        m_segmentIndex = 0;
+        std::copy_n(m_segmentPower.begin(), bins, m_powerSum.begin());
+        for (int s = 1; s < m_segments; s++)
+        {
+            const float *r = &m_segmentPower[(size_t)s * bins];
+            for (int i = 0; i < bins; i++)
+                m_powerSum[i] += r[i];
+        }
+    }
+
+    const float norm = 1.0f / m_segmentCount;
+    m_kernels.to_db(m_powerSum.data(), norm, m_db.data(), bins);
+    // DC has no negative frequency twin
+    if (!zoomed)
+        m_db[0] = 10.f * log10f(qMax(0.0f, m_powerSum[0] * norm) * 0.25f + SPECTRUM_POWER_FLOOR);
+    m_kernels.smooth(m_db.data(), m_peak.data(), m_average.data(), bins, alpha);
+
+    // A frame still waiting for the display is about to be replaced, fold
+    // its waterfall line into this one so short bursts are not lost
+    if (m_output.pending())
+        for (int i = 0; i < bins; i++)
+            m_waterfall[i] = qMax(m_waterfall[i], m_peak[i]);
+    else
+        std::copy(m_peak.begin(), m_peak.end(), m_waterfall.begin());
+
+    // Buffers rotate through the exchange, assign() reuses their capacity
+    spectrum_frame &frame = m_output.writeBuffer();
+    frame.peak.assign(m_peak.begin(), m_peak.end());
+    frame.average.assign(m_average.begin(), m_average.end());
+    frame.waterfall.assign(m_waterfall.begin(), m_waterfall.end());
+    frame.fftSize = n;
+    frame.hop = m_hop * m_decimation;
+    frame.sampleRate = m_sampleRate;
+    frame.bandStart = zoomed ? m_bandStart : 0.0;
+    frame.bandWidth = zoomed ? (double)m_sampleRate / m_decimation : 0.0;
+    frame.timestamp = QDateTime::currentMSecsSinceEpoch();
+    frame.sequence = ++m_frames;
+    m_history.addFrame(frame);
+    m_output.publish();
+}
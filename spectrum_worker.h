@@ -0,0 +1,177 @@
+#ifndef SPECTRUM_WORKER_H
+#define SPECTRUM_WORKER_H
+
+#include <QThread>
+#include <QHash>
+#include <QMutex>
+#include <QSemaphore>
+#include <atomic>
+#include <complex>
+#include <vector>
+
+#include <fftw3.h>
+
+#include "audio_buffer.h"
+#include "mailbox.h"
+#include "spectrum_frame.h"
+#include "spectrum_kernels.h"
+#include "waterfall_history.h"
+
+#define SPECTRUM_DEFAULT_FFT_SIZE   4096
+#define SPECTRUM_MIN_FFT_SIZE       256
+#define SPECTRUM_MAX_FFT_SIZE       65536
+#define SPECTRUM_DEFAULT_OVERLAP    0.5f
+#define SPECTRUM_MAX_OVERLAP        0.9375f
+#define SPECTRUM_DEFAULT_SEGMENTS   4
+#define SPECTRUM_MAX_SEGMENTS       16
+#define SPECTRUM_INPUT_QUEUE_SIZE   64
+#define SPECTRUM_RESET_DB           -72.0f
+#define SPECTRUM_WAIT_MS            100
+#define SPECTRUM_WISDOM_FILE        "fftwf_wisdom"
+#define SPECTRUM_ALL_CHANNELS       -1
+#define SPECTRUM_MAX_DECIMATION     256
+#define SPECTRUM_ZOOM_USABLE        0.8     // part of a decimated band clear of aliases
+#define SPECTRUM_ZOOM_TAPS_PER_PHASE 32
+
+enum spectrum_window
+{
+    SPECTRUM_WINDOW_RECT,
+    SPECTRUM_WINDOW_HANN,
+    SPECTRUM_WINDOW_BLACKMAN_HARRIS
+};
+
+// Spectrum analysis off the GUI thread. Audio blocks are handed in with
+// pushAudio() from any thread, finished spectra are published through a
+// wait-free triple buffer, exchange(), for a single display consumer.
+// Samples are taken as typed s16 or f32 at the block's own sample rate,
+// windowed and run through a real-to-complex transform.
+//
+// Samples go into a circular analysis buffer of fftSize samples and a
+// transform runs every hop samples, so overlapping segments are windowed
+// straight out of the ring without moving the overlap around. The power
+// of the last few segments is averaged (Welch's method) before it is
+// turned into dB.
+//
+// With a zoom band set, samples are instead mixed down so the band center
+// sits at 0 Hz, low-pass filtered and decimated by the largest power of
+// two that still keeps the band, and the same size of complex transform
+// then resolves just that band, decimation times finer than the full band
+// could at the same cost. The filter is only evaluated for the samples
+// that are kept.
+//
+// Single precision FFTW plans are created once per size with FFTW_MEASURE,
+// and the planner wisdom is kept in a cache file so only the very first
+// start pays for measuring.
+class spectrum_worker : public QThread
+{
+    Q_OBJECT
+public:
+    explicit spectrum_worker(QObject *parent = nullptr);
+    ~spectrum_worker();
+
+    void pushAudio(const audio_buffer &block);
+    spectrum_exchange *exchange() { return &m_output; }
+    // Every computed spectrum also goes to the history while it is open
+    waterfall_history *history() { return &m_history; }
+
+    // Rounded to a power of two in [SPECTRUM_MIN_FFT_SIZE, SPECTRUM_MAX_FFT_SIZE]
+    void setFftSize(int size);
+    // Fraction of a segment shared with the previous one, [0, SPECTRUM_MAX_OVERLAP]
+    void setOverlap(float overlap);
+    // Number of overlapped segments averaged per frame, 1 disables averaging
+    void setSegments(int segments);
+    void setAveraging(float alpha) { m_alpha = alpha; }
+    void setWindow(spectrum_window window) { m_requestedWindow = window; }
+    // Channel to analyse, SPECTRUM_ALL_CHANNELS averages them
+    void setChannel(int channel) { m_channel = channel; }
+    // Band to resolve finely, in Hz of the input; a span of 0 analyses the full band
+    void setZoom(double center, double span);
+    void stop();
+
+    quint64 framesComputed() const { return m_frames; }
+    quint64 blocksDropped() const { return m_input.stats().dropped; }
+    // Frames replaced before the consumer read them
+    quint64 framesOverwritten() const { return m_output.overwritten(); }
+
+    static QString wisdomPath();
+
+protected:
+    void run() override;
+
+private:
+    struct fft_plan
+    {
+        fftwf_plan plan {nullptr};
+        float *in {nullptr};        // interleaved complex for complex plans
+        fftwf_complex *out {nullptr};
+    };
+
+    template <typename T>
+    void append_samples(const T *samples, int channels, int frames, float scale);
+
+    fft_plan *plan_for(int size, bool complex = false);
+    void free_plans();
+    void reset(int size);
+    void reset_segments();
+    void build_window();
+    void build_zoom();
+    void zoom_sample(float value);
+    void process_block(const audio_buffer &block);
+    void compute();
+
+    static void load_wisdom();
+    static void save_wisdom();
+
+    mailbox<audio_buffer> m_input {SPECTRUM_INPUT_QUEUE_SIZE};
+    spectrum_exchange m_output;
+    waterfall_history m_history;
+    QSemaphore m_wake;
+    std::atomic<bool> m_stop {false};
+    std::atomic<int> m_requestedSize {SPECTRUM_DEFAULT_FFT_SIZE};
+    std::atomic<float> m_requestedOverlap {SPECTRUM_DEFAULT_OVERLAP};
+    std::atomic<int> m_requestedSegments {SPECTRUM_DEFAULT_SEGMENTS};
+    std::atomic<float> m_alpha {0.25f};
+    std::atomic<int> m_requestedWindow {SPECTRUM_WINDOW_HANN};
+    std::atomic<int> m_channel {SPECTRUM_ALL_CHANNELS};
+    std::atomic<double> m_requestedZoomCenter {0};
+    std::atomic<double> m_requestedZoomSpan {0};
+    std::atomic<quint64> m_frames {0};
+
+    // Worker thread only
+    spectrum_kernels m_kernels;
+    QHash<int, fft_plan> m_plans;  // complex plans under -size
+    int m_fftSize {0};
+    int m_bins {0};                 // fftSize / 2, or fftSize when zoomed
+    int m_hop {0};
+    int m_window {-1};
+    int m_sampleRate {0};
+    std::vector<float> m_ring;      // last fftSize samples, oldest at m_writePos, complex when zoomed
+    int m_writePos {0};
+    int m_filled {0};
+    int m_sinceLast {0};
+    std::vector<float> m_segmentPower;  // segments x bins, one row per segment
+    std::vector<float> m_powerSum;
+    int m_segments {0};
+    int m_segmentIndex {0};
+    int m_segmentCount {0};
+    std::vector<float> m_coefficients;
+    float m_amplitudeScale {1.0f};
+    std::vector<float> m_db;
+    std::vector<float> m_waterfall;
+    std::vector<float> m_peak;
+    std::vector<float> m_average;
+
+    // Zoom, decimation 1 is off
+    double m_zoomCenter {0};
+    double m_zoomSpan {0};
+    int m_decimation {1};
+    double m_bandStart {0};         // frequency of the lowest zoomed bin
+    std::vector<float> m_zoomTaps;
+    std::vector<std::complex<float>> m_zoomHistory;    // mixed samples, twice over so the filter reads them in one piece
+    int m_zoomPos {0};
+    int m_zoomPhase {0};
+    std::complex<double> m_nco;
+    std::complex<double> m_ncoStep;
+};
+
+#endif // SPECTRUM_WORKER_H
@@ -0,0 +1,85 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <utility>
+
+#define SPSC_CACHE_LINE 64
+
+// Bounded wait-free single-producer / single-consumer ring queue.
+// Capacity is rounded up to a power of two. One thread may push, one other
+// thread may pop; the counters can be read from any thread.
+template <typename T>
+class spsc_queue
+{
+public:
+    explicit spsc_queue(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        m_slots.resize(size);
+        m_mask = size - 1;
+    }
+
+    spsc_queue(const spsc_queue&) = delete;
+    spsc_queue& operator=(const spsc_queue&) = delete;
+
+    bool push(T item)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        const size_t head = m_head.load(std::memory_order_acquire);
+        if (tail - head > m_mask)
+        {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        m_slots[tail & m_mask] = std::move(item);
+        m_tail.store(tail + 1, std::memory_order_release);
+
+        size_t depth = tail + 1 - head;
+        if (depth > m_maxDepth.load(std::memory_order_relaxed))
+            m_maxDepth.store(depth, std::memory_order_relaxed);
+        m_pushed.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        const size_t tail = m_tail.load(std::memory_order_acquire);
+        if (head == tail)
+            return false;
+
+        item = std::move(m_slots[head & m_mask]);
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool full() const { return depth() > m_mask; }
+    bool empty() const { return depth() == 0; }
+
+    size_t depth() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+    size_t capacity() const { return m_mask + 1; }
+    size_t maxDepth() const { return m_maxDepth.load(std::memory_order_relaxed); }
+    uint64_t pushed() const { return m_pushed.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+    alignas(SPSC_CACHE_LINE) std::atomic<size_t> m_head {0};
+    alignas(SPSC_CACHE_LINE) std::atomic<size_t> m_tail {0};
+    alignas(SPSC_CACHE_LINE) std::atomic<size_t> m_maxDepth {0};
+    std::atomic<uint64_t> m_pushed {0};
+    std::atomic<uint64_t> m_dropped {0};
+    std::vector<T> m_slots;
+    size_t m_mask;
+};
+
+#endif // SPSC_QUEUE_H
@@ -0,0 +1,358 @@
+#include "sws_converter.h"
+
+#include <QSemaphore>
+#include <QThread>
+#include <algorithm>
+#include <atomic>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include <libavutil/imgutils.h>
+#ifdef __cplusplus
+};
+#endif
+
+sws_converter::sws_converter(int threads)
+    : m_threads(qBound(1, threads, SWS_MAX_SLICES))
+{
+    // The calling thread converts the first band itself
+    m_pool.setMaxThreadCount(qMax(1, m_threads - 1));
+}
+
+sws_converter::~sws_converter()
+{
+    m_pool.waitForDone();
+    clear();
+}
+
+void sws_converter::clear()
+{
+    for (entry *e : std::as_const(m_cache))
+        free_entry(e);
+    m_cache.clear();
+}
+
+void sws_converter::free_entry(entry *e)
+{
+    for (slice &s : e->slices)
+    {
+        sws_freeContext(s.ctx);
+        av_frame_free(&s.src);
+        av_frame_free(&s.dst);
+    }
+    delete e;
+}
+
+/** Advance plane pointers of fmt by y luma rows, honouring chroma subsampling. */
+void sws_converter::offset_planes(AVPixelFormat fmt, const uint8_t *const in[], const int stride[],
+                                  int y, const uint8_t *out[])
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+    int planes = av_pix_fmt_count_planes(fmt);
+
+    for (int p = 0; p < 4; p++)
+    {
+        if (p >= planes || !in[p])
+        {
+            out[p] = in[p];
+            continue;
+        }
+
+        // Palette formats carry the palette in plane 1, it is not image data
+        if (p == 1 && (desc->flags & AV_PIX_FMT_FLAG_PAL))
+        {
+            out[p] = in[p];
+            continue;
+        }
+
+        bool chroma = (p == 1 || p == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+        int rows = chroma ? (y >> desc->log2_chroma_h) : y;
+        out[p] = in[p] + (ptrdiff_t)rows * stride[p];
+    }
+}
+
+void sws_converter::crop_planes(AVPixelFormat fmt, const uint8_t *const in[], const int stride[],
+                                int x, int y, const uint8_t *out[])
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+    int steps[4] = { 0 };
+    av_image_fill_max_pixsteps(steps, nullptr, desc);
+
+    offset_planes(fmt, in, stride, y, out);
+
+    int planes = av_pix_fmt_count_planes(fmt);
+    for (int p = 0; p < planes && p < 4; p++)
+    {
+        if (!out[p] || (p == 1 && (desc->flags & AV_PIX_FMT_FLAG_PAL)))
+            continue;
+
+        bool chroma = (p == 1 || p == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+        int cols = chroma ? (x >> desc->log2_chroma_w) : x;
+        out[p] += (ptrdiff_t)cols * steps[p];
+    }
+}
+
+QRect sws_converter::align_crop(AVPixelFormat fmt, const QRect &crop, int width, int height)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+    QRect r = crop.intersected(QRect(0, 0, width, height));
+    if (!desc || r.isEmpty())
+        return QRect(0, 0, width, height);
+
+    // Bitstream formats can not be addressed per pixel
+    if (desc->flags & AV_PIX_FMT_FLAG_BITSTREAM)
+        return QRect(0, 0, width, height);
+
+    int ax = 1 << desc->log2_chroma_w;
+    int ay = 1 << desc->log2_chroma_h;
+    int x = r.x() / ax * ax;
+    int y = r.y() / ay * ay;
+    int w = qMax(ax, (r.right() + 1 - x) / ax * ax);
+    int h = qMax(ay, (r.bottom() + 1 - y) / ay * ay);
+    return QRect(x, y, qMin(w, width - x), qMin(h, height - y));
+}
+
+sws_converter::entry *sws_converter::lookup(const sws_key &key)
+{
+    m_useCounter++;
+
+    auto it = m_cache.find(key);
+    if (it != m_cache.end())
+    {
+        it.value()->lastUse = m_useCounter;
+        return it.value();
+    }
+
+    m_misses++;
+
+    const AVPixFmtDescriptor *srcDesc = av_pix_fmt_desc_get(key.srcFmt);
+    const AVPixFmtDescriptor *dstDesc = av_pix_fmt_desc_get(key.dstFmt);
+    if (!srcDesc || !dstDesc)
+        return nullptr;
+
+#ifdef SWS_HAS_SLICE_API
+    int count = qBound(1, key.dstH / SWS_MIN_SLICE_ROWS, m_threads);
+#else
+    int count = 1;
+#endif
+
+    auto *e = new entry;
+    e->lastUse = m_useCounter;
+
+    // Band borders must land on rows the context can start an output slice on
+    int align = 1 << dstDesc->log2_chroma_h;
+    int dstY = 0;
+    for (int i = 0; i < count; i++)
+    {
+        slice s;
+        s.ctx = sws_getContext(key.srcW, key.srcH, key.srcFmt,
+                               key.dstW, key.dstH, key.dstFmt,
+                               key.flags, nullptr, nullptr, nullptr);
+        if (!s.ctx)
+        {
+            free_entry(e);
+            return nullptr;
+        }
+#ifdef SWS_HAS_SLICE_API
+        if (i == 0)
+            align = qMax<int>(align, sws_receive_slice_alignment(s.ctx));
+        if (count > 1)
+        {
+            s.src = av_frame_alloc();
+            s.dst = av_frame_alloc();
+        }
+#endif
+
+        int dstEnd = (i == count - 1) ? key.dstH
+                                      : (int)((qint64)(i + 1) * key.dstH / count) / align * align;
+        s.dstY = dstY;
+        s.dstH = dstEnd - dstY;
+        e->slices.append(s);
+
+        if ((count > 1 && (!s.src || !s.dst)) || s.dstH <= 0)
+        {
+            free_entry(e);
+            return nullptr;
+        }
+        dstY = dstEnd;
+    }
+
+    // Evict the least recently used geometry, sessions rarely switch back and forth
+    if (m_cache.size() >= SWS_CACHE_MAX)
+    {
+        auto oldest = m_cache.begin();
+        for (auto i = m_cache.begin(); i != m_cache.end(); ++i)
+            if (i.value()->lastUse < oldest.value()->lastUse)
+                oldest = i;
+        free_entry(oldest.value());
+        m_cache.erase(oldest);
+    }
+
+    m_cache.insert(key, e);
+    return e;
+}
+
+#ifdef SWS_HAS_SLICE_API
+static void keep_planes(void *, uint8_t *)
+{
+}
+
+/**
+ * Point frame at caller owned planes. The slice API refs its frames, a
+ * buffer that frees nothing keeps av_frame_ref() from copying the planes.
+ */
+static bool wrap_planes(AVFrame *frame, const uint8_t *const data[], const int stride[],
+                        int width, int height, AVPixelFormat fmt)
+{
+    frame->width = width;
+    frame->height = height;
+    frame->format = fmt;
+    for (int p = 0; p < 4; p++)
+    {
+        frame->data[p] = const_cast<uint8_t *>(data[p]);
+        frame->linesize[p] = stride[p];
+    }
+    frame->buf[0] = av_buffer_create(frame->data[0], 0, keep_planes, nullptr, 0);
+    return frame->buf[0] != nullptr;
+}
+#endif
+
+/**
+ * Convert the destination rows of one band. A single band covers the frame
+ * and goes through sws_scale, the bands of a split frame each read the
+ * whole source.
+ */
+bool sws_converter::run_slice(const slice &s, const uint8_t *const srcData[], const int srcStride[],
+                              int srcW, int srcH, AVPixelFormat srcFmt,
+                              int dstW, int dstH, AVPixelFormat dstFmt,
+                              uint8_t *const dstData[], const int dstStride[])
+{
+    if (!s.src)
+        return sws_scale(s.ctx, srcData, srcStride, 0, srcH, dstData, dstStride) > 0;
+
+#ifdef SWS_HAS_SLICE_API
+    bool ok = wrap_planes(s.src, srcData, srcStride, srcW, srcH, srcFmt) &&
+              wrap_planes(s.dst, dstData, dstStride, dstW, dstH, dstFmt) &&
+              sws_frame_start(s.ctx, s.dst, s.src) >= 0;
+    if (ok)
+    {
+        ok = sws_send_slice(s.ctx, 0, srcH) >= 0 &&
+             sws_receive_slice(s.ctx, s.dstY, s.dstH) >= 0;
+        sws_frame_end(s.ctx);
+    }
+    av_frame_unref(s.src);
+    av_frame_unref(s.dst);
+    return ok;
+#else
+    (void)srcW; (void)srcFmt; (void)dstW; (void)dstH; (void)dstFmt;
+    return false;
+#endif
+}
+
+bool sws_converter::convert(const AVFrame *src, int dstW, int dstH, AVPixelFormat dstFmt, int flags,
+                            uint8_t *const dstData[], const int dstStride[])
+{
+    return convert(src->data, src->linesize, src->width, src->height, (AVPixelFormat)src->format,
+                   dstW, dstH, dstFmt, flags, dstData, dstStride);
+}
+
+bool sws_converter::convert(const uint8_t *const srcData[], const int srcStride[],
+                            int srcW, int srcH, AVPixelFormat srcFmt,
+                            int dstW, int dstH, AVPixelFormat dstFmt, int flags,
+                            uint8_t *const dstData[], const int dstStride[])
+{
+    if (srcW <= 0 || srcH <= 0 || dstW <= 0 || dstH <= 0)
+        return false;
+
+    entry *e = lookup({ srcW, srcH, srcFmt, dstW, dstH, dstFmt, flags });
+    if (!e)
+        return false;
+
+    const int count = e->slices.size();
+    if (count == 1)
+        return run_slice(e->slices[0], srcData, srcStride, srcW, srcH, srcFmt, dstW, dstH, dstFmt, dstData, dstStride);
+
+    QSemaphore done;
+    std::atomic<bool> ok {true};
+    for (int i = 1; i < count; i++)
+    {
+        const slice s = e->slices[i];
+        m_pool.start([&, s]() {
+            if (!run_slice(s, srcData, srcStride, srcW, srcH, srcFmt, dstW, dstH, dstFmt, dstData, dstStride))
+                ok = false;
+            done.release();
+        });
+    }
+    if (!run_slice(e->slices[0], srcData, srcStride, srcW, srcH, srcFmt, dstW, dstH, dstFmt, dstData, dstStride))
+        ok = false;
+    done.acquire(count - 1);
+
+    return ok;
+}
+
+/**
+ * Compare per-frame context setup (the old preview path) with the cached
+ * single band and cached multi band conversion. Returns frames per second.
+ */
+sws_converter::benchmark_result sws_converter::benchmark(int srcW, int srcH, AVPixelFormat srcFmt,
+                                                         int dstW, int dstH, AVPixelFormat dstFmt,
+                                                         int frames, int threads)
+{
+    benchmark_result result;
+
+    AVFrame *src = av_frame_alloc();
+    src->width = srcW;
+    src->height = srcH;
+    src->format = srcFmt;
+    if (av_frame_get_buffer(src, 0) < 0)
+    {
+        av_frame_free(&src);
+        return result;
+    }
+    for (int p = 0; p < 4 && src->buf[p]; p++)
+        for (size_t i = 0; i < (size_t)src->buf[p]->size; i++)
+            src->buf[p]->data[i] = uint8_t(i * 7 + p * 31);
+
+    uint8_t *dstData[4] = { nullptr };
+    int dstStride[4] = { 0 };
+    if (av_image_alloc(dstData, dstStride, dstW, dstH, dstFmt, 32) < 0)
+    {
+        av_frame_free(&src);
+        return result;
+    }
+
+    QElapsedTimer timer;
+
+    timer.start();
+    for (int i = 0; i < frames; i++)
+    {
+        SwsContext *ctx = sws_getContext(srcW, srcH, srcFmt, dstW, dstH, dstFmt,
+                                         SWS_BILINEAR, nullptr, nullptr, nullptr);
+        sws_scale(ctx, src->data, src->linesize, 0, srcH, dstData, dstStride);
+        sws_freeContext(ctx);
+    }
+    result.perFrameFps = frames * 1e9 / qMax<qint64>(1, timer.nsecsElapsed());
+
+    {
+        sws_converter cached(1);
+        timer.restart();
+        for (int i = 0; i < frames; i++)
+            cached.convert(src, dstW, dstH, dstFmt, SWS_BILINEAR, dstData, dstStride);
+        result.cachedFps = frames * 1e9 / qMax<qint64>(1, timer.nsecsElapsed());
+    }
+
+    {
+        sws_converter sliced(threads);
+        timer.restart();
+        for (int i = 0; i < frames; i++)
+            sliced.convert(src, dstW, dstH, dstFmt, SWS_BILINEAR, dstData, dstStride);
+        result.slicedFps = frames * 1e9 / qMax<qint64>(1, timer.nsecsElapsed());
+    }
+
+    av_freep(&dstData[0]);
+    av_frame_free(&src);
+
+    return result;
+}
@@ -0,0 +1,125 @@
+#ifndef SWS_CONVERTER_H
+#define SWS_CONVERTER_H
+
+#include <QHash>
+#include <QList>
+#include <QThreadPool>
+#include <QElapsedTimer>
+#include <QRect>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include <libswscale/swscale.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+#ifdef __cplusplus
+};
+#endif
+
+#define SWS_MAX_SLICES      8
+#define SWS_DEFAULT_THREADS 4
+#define SWS_CACHE_MAX       8
+#define SWS_MIN_SLICE_ROWS  64
+
+struct sws_key
+{
+    int srcW;
+    int srcH;
+    AVPixelFormat srcFmt;
+    int dstW;
+    int dstH;
+    AVPixelFormat dstFmt;
+    int flags;
+
+    bool operator==(const sws_key &o) const
+    {
+        return srcW == o.srcW && srcH == o.srcH && srcFmt == o.srcFmt &&
+               dstW == o.dstW && dstH == o.dstH && dstFmt == o.dstFmt && flags == o.flags;
+    }
+};
+
+inline size_t qHash(const sws_key &k, size_t seed = 0)
+{
+    return qHashMulti(seed, k.srcW, k.srcH, int(k.srcFmt), k.dstW, k.dstH, int(k.dstFmt), k.flags);
+}
+
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+#define SWS_HAS_SLICE_API 1
+#endif
+
+// Pixel format conversion service for one session. SwsContexts are cached
+// per (src w/h/fmt, dst w/h/fmt, flags) instead of being created for every
+// frame, and the destination is cut into horizontal bands that are
+// converted in parallel. Every band has its own SwsContext set up for the
+// whole frame that only outputs the rows of its band, so the vertical
+// filter reads across band edges and leaves no seams. Without the slice
+// API of libswscale 6.1 a frame is converted as one band.
+class sws_converter
+{
+public:
+    explicit sws_converter(int threads = SWS_DEFAULT_THREADS);
+    ~sws_converter();
+
+    bool convert(const AVFrame *src, int dstW, int dstH, AVPixelFormat dstFmt, int flags,
+                 uint8_t *const dstData[], const int dstStride[]);
+    bool convert(const uint8_t *const srcData[], const int srcStride[],
+                 int srcW, int srcH, AVPixelFormat srcFmt,
+                 int dstW, int dstH, AVPixelFormat dstFmt, int flags,
+                 uint8_t *const dstData[], const int dstStride[]);
+
+    // Plane pointers for the sub-image starting at luma (x, y). x and y must
+    // sit on a chroma sample, see align_crop().
+    static void crop_planes(AVPixelFormat fmt, const uint8_t *const in[], const int stride[],
+                            int x, int y, const uint8_t *out[]);
+    static QRect align_crop(AVPixelFormat fmt, const QRect &crop, int width, int height);
+
+    void clear();
+    int threads() const { return m_threads; }
+    int cachedContexts() const { return m_cache.size(); }
+    quint64 cacheMisses() const { return m_misses; }
+
+    struct benchmark_result
+    {
+        double perFrameFps {0};
+        double cachedFps {0};
+        double slicedFps {0};
+    };
+    static benchmark_result benchmark(int srcW, int srcH, AVPixelFormat srcFmt,
+                                      int dstW, int dstH, AVPixelFormat dstFmt,
+                                      int frames, int threads = SWS_DEFAULT_THREADS);
+
+private:
+    struct slice
+    {
+        SwsContext *ctx {nullptr};
+        AVFrame *src {nullptr};         // wrap the caller's planes for the slice API
+        AVFrame *dst {nullptr};
+        int dstY {0};
+        int dstH {0};
+    };
+
+    struct entry
+    {
+        QList<slice> slices;
+        quint64 lastUse {0};
+    };
+
+    entry *lookup(const sws_key &key);
+    static void free_entry(entry *e);
+    static void offset_planes(AVPixelFormat fmt, const uint8_t *const in[], const int stride[],
+                              int y, const uint8_t *out[]);
+    static bool run_slice(const slice &s, const uint8_t *const srcData[], const int srcStride[],
+                          int srcW, int srcH, AVPixelFormat srcFmt,
+                          int dstW, int dstH, AVPixelFormat dstFmt,
+                          uint8_t *const dstData[], const int dstStride[]);
+
+    int m_threads;
+    QThreadPool m_pool;
+    QHash<sws_key, entry*> m_cache;
+    quint64 m_useCounter {0};
+    quint64 m_misses {0};
+};
+
+#endif // SWS_CONVERTER_H
@@ -0,0 +1,72 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+
+#define TRIPLE_BUFFER_CACHE_LINE 64
+
+// Wait-free latest-value exchange between one producer and one consumer.
+// The producer fills writeBuffer() and publish()es it, the consumer calls
+// update() and reads readBuffer() until its next update(). Three buffers
+// rotate through an atomic middle slot, so neither side ever waits for the
+// other and the consumer never sees a half written value. A value that is
+// published again before the consumer picked up the previous one replaces
+// it; T is reused, not reallocated, so buffers keep their capacity.
+template <typename T>
+class triple_buffer
+{
+public:
+    triple_buffer() = default;
+
+    triple_buffer(const triple_buffer&) = delete;
+    triple_buffer& operator=(const triple_buffer&) = delete;
+
+    // Producer side
+    T &writeBuffer() { return m_buffers[m_back]; }
+
+    // Returns false if the previously published value was never read
+    bool publish()
+    {
+        int prev = m_middle.exchange(m_back | FRESH, std::memory_order_acq_rel);
+        m_back = prev & INDEX;
+        m_published.fetch_add(1, std::memory_order_relaxed);
+        if (prev & FRESH)
+        {
+            m_overwritten.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    // True while a published value waits for the consumer, from any thread
+    bool pending() const { return m_middle.load(std::memory_order_acquire) & FRESH; }
+
+    // Consumer side. Returns true if a newer value is now in readBuffer().
+    bool update()
+    {
+        if (!(m_middle.load(std::memory_order_relaxed) & FRESH))
+            return false;
+
+        int prev = m_middle.exchange(m_front, std::memory_order_acq_rel);
+        m_front = prev & INDEX;
+        return true;
+    }
+
+    const T &readBuffer() const { return m_buffers[m_front]; }
+
+    uint64_t published() const { return m_published.load(std::memory_order_relaxed); }
+    uint64_t overwritten() const { return m_overwritten.load(std::memory_order_relaxed); }
+
+private:
+    enum { INDEX = 3, FRESH = 4 };
+
+    T m_buffers[3];
+    int m_back {0};                                                 // producer only
+    alignas(TRIPLE_BUFFER_CACHE_LINE) std::atomic<int> m_middle {1};
+    alignas(TRIPLE_BUFFER_CACHE_LINE) int m_front {2};               // consumer only
+    std::atomic<uint64_t> m_published {0};
+    std::atomic<uint64_t> m_overwritten {0};
+};
+
+#endif // TRIPLE_BUFFER_H
@@ -5,19 +5,53 @@ QT += multimedia multimediawidgets widgets network
 
 HEADERS = \
     Plotter.h \
+    audio_buffer.h \
+    audio_converter.h \
+    audio_ring.h \
+    benchmark.h \
     ffmpeg_rtmp.h \
+    mailbox.h \
+    peak_detector.h \
+    plot_renderer.h \
+    spectrum_frame.h \
+    spectrum_kernels.h \
+    spectrum_pyramid.h \
+    spectrum_worker.h \
+    spsc_queue.h \
+    triple_buffer.h \
+    waterfall_history.h \
+    sws_converter.h \
+    flv_pipe.h \
+    headless.h \
+    rtmp_server.h \
     imagesettings.h \
     rtmp.h \
     videosettings.h \
+    videosurface.h \
     metadatadialog.h
 
 SOURCES = \
     Plotter.cpp \
+    audio_buffer.cpp \
+    audio_converter.cpp \
+    audio_ring.cpp \
+    benchmark.cpp \
     main.cpp \
     ffmpeg_rtmp.cpp \
+    flv_pipe.cpp \
+    headless.cpp \
+    peak_detector.cpp \
+    plot_renderer.cpp \
+    sws_converter.cpp \
+    rtmp_server.cpp \
+    spectrum_kernels.cpp \
+    spectrum_pyramid.cpp \
+    spectrum_worker.cpp \
+    waterfall_history.cpp \
     imagesettings.cpp \
     rtmp.cpp \
     videosettings.cpp \
+    videosurface.cpp \
     metadatadialog.cpp
 
 FORMS += \
@@ -49,6 +83,7 @@ unix:!macx {
     INCLUDEPATH += /usr/include/x86_64-linux-gnu/libavformat
     INCLUDEPATH += /usr/include/x86_64-linux-gnu/libavfilter
     LIBS += -L/usr/include/x86_64-linux-gnu/ -lavformat -lavcodec -lavutil -lavfilter -lswscale -lswresample
+    LIBS += -lfftw3f
 }
 
 unix:macx {
@@ -58,7 +93,7 @@ unix:macx {
     INCLUDEPATH += $$HOMEBREW_CELLAR_PATH/ffmpeg/7.0.1/include
     INCLUDEPATH += $$HOMEBREW_CELLAR_PATH/fftw/3.3.10_1/include
     LIBS += -L$$HOMEBREW_CELLAR_PATH/ffmpeg/7.0.1/lib -lavformat -lavcodec -lavutil -lavfilter -lswscale -lswresample
-    LIBS += -L$$HOMEBREW_CELLAR_PATH/fftw/3.3.10_1/lib -lfftw3
+    LIBS += -L$$HOMEBREW_CELLAR_PATH/fftw/3.3.10_1/lib -lfftw3 -lfftw3f
 }
 
 RESOURCES += camera.qrc
@@ -72,5 +107,6 @@ include(./shared/shared.pri)
 ANDROID_PACKAGE_SOURCE_DIR = $$PWD/android
 OTHER_FILES += android/AndroidManifest.xml
 
-# ffmpeg -re -i test.flv  -vcodec libx264 -preset fast -crf 30 -acodec aac -ab 128k -ar 44100 -strict experimental -f flv rtmp://192.168.1.9:8889/live
-# ffmpeg -re -i test.flv  -vcodec libx264 -preset fast -crf 30 -acodec aac -ab 128k -ar 44100 -strict experimental -f flv rtmp://172.26.241.24:8889/live
+# ffmpeg -re -i test.flv  -vcodec libx264 -preset fast -crf 30 -acodec aac -ab 128k -ar 44100 -strict experimental -f flv rtmp://192.168.1.9:8889/live/cam1
+# ffmpeg -re -i test.flv  -vcodec libx264 -preset fast -crf 30 -acodec aac -ab 128k -ar 44100 -strict experimental -f flv rtmp://172.26.241.24:8889/live/cam2
+# video_process_ai --headless --port 8889 --output-dir /srv/recordings --stats-interval 10
@@ -0,0 +1,161 @@
+#include "videosurface.h"
+
+#include <QPainter>
+#include <QPaintEvent>
+#include <QWheelEvent>
+#include <QMouseEvent>
+
+VideoSurface::VideoSurface(QWidget *parent)
+    : QWidget(parent)
+{
+    // Everything is painted by us, no background erase before each frame
+    setAttribute(Qt::WA_OpaquePaintEvent);
+    setAttribute(Qt::WA_NoSystemBackground);
+    setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
+}
+
+void VideoSurface::setFrame(const QImage &image)
+{
+    if (image.isNull())
+        return;
+
+    bool geometryChanged = image.size() != m_frame.size();
+
+    // Shallow, the decoder converts into a small ring of images at viewport
+    // resolution and already tags them for this screen. Retagging a shared
+    // image deep copies it, so only do that after a screen change
+    m_frame = image;
+    if (m_frame.devicePixelRatio() != devicePixelRatioF())
+        m_frame.setDevicePixelRatio(devicePixelRatioF());
+    m_frames++;
+
+    if (geometryChanged)
+    {
+        updateTarget();
+        update();
+    }
+    else
+    {
+        update(m_target);
+    }
+}
+
+void VideoSurface::clear()
+{
+    m_frame = QImage();
+    m_target = QRect();
+    m_fillBorders = true;
+    update();
+}
+
+QSize VideoSurface::viewportSize() const
+{
+    return size() * devicePixelRatioF();
+}
+
+void VideoSurface::resetZoom()
+{
+    m_crop = QRectF(0, 0, 1, 1);
+    emit viewportChanged(viewportSize(), m_crop);
+}
+
+void VideoSurface::wheelEvent(QWheelEvent *event)
+{
+    if (m_target.isEmpty() || event->angleDelta().y() == 0)
+        return;
+
+    double factor = event->angleDelta().y() > 0 ? 1.0 / VIDEOSURFACE_ZOOM_STEP : VIDEOSURFACE_ZOOM_STEP;
+    double w = qBound(1.0 / VIDEOSURFACE_ZOOM_MAX, m_crop.width() * factor, 1.0);
+    double h = qBound(1.0 / VIDEOSURFACE_ZOOM_MAX, m_crop.height() * factor, 1.0);
+
+    // Keep the source point under the cursor where it is
+    QPointF pos = event->position();
+    double u = qBound(0.0, (pos.x() - m_target.x()) / m_target.width(), 1.0);
+    double v = qBound(0.0, (pos.y() - m_target.y()) / m_target.height(), 1.0);
+    double sx = m_crop.x() + u * m_crop.width();
+    double sy = m_crop.y() + v * m_crop.height();
+
+    double x = qBound(0.0, sx - u * w, 1.0 - w);
+    double y = qBound(0.0, sy - v * h, 1.0 - h);
+    m_crop = QRectF(x, y, w, h);
+
+    emit viewportChanged(viewportSize(), m_crop);
+    event->accept();
+}
+
+void VideoSurface::mouseDoubleClickEvent(QMouseEvent *event)
+{
+    resetZoom();
+    event->accept();
+}
+
+void VideoSurface::updateTarget()
+{
+    if (m_frame.isNull())
+    {
+        m_target = QRect();
+    }
+    else
+    {
+        QSize scaled = m_frame.deviceIndependentSize().toSize().scaled(size(), Qt::KeepAspectRatio);
+        m_target = QRect(QPoint((width() - scaled.width()) / 2, (height() - scaled.height()) / 2), scaled);
+    }
+    m_fillBorders = true;
+}
+
+void VideoSurface::resizeEvent(QResizeEvent *)
+{
+    updateTarget();
+    emit viewportChanged(viewportSize(), m_crop);
+}
+
+void VideoSurface::paintEvent(QPaintEvent *event)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QPainter painter(this);
+
+    // Letterbox borders only need painting after a geometry change or expose
+    if (m_fillBorders || !m_target.contains(event->rect()))
+    {
+        QRegion borders = QRegion(event->rect()).subtracted(m_target);
+        for (const QRect &r : borders)
+            painter.fillRect(r, Qt::black);
+        m_fillBorders = false;
+    }
+
+    if (!m_frame.isNull())
+    {
+        // 1:1 is a plain blit, anything else goes through the scaler
+        if (m_target.size() == m_frame.deviceIndependentSize().toSize())
+            painter.drawImage(m_target.topLeft(), m_frame);
+        else
+            painter.drawImage(m_target, m_frame);
+    }
+
+    m_lastPaintNs = timer.nsecsElapsed();
+    m_maxPaintNs = qMax(m_maxPaintNs, m_lastPaintNs);
+    m_totalPaintNs += m_lastPaintNs;
+    m_paints++;
+}
+
+VideoSurface::paint_stats VideoSurface::stats() const
+{
+    paint_stats st;
+    st.frames = m_frames;
+    st.paints = m_paints;
+    st.lastPaintUs = m_lastPaintNs / 1000;
+    st.maxPaintUs = m_maxPaintNs / 1000;
+    st.avgPaintUs = m_paints ? m_totalPaintNs / 1000.0 / m_paints : 0;
+    return st;
+}
+
+void VideoSurface::resetStats()
+{
+    m_frames = 0;
+    m_paints = 0;
+    m_lastPaintNs = 0;
+    m_maxPaintNs = 0;
+    m_totalPaintNs = 0;
+}
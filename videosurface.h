@@ -0,0 +1,68 @@
+#ifndef VIDEOSURFACE_H
+#define VIDEOSURFACE_H
+
+#define VIDEOSURFACE_ZOOM_STEP  1.25
+#define VIDEOSURFACE_ZOOM_MAX   16.0
+
+#include <QWidget>
+#include <QImage>
+#include <QElapsedTimer>
+
+// Raster preview widget. Holds the latest frame and draws it letterboxed
+// into the widget; the target rectangle is only recomputed when the widget
+// or the frame geometry changes, and only that rectangle is repainted for a
+// new frame. The wheel zooms into a region of the source, double click
+// resets; the producer is told about both through viewportChanged() so it
+// can convert straight to what is shown.
+class VideoSurface : public QWidget
+{
+    Q_OBJECT
+
+public:
+    explicit VideoSurface(QWidget *parent = nullptr);
+
+    void setFrame(const QImage &image);
+    void clear();
+
+    // Size in device pixels available for the frame
+    QSize viewportSize() const;
+    // Normalized region of the source frame that is shown
+    QRectF cropRect() const { return m_crop; }
+    void resetZoom();
+
+    struct paint_stats
+    {
+        quint64 frames {0};
+        quint64 paints {0};
+        qint64  lastPaintUs {0};
+        qint64  maxPaintUs {0};
+        double  avgPaintUs {0};
+    };
+    paint_stats stats() const;
+    void resetStats();
+
+signals:
+    void viewportChanged(QSize, QRectF);
+
+protected:
+    void paintEvent(QPaintEvent *event) override;
+    void resizeEvent(QResizeEvent *event) override;
+    void wheelEvent(QWheelEvent *event) override;
+    void mouseDoubleClickEvent(QMouseEvent *event) override;
+
+private:
+    void updateTarget();
+
+    QImage m_frame;
+    QRect m_target;
+    QRectF m_crop {0, 0, 1, 1};
+    bool m_fillBorders {true};
+
+    quint64 m_frames {0};
+    quint64 m_paints {0};
+    qint64 m_lastPaintNs {0};
+    qint64 m_maxPaintNs {0};
+    qint64 m_totalPaintNs {0};
+};
+
+#endif // VIDEOSURFACE_H
@@ -0,0 +1,373 @@
+#include "waterfall_history.h"
+
+#include <QStandardPaths>
+#include <QDir>
+#include <QFileInfo>
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Quantized value 0 marks a column no spectrum covered, levels 1..255 span the dB range
+#define HISTORY_LEVELS  254
+
+waterfall_history::~waterfall_history()
+{
+    close();
+}
+
+QString waterfall_history::pathFor(const QString &stream)
+{
+    QString name = stream;
+    for (QChar &c : name)
+        if (!c.isLetterOrNumber() && c != '-' && c != '_')
+            c = '_';
+
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    return QDir(dir).filePath("waterfall/" + name + WATERFALL_HISTORY_SUFFIX);
+}
+
+bool waterfall_history::open(const QString &path, int columns, int capacity)
+{
+    QMutexLocker locker(&m_lock);
+    unmap();
+
+    if (columns <= 0 || capacity <= 0)
+        return false;
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::ReadWrite))
+    {
+        qWarning() << "Can not open waterfall history" << path << m_file.errorString();
+        return false;
+    }
+
+    // Lines stay 8 byte aligned for their timestamps
+    m_lineSize = sizeof(line_header) + ((columns + 7) & ~7);
+    const qint64 size = sizeof(file_header) + (qint64)capacity * m_lineSize;
+
+    file_header header;
+    bool reuse = m_file.size() == size &&
+                 m_file.read(reinterpret_cast<char *>(&header), sizeof(header)) == sizeof(header) &&
+                 memcmp(header.magic, WATERFALL_HISTORY_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.columns == (quint32)columns && header.capacity == (quint32)capacity &&
+                 header.minDb == WATERFALL_HISTORY_MIN_DB && header.maxDb == WATERFALL_HISTORY_MAX_DB &&
+                 header.lineMs == WATERFALL_HISTORY_LINE_MS;
+
+    // A history of another layout is started over
+    if (!reuse && (!m_file.resize(0) || !m_file.resize(size)))
+    {
+        qWarning() << "Can not size waterfall history" << path << m_file.errorString();
+        m_file.close();
+        return false;
+    }
+
+    m_map = m_file.map(0, size);
+    if (!m_map)
+    {
+        qWarning() << "Can not map waterfall history" << path << m_file.errorString();
+        m_file.close();
+        return false;
+    }
+
+    m_header = reinterpret_cast<file_header *>(m_map);
+    if (!reuse)
+    {
+        memcpy(m_header->magic, WATERFALL_HISTORY_MAGIC, sizeof(m_header->magic));
+        m_header->columns = columns;
+        m_header->capacity = capacity;
+        m_header->written = 0;
+        m_header->minDb = WATERFALL_HISTORY_MIN_DB;
+        m_header->maxDb = WATERFALL_HISTORY_MAX_DB;
+        m_header->lineMs = WATERFALL_HISTORY_LINE_MS;
+        m_header->reserved = 0;
+    }
+
+    m_pending.assign(columns, -INFINITY);
+    m_pendingFrames = 0;
+    return true;
+}
+
+void waterfall_history::close()
+{
+    QMutexLocker locker(&m_lock);
+    unmap();
+}
+
+// Writes out what is pending and releases the file, m_lock held
+void waterfall_history::unmap()
+{
+    if (m_map)
+    {
+        if (m_pendingFrames)
+            flush_line();
+        m_file.unmap(m_map);
+    }
+    m_file.close();
+    m_map = nullptr;
+    m_header = nullptr;
+    m_generation++;
+}
+
+bool waterfall_history::isOpen() const
+{
+    QMutexLocker locker(&m_lock);
+    return m_header != nullptr;
+}
+
+QString waterfall_history::fileName() const
+{
+    QMutexLocker locker(&m_lock);
+    return m_file.fileName();
+}
+
+/**
+ * Peak-hold a spectrum into the pending line, which is written once it
+ * covers the line period or the band changes. Each column takes the
+ * largest of the bins centered in it, columns narrower than a bin take the
+ * nearest bin.
+ */
+void waterfall_history::addFrame(const spectrum_frame &frame)
+{
+    QMutexLocker locker(&m_lock);
+    const std::vector<float> &peak = frame.peak.empty() ? frame.average : frame.peak;
+    const int bins = (int)peak.size();
+    if (!m_header || frame.sampleRate <= 0 || bins == 0)
+        return;
+
+    const float maxFreq = frame.sampleRate / 2.0f;
+    if (m_pendingFrames &&
+        (maxFreq != m_pendingMaxFreq || frame.timestamp - m_pendingStart >= m_header->lineMs))
+        flush_line();
+
+    if (!m_pendingFrames)
+    {
+        m_pendingStart = frame.timestamp;
+        m_pendingMaxFreq = maxFreq;
+    }
+    m_pendingTime = frame.timestamp;
+    m_pendingFrames++;
+
+    // Bin i is centered on first + i * step Hz
+    const int columns = m_header->columns;
+    const double first = frame.bandWidth > 0 ? frame.bandStart : 0.0;
+    const double step = frame.bandWidth > 0 ? frame.bandWidth / bins : (double)maxFreq / bins;
+    const double hzPerColumn = (double)maxFreq / columns;
+
+    for (int c = 0; c < columns; c++)
+    {
+        int b0 = qMax(0, (int)std::ceil((c * hzPerColumn - first) / step));
+        int b1 = qMin(bins, (int)std::ceil(((c + 1) * hzPerColumn - first) / step));
+        float v;
+        if (b0 < b1)
+        {
+            v = peak[b0];
+            for (int i = b0 + 1; i < b1; i++)
+                v = std::max(v, peak[i]);
+        }
+        else
+        {
+            int i = (int)std::lround(((c + 0.5) * hzPerColumn - first) / step);
+            if (i < 0 || i >= bins)
+                continue;
+            v = peak[i];
+        }
+        m_pending[c] = std::max(m_pending[c], v);
+    }
+}
+
+// Quantize the pending line into the oldest slot, m_lock held
+void waterfall_history::flush_line()
+{
+    const quint64 n = stored();
+    const quint64 slot = m_header->written % m_header->capacity;
+    uchar *p = m_map + sizeof(file_header) + slot * m_lineSize;
+    line_header *header = reinterpret_cast<line_header *>(p);
+    uchar *values = p + sizeof(line_header);
+
+    // Lines stay in time order for the lookups even if the clock steps back
+    qint64 t = m_pendingTime;
+    if (n > 0)
+        t = qMax(t, line(n - 1)->timestamp);
+
+    const float minDb = m_header->minDb;
+    const float scale = HISTORY_LEVELS / (m_header->maxDb - minDb);
+    const int columns = m_header->columns;
+    for (int c = 0; c < columns; c++)
+    {
+        const float v = m_pending[c];
+        values[c] = std::isinf(v) ? 0 : (uchar)(1 + qBound(0, (int)std::lround((v - minDb) * scale), HISTORY_LEVELS));
+        m_pending[c] = -INFINITY;
+    }
+
+    header->timestamp = t;
+    header->maxFreq = m_pendingMaxFreq;
+    header->frames = m_pendingFrames;
+    m_header->written++;
+    m_pendingFrames = 0;
+}
+
+quint64 waterfall_history::stored() const
+{
+    return m_header ? qMin(m_header->written, (quint64)m_header->capacity) : 0;
+}
+
+const waterfall_history::line_header *waterfall_history::line(quint64 index) const
+{
+    const quint64 slot = (m_header->written - stored() + index) % m_header->capacity;
+    return reinterpret_cast<const line_header *>(m_map + sizeof(file_header) + slot * m_lineSize);
+}
+
+// Index of the first stored line at or after t
+quint64 waterfall_history::lower_bound(qint64 t) const
+{
+    quint64 lo = 0;
+    quint64 hi = stored();
+    while (lo < hi)
+    {
+        const quint64 mid = lo + (hi - lo) / 2;
+        if (line(mid)->timestamp < t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int waterfall_history::lines() const
+{
+    QMutexLocker locker(&m_lock);
+    return (int)stored();
+}
+
+bool waterfall_history::timeRange(qint64 *first, qint64 *last) const
+{
+    QMutexLocker locker(&m_lock);
+    const quint64 n = stored();
+    if (n == 0)
+        return false;
+
+    *first = line(0)->timestamp;
+    *last = line(n - 1)->timestamp;
+    return true;
+}
+
+int waterfall_history::linesBetween(qint64 from, qint64 to) const
+{
+    QMutexLocker locker(&m_lock);
+    if (!m_header || to <= from)
+        return 0;
+    return (int)(lower_bound(to) - lower_bound(from));
+}
+
+bool waterfall_history::render(qint64 from, qint64 to, double startFreq, double stopFreq,
+                               int width, int rows, spectrum_statistic stat, std::vector<float> &db) const
+{
+    db.assign((size_t)qMax(0, width) * qMax(0, rows), -INFINITY);
+    if (width <= 0 || rows <= 0 || to <= from || stopFreq <= startFreq)
+        return false;
+
+    QMutexLocker locker(&m_lock);
+    if (!m_header)
+        return false;
+
+    // The file may be reopened while the lock is released between rows,
+    // the rest of the render then stops
+    const quint64 generation = m_generation;
+    const int columns = m_header->columns;
+    const float minDb = m_header->minDb;
+    const float dbPerLevel = (m_header->maxDb - minDb) / HISTORY_LEVELS;
+    auto toDb = [=](float level) { return minDb + (level - 1) * dbPerLevel; };
+
+    // Column runs of the pixels, rebuilt when the band of the lines changes
+    std::vector<int> edges(width + 1);
+    float edgesFreq = 0;
+    std::vector<float> sum(width);
+    std::vector<int> count(width);
+
+    for (int r = 0; r < rows; r++)
+    {
+        // One row at a time under the lock, so a long export never holds
+        // up the writer on the analyzer thread for more than a row. Rows
+        // find their lines by time, new lines in between do not move them.
+        if (r > 0)
+        {
+            locker.unlock();
+            locker.relock();
+            if (m_generation != generation || !m_header)
+                return false;
+        }
+
+        const qint64 hi = to - (qint64)((double)(to - from) * r / rows);
+        const qint64 lo = to - (qint64)((double)(to - from) * (r + 1) / rows);
+        const quint64 end = lower_bound(hi);
+        float *out = &db[(size_t)r * width];
+
+        std::fill(sum.begin(), sum.end(), 0.0f);
+        std::fill(count.begin(), count.end(), 0);
+
+        for (quint64 i = lower_bound(lo); i < end; i++)
+        {
+            const line_header *header = line(i);
+            const uchar *values = reinterpret_cast<const uchar *>(header) + sizeof(line_header);
+
+            if (header->maxFreq != edgesFreq)
+            {
+                edgesFreq = header->maxFreq;
+                const double columnsPerHz = columns / (double)edgesFreq;
+                for (int x = 0; x <= width; x++)
+                    edges[x] = (int)std::floor((startFreq + (stopFreq - startFreq) * x / width) * columnsPerHz);
+            }
+
+            for (int x = 0; x < width; x++)
+            {
+                const int c0 = qMax(0, edges[x]);
+                const int c1 = qMin(columns, qMax(edges[x] + 1, edges[x + 1]));
+                if (c0 >= c1)
+                    continue;
+
+                // Columns of the pixel first, 0 is no data
+                int level = 0;
+                int levels = 0;
+                int levelSum = 0;
+                for (int c = c0; c < c1; c++)
+                {
+                    const int v = values[c];
+                    if (v == 0)
+                        continue;
+                    if (!levels || (stat == SPECTRUM_STAT_MIN ? v < level : v > level))
+                        level = v;
+                    levelSum += v;
+                    levels++;
+                }
+                if (!levels)
+                    continue;
+
+                // then the lines of the row
+                const float v = toDb(stat == SPECTRUM_STAT_MEAN ? (float)levelSum / levels : (float)level);
+                switch (stat)
+                {
+                case SPECTRUM_STAT_MAX:
+                    out[x] = std::max(out[x], v);
+                    break;
+                case SPECTRUM_STAT_MIN:
+                    out[x] = count[x] ? std::min(out[x], v) : v;
+                    count[x]++;
+                    break;
+                case SPECTRUM_STAT_MEAN:
+                    sum[x] += v;
+                    count[x]++;
+                    break;
+                }
+            }
+        }
+
+        if (stat == SPECTRUM_STAT_MEAN)
+            for (int x = 0; x < width; x++)
+                if (count[x])
+                    out[x] = sum[x] / count[x];
+    }
+
+    return true;
+}
@@ -0,0 +1,112 @@
+#ifndef WATERFALL_HISTORY_H
+#define WATERFALL_HISTORY_H
+
+#include <QFile>
+#include <QMutex>
+#include <QString>
+#include <vector>
+
+#include "spectrum_frame.h"
+#include "spectrum_pyramid.h"
+
+#define WATERFALL_HISTORY_MAGIC     "WFHIST01"
+#define WATERFALL_HISTORY_COLUMNS   1024
+#define WATERFALL_HISTORY_LINES     72000   // 4 hours at the default line period
+#define WATERFALL_HISTORY_LINE_MS   200
+#define WATERFALL_HISTORY_MIN_DB    -140.0f
+#define WATERFALL_HISTORY_MAX_DB    20.0f
+#define WATERFALL_HISTORY_SUFFIX    ".wfh"
+
+// Long term waterfall of one stream, kept in a memory-mapped circular file
+// so it survives restarts and costs no heap however long it is.
+//
+// Spectra are peak-held into one line per WATERFALL_HISTORY_LINE_MS, each
+// line holds a fixed number of columns spanning the stream's one-sided
+// band, quantized to 8 bits of dB between WATERFALL_HISTORY_MIN_DB and
+// WATERFALL_HISTORY_MAX_DB. Zoomed spectra only fill the columns of their
+// band. Once the file is full the oldest line is overwritten.
+//
+// Any time window and frequency range can be rendered back at any size,
+// combining the lines and columns that fall on a value with a peak, minimum
+// or mean, without the audio. The analyzer thread writes while the GUI
+// reads; both go through one lock, held for a line write or one row of a
+// render.
+class waterfall_history
+{
+public:
+    waterfall_history() = default;
+    ~waterfall_history();
+
+    waterfall_history(const waterfall_history&) = delete;
+    waterfall_history& operator=(const waterfall_history&) = delete;
+
+    // Maps path, continuing an existing history if it has the same layout
+    bool open(const QString &path, int columns = WATERFALL_HISTORY_COLUMNS,
+              int capacity = WATERFALL_HISTORY_LINES);
+    void close();
+    bool isOpen() const;
+    QString fileName() const;
+
+    // History file of a stream key in the application data directory
+    static QString pathFor(const QString &stream);
+
+    // Writer side, folds a spectrum into the pending line
+    void addFrame(const spectrum_frame &frame);
+
+    int lines() const;
+    // Times of the oldest and newest stored line, false while empty
+    bool timeRange(qint64 *first, qint64 *last) const;
+    // Stored lines with a time in [from, to)
+    int linesBetween(qint64 from, qint64 to) const;
+
+    /**
+     * Values in dB of the lines in [from, to) on rows x width, newest row
+     * first. Row r covers the r-th slice of the window counted back from
+     * to, pixel x the x-th slice of [startFreq, stopFreq) in Hz. Values
+     * without any data are -infinity.
+     */
+    bool render(qint64 from, qint64 to, double startFreq, double stopFreq,
+                int width, int rows, spectrum_statistic stat, std::vector<float> &db) const;
+
+private:
+    struct file_header
+    {
+        char    magic[8];
+        quint32 columns;
+        quint32 capacity;
+        quint64 written;            // lines ever written, the next goes to written % capacity
+        float   minDb;
+        float   maxDb;
+        quint32 lineMs;
+        quint32 reserved;
+    };
+
+    struct line_header
+    {
+        qint64  timestamp;          // ms since epoch of the newest spectrum in the line
+        float   maxFreq;            // Hz of the right edge of the last column
+        quint32 frames;             // spectra peak-held into the line
+    };
+
+    void unmap();
+    void flush_line();
+    const line_header *line(quint64 index) const;    // index counts from the oldest stored line
+    quint64 stored() const;
+    quint64 lower_bound(qint64 t) const;
+
+    mutable QMutex m_lock;
+    QFile m_file;
+    uchar *m_map {nullptr};
+    file_header *m_header {nullptr};
+    qsizetype m_lineSize {0};
+    quint64 m_generation {0};       // counts unmaps, a render that let go of the lock checks it
+
+    // Pending line, writer only
+    std::vector<float> m_pending;
+    qint64 m_pendingStart {0};
+    qint64 m_pendingTime {0};
+    float m_pendingMaxFreq {0};
+    quint32 m_pendingFrames {0};
+};
+
+#endif // WATERFALL_HISTORY_H